@@ -0,0 +1,293 @@
+/*
+ * nvme-bench.c -- microbenchmarks for the nvme utility's own hot paths.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The functions measured are static to nvme.c, so it is built into this
+ * program with its main() renamed. Anything a benchmark prints goes to
+ * /dev/null; results go to the original stdout.
+ */
+
+#define main nvme_main
+#include "nvme.c"
+#undef main
+
+#define BENCH_EMU	EMU_PREFIX "size=1M,clock=virtual"
+
+struct bench {
+	const char *name;
+	void (*fn)(void);
+	unsigned int bytes;	/* processed per op, 0 if not meaningful */
+};
+
+static unsigned char bench_buf[4096];
+static struct nvme_id_ctrl bench_ctrl;
+static struct nvme_smart_log bench_smart;
+static int bench_fd = -1;
+static char *bench_dev = BENCH_EMU;
+static unsigned char bench_fill[128 << 10];
+static struct data_pattern bench_pat[3];
+
+static void bench_d(void)
+{
+	d(bench_buf, sizeof(bench_buf), 16, 1);
+}
+
+static void bench_d_raw(void)
+{
+	d_raw(bench_buf, sizeof(bench_buf));
+}
+
+static void bench_id_ctrl(void)
+{
+	show_nvme_id_ctrl(&bench_ctrl, 0);
+}
+
+static void bench_smart_log(void)
+{
+	show_smart_log(&bench_smart, 0xffffffff);
+}
+
+static void bench_u128(void)
+{
+	char buf[U128_STR_LEN];
+
+	u128_to_str(int128_to_u128(bench_smart.data_units_read), buf, 0);
+}
+
+static void bench_u128_group(void)
+{
+	char buf[U128_STR_LEN];
+
+	u128_to_str(int128_to_u128(bench_smart.data_units_read), buf, 1);
+}
+
+static void bench_status(void)
+{
+	static const __u32 codes[] = {
+		NVME_SC_SUCCESS, NVME_SC_INVALID_FIELD, NVME_SC_LBA_RANGE,
+		NVME_SC_INVALID_LOG_PAGE, NVME_SC_COMPARE_FAILED, 0x7ff,
+	};
+	static unsigned int i;
+	volatile const char *s;
+
+	s = nvme_status_to_string(codes[i++ % ARRAY_SIZE(codes)]);
+	(void)s;
+}
+
+static void bench_parse_fields(void)
+{
+	const struct field_desc *sel[ARRAY_SIZE(smart_log_fields)];
+	char list[] = "temperature,available_spare,media_errors,power_cycles";
+
+	parse_fields(list, smart_log_fields, ARRAY_SIZE(smart_log_fields), sel);
+}
+
+static void bench_parse_alert(void)
+{
+	struct alert_rule r;
+
+	parse_alert("temperature > wctemp-5 hyst=2 for=3", &r,
+			smart_log_fields, ARRAY_SIZE(smart_log_fields),
+			alert_ctrl_fields, ARRAY_SIZE(alert_ctrl_fields));
+}
+
+/* a whole command: option parsing, open, one ioctl and printing */
+static void bench_smart_cmd(void)
+{
+	char *argv[] = { "smart-log", bench_dev, "--fields=temperature",
+								NULL };
+
+	get_smart_log(3, argv);
+	nvme_close(fd);
+}
+
+static void bench_ioctl_identify(void)
+{
+	identify(bench_fd, 0, &bench_ctrl, 1);
+}
+
+static void bench_ioctl_io(__u8 opcode, void *buf, unsigned int len)
+{
+	struct nvme_user_io io;
+
+	memset(&io, 0, sizeof(io));
+	io.opcode = opcode;
+	io.addr = (unsigned long)buf;
+	io.nblocks = len / 512 - 1;
+	nvme_ioctl(bench_fd, NVME_IOCTL_SUBMIT_IO, &io);
+}
+
+static void bench_ioctl_read(void)
+{
+	bench_ioctl_io(nvme_cmd_read, bench_buf, sizeof(bench_buf));
+}
+
+static void bench_ioctl_write(void)
+{
+	bench_ioctl_io(nvme_cmd_write, bench_buf, sizeof(bench_buf));
+}
+
+static void bench_ioctl_read_128k(void)
+{
+	bench_ioctl_io(nvme_cmd_read, bench_fill, sizeof(bench_fill));
+}
+
+static void bench_ioctl_write_128k(void)
+{
+	bench_ioctl_io(nvme_cmd_write, bench_fill, sizeof(bench_fill));
+}
+
+static void bench_fill_random(void)
+{
+	fill_pattern(&bench_pat[0], bench_fill, sizeof(bench_fill));
+}
+
+static void bench_fill_compress(void)
+{
+	fill_pattern(&bench_pat[1], bench_fill, sizeof(bench_fill));
+}
+
+static void bench_fill_dedupe(void)
+{
+	fill_pattern(&bench_pat[2], bench_fill, sizeof(bench_fill));
+}
+
+static struct bench benches[] = {
+	{ "d", bench_d, sizeof(bench_buf) },
+	{ "d_raw", bench_d_raw, sizeof(bench_buf) },
+	{ "show_nvme_id_ctrl", bench_id_ctrl, sizeof(bench_ctrl) },
+	{ "show_smart_log", bench_smart_log, sizeof(bench_smart) },
+	{ "u128_to_str", bench_u128, 0 },
+	{ "u128_to_str_grouped", bench_u128_group, 0 },
+	{ "nvme_status_to_string", bench_status, 0 },
+	{ "parse_fields", bench_parse_fields, 0 },
+	{ "parse_alert", bench_parse_alert, 0 },
+	{ "smart-log_command", bench_smart_cmd, 0 },
+	{ "ioctl_identify", bench_ioctl_identify, 4096 },
+	{ "ioctl_read_4k", bench_ioctl_read, sizeof(bench_buf) },
+	{ "ioctl_write_4k", bench_ioctl_write, sizeof(bench_buf) },
+	{ "ioctl_read_128k", bench_ioctl_read_128k, sizeof(bench_fill) },
+	{ "ioctl_write_128k", bench_ioctl_write_128k, sizeof(bench_fill) },
+	{ "fill_pattern_random", bench_fill_random, sizeof(bench_fill) },
+	{ "fill_pattern_compress2", bench_fill_compress, sizeof(bench_fill) },
+	{ "fill_pattern_dedupe50", bench_fill_dedupe, sizeof(bench_fill) },
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs one op. Commands under test run their own getopt, so its state is
+ * reset before and restored after, leaving the driver's untouched.
+ */
+static void bench_op(struct bench *b)
+{
+	int saved = optind;
+
+	optind = 0;
+	b->fn();
+	optind = saved;
+}
+
+/* Doubles the iteration count until a run takes at least 'secs'. */
+static void bench_run(struct bench *b, double secs, FILE *out)
+{
+	unsigned long n, i;
+	double t = 0;
+
+	for (n = 1; ; n *= 2) {
+		double start = bench_now();
+
+		for (i = 0; i < n; i++)
+			bench_op(b);
+		fflush(stdout);
+		t = bench_now() - start;
+		if (t >= secs || n >= 1UL << 40)
+			break;
+	}
+	fprintf(out, "%-24s %12lu %12.1f", b->name, n, t * 1e9 / n);
+	if (b->bytes)
+		fprintf(out, " %12.1f", b->bytes * n / t / 1e6);
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, j, null_fd, out_fd, first_filter;
+	unsigned int i, ms = 200;
+	FILE *out;
+
+	while ((opt = getopt(argc, argv, "t:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			get_int(optarg, &ms);
+			break;
+		case 'd':
+			bench_dev = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t <ms per bench>] "
+					"[-d <device>] [<name substring>...]\n",
+					argv[0]);
+			return EINVAL;
+		}
+	}
+
+	first_filter = optind;
+	setlocale(LC_ALL, "");
+	for (i = 0; i < sizeof(bench_buf); i++)
+		bench_buf[i] = i * 37;
+	parse_data_pattern("random", &bench_pat[0]);
+	parse_data_pattern("compress:2", &bench_pat[1]);
+	parse_data_pattern("dedupe:50", &bench_pat[2]);
+	bench_fd = nvme_open(bench_dev);
+	if (bench_fd < 0) {
+		perror(bench_dev);
+		return errno;
+	}
+	/* the ioctl benches ignore errors, so make sure the device answers */
+	if (identify(bench_fd, 0, &bench_ctrl, 1)) {
+		fprintf(stderr, "%s: identify failed\n", bench_dev);
+		return EIO;
+	}
+	nvme_get_log(bench_fd, &bench_smart, sizeof(bench_smart),
+		0x2 | (((sizeof(bench_smart) / 4) - 1) << 16), 0xffffffff);
+	memset(bench_smart.data_units_read, 0xff, 12);
+
+	out_fd = dup(STDOUT_FILENO);
+	null_fd = open("/dev/null", O_WRONLY);
+	out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+	if (!out || null_fd < 0) {
+		perror("bench");
+		return errno;
+	}
+	dup2(null_fd, STDOUT_FILENO);
+
+	fprintf(out, "%-24s %12s %12s %12s\n", "benchmark", "ops", "ns/op",
+								"MB/s");
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		for (j = first_filter; j < argc; j++)
+			if (strstr(benches[i].name, argv[j]))
+				break;
+		if (j == argc && first_filter < argc)
+			continue;
+		bench_run(&benches[i], ms / 1000.0, out);
+	}
+	nvme_close(bench_fd);
+	return 0;
+}
@@ -0,0 +1,1661 @@
+/*
+ * nvme-emu.c -- emulated NVMe controllers for the nvme utility.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * An emulated controller has a single namespace kept in memory, or in a
+ * state file so it survives between invocations, and answers the admin and
+ * I/O commands the utility sends after a delay drawn from a latency model.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "linux/nvme.h"
+#include "nvme-emu.h"
+
+#define EMU_MAGIC	"NVMEEMU1"
+#define EMU_HDR_SIZE	4096
+#define EMU_MAX_FDS	1024
+#define EMU_MAX_UNITS	256
+#define EMU_NSID	1
+#define EMU_MAX_CTRLS	16
+#define EMU_MAX_UNCOR	128	/* uncorrectable extents, fits the header */
+#define EMU_RC_LINE	4096
+#define EMU_RC_WAYS	8
+
+enum {
+	EMU_DIST_FIXED,
+	EMU_DIST_UNIFORM,
+	EMU_DIST_EXP,
+	EMU_DIST_NORMAL,
+	EMU_DIST_LOGNORMAL,
+};
+
+/*
+ * A latency distribution in nanoseconds. For lognormal 'a' is the median
+ * and 'b' the shape; a tail adds 'tail' nanoseconds with probability
+ * 'tail_p' on top of whatever was drawn.
+ */
+struct emu_dist {
+	int kind;
+	double a, b;
+	double tail_p, tail;
+};
+
+/* A reservation registrant, one per host identifier. */
+struct emu_reg {
+	__u64 hostid;
+	__u64 rkey;
+	__u16 cntlid;
+	__u16 valid;
+	__u32 rsvd;
+};
+
+/* A run of blocks marked by Write Uncorrectable. */
+struct emu_extent {
+	__u64 slba;
+	__u64 nlb;
+};
+
+/*
+ * The persistent head of the state mapping; the namespace data follows at
+ * EMU_HDR_SIZE. Every open of the same state file shares it, which is how
+ * several emulated controllers see one namespace and its reservation.
+ */
+struct emu_state {
+	char magic[8];
+	__u32 lba_shift;
+	__u32 rsvd;
+	__u64 nsze;
+	__u64 bytes_read;
+	__u64 bytes_written;
+	__u64 host_reads;
+	__u64 host_writes;
+	__u64 power_cycles;
+	__u32 features[256];
+	__u32 nr_ctrls;
+	__u32 resv_gen;
+	__u8 rtype;
+	__u8 ptpls;
+	__u16 holder;		/* registrant slot + 1, 0 if not reserved */
+	__u32 rsvd2;
+	__u64 hostid[EMU_MAX_CTRLS];
+	struct emu_reg regs[EMU_MAX_CTRLS];
+	__u64 media_errors;
+	__u32 nr_uncor;
+	__u32 rsvd3;
+	struct emu_extent uncor[EMU_MAX_UNCOR];
+};
+
+struct emu_ctrl {
+	pthread_mutex_t lock;
+	int sfd;
+	struct emu_state *st;
+	__u8 *data;
+	size_t map_size;
+
+	/* configuration */
+	char *state_path;
+	unsigned int cntlid, nr_ctrls;
+	__u64 hostid;
+	__u64 size;
+	__u32 lba_shift;
+	struct emu_dist io[256];
+	struct emu_dist admin;
+	struct emu_dist gc;
+	struct emu_dist recovery;
+	double lr_limit;		/* recovery cap with Limited Retry */
+	struct emu_extent weak;
+	unsigned int channels, dies;
+	__u64 stripe;
+	double xfer;
+	__u64 cache;
+	double drain;
+	__u64 gc_every;
+	__u64 rcache;
+	struct emu_dist rcache_hit;
+	__u64 page;
+	__u64 boundary;
+	double heat;			/* kelvin per GiB written */
+	double cool;			/* cooling time constant, ns */
+	double ambient;			/* kelvin */
+	double throttle;		/* media time factor when hot */
+	double apst;			/* deepest power state exit, ns */
+	int virt;
+
+	/* model state, all times in ns since open */
+	__u64 rng;
+	__u64 base;
+	__u64 vclock;
+	__u64 admin_busy;
+	__u64 gc_until;
+	__u64 gc_written;
+	__u64 dirty;
+	__u64 dirty_at;
+	__u64 die_busy[EMU_MAX_UNITS];
+	__u64 chan_busy[EMU_MAX_UNITS];
+
+	/* read cache: EMU_RC_WAYS way set associative, LRU by use stamp */
+	__u64 *rc_tag;			/* line + 1, 0 if empty */
+	__u64 *rc_used;
+	__u64 rc_sets;
+	__u64 rc_clock;
+
+	double temp;
+	__u64 temp_at;
+
+	int apste;
+	__u64 apst_table[32];
+	__u64 idle_at;			/* when the last command completed */
+};
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct emu_ctrl *emu_ctrls[EMU_MAX_FDS];
+
+static __u64 emu_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 emu_now(struct emu_ctrl *c)
+{
+	if (c->virt)
+		return c->vclock;
+	return emu_mono() - c->base;
+}
+
+static __u64 max64(__u64 a, __u64 b)
+{
+	return a > b ? a : b;
+}
+
+/* xorshift64*, so a given seed replays the same latencies */
+static double emu_rand(struct emu_ctrl *c)
+{
+	c->rng ^= c->rng >> 12;
+	c->rng ^= c->rng << 25;
+	c->rng ^= c->rng >> 27;
+	return (((c->rng * 2685821657736338717ULL) >> 11) + 0.5) /
+							9007199254740992.0;
+}
+
+static double emu_gauss(struct emu_ctrl *c)
+{
+	double u = emu_rand(c), v = emu_rand(c);
+
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+static __u64 emu_sample(struct emu_ctrl *c, const struct emu_dist *d)
+{
+	double v;
+
+	switch (d->kind) {
+	case EMU_DIST_UNIFORM:
+		v = d->a + (d->b - d->a) * emu_rand(c);
+		break;
+	case EMU_DIST_EXP:
+		v = -d->a * log(emu_rand(c));
+		break;
+	case EMU_DIST_NORMAL:
+		v = d->a + d->b * emu_gauss(c);
+		break;
+	case EMU_DIST_LOGNORMAL:
+		v = d->a * exp(d->b * emu_gauss(c));
+		break;
+	default:
+		v = d->a;
+		break;
+	}
+	if (d->tail_p && emu_rand(c) < d->tail_p)
+		v += d->tail;
+	return v > 0 ? (__u64)v : 0;
+}
+
+/*
+ * Looks up the read cache lines a command covers. With 'fill' missing
+ * lines are brought in, evicting the least recently used of their set,
+ * and the result is whether every line was a hit; otherwise the lines are
+ * dropped, as a write does to stale copies.
+ */
+static int emu_rc_access(struct emu_ctrl *c, __u64 slba, __u64 len, int fill)
+{
+	__u64 first = (slba << c->lba_shift) / EMU_RC_LINE, line, *tag, *used;
+	__u64 last = ((slba << c->lba_shift) + len - 1) / EMU_RC_LINE;
+	int hit = 1, i, victim;
+
+	for (line = first; len && line <= last; line++) {
+		tag = &c->rc_tag[(line ^ line >> 17) % c->rc_sets * EMU_RC_WAYS];
+		used = &c->rc_used[tag - c->rc_tag];
+		for (i = 0, victim = 0; i < EMU_RC_WAYS; i++) {
+			if (tag[i] == line + 1)
+				break;
+			if (used[i] < used[victim])
+				victim = i;
+		}
+		if (!fill) {
+			if (i < EMU_RC_WAYS)
+				tag[i] = used[i] = 0;
+			continue;
+		}
+		if (i == EMU_RC_WAYS) {
+			hit = 0;
+			i = victim;
+			tag[i] = line + 1;
+		}
+		used[i] = ++c->rc_clock;
+	}
+	return hit;
+}
+
+/*
+ * Thermal model: writes heat the controller by 'heat' kelvin per GiB and
+ * it cools exponentially towards ambient. Above the Temperature Threshold
+ * feature's over temperature threshold, media operations slow down by
+ * the 'throttle' factor.
+ */
+static void emu_heat(struct emu_ctrl *c, __u64 now, __u64 bytes)
+{
+	if (!c->heat)
+		return;
+	if (now > c->temp_at) {
+		c->temp = c->ambient + (c->temp - c->ambient) *
+				exp(-(double)(now - c->temp_at) / c->cool);
+		c->temp_at = now;
+	}
+	c->temp += bytes * c->heat / (1 << 30);
+}
+
+static int emu_hot(struct emu_ctrl *c)
+{
+	return c->heat && c->temp >=
+			(c->st->features[NVME_FEAT_TEMP_THRESH] & 0xffff);
+}
+
+/*
+ * Works out when a command submitted now completes and updates the model.
+ * Media time comes from the opcode's distribution, transfer time from the
+ * per channel bandwidth. LBAs are striped over channels * dies units by
+ * their starting block; a die runs one media operation at a time and a
+ * channel moves one transfer at a time, so concurrent submitters queue.
+ */
+static __u64 emu_model(struct emu_ctrl *c, int admin, __u8 opcode,
+					__u64 slba, __u64 len, double extra)
+{
+	__u64 now = emu_now(c), media, xfer = 0, start, done;
+	unsigned int units = c->channels * c->dies, u, ch;
+
+	if (admin) {
+		start = max64(now, c->admin_busy);
+		c->admin_busy = done = start + emu_sample(c, &c->admin);
+		return done;
+	}
+
+	media = emu_sample(c, &c->io[opcode]) + extra;
+	emu_heat(c, now, opcode == nvme_cmd_write ? len : 0);
+	if (emu_hot(c))
+		media *= c->throttle;
+	/* a write of part of a page reads the rest first */
+	if (c->page && opcode == nvme_cmd_write &&
+			((slba << c->lba_shift) % c->page ||
+			 ((slba << c->lba_shift) + len) % c->page))
+		media += emu_sample(c, &c->io[nvme_cmd_read]);
+	/* a command crossing an atomic boundary is split in two */
+	if (c->boundary && len && slba / c->boundary !=
+			(slba + (len >> c->lba_shift) - 1) / c->boundary)
+		media += emu_sample(c, &c->io[opcode]);
+	if (c->xfer)
+		xfer = len * 1e9 / c->xfer;
+	u = ((slba << c->lba_shift) / c->stripe) % units;
+	ch = u % c->channels;
+	start = max64(now, c->gc_until);
+
+	if (c->cache && now > c->dirty_at) {
+		__u64 drained = (now - c->dirty_at) * c->drain / 1e9;
+
+		c->dirty = c->dirty > drained ? c->dirty - drained : 0;
+		c->dirty_at = now;
+	}
+
+	switch (opcode) {
+	case nvme_cmd_flush:
+		done = start + media;
+		if (c->cache) {
+			done += c->dirty * 1e9 / c->drain;
+			c->dirty = 0;
+			c->dirty_at = done;
+		}
+		return done;
+	case nvme_cmd_read:
+	case nvme_cmd_compare:
+		if (c->rc_sets && !extra && emu_rc_access(c, slba, len, 1)) {
+			/* a hit skips the die but still crosses the channel */
+			start = max64(now + emu_sample(c, &c->rcache_hit),
+							c->chan_busy[ch]);
+			c->chan_busy[ch] = done = start + xfer;
+			return done;
+		}
+		start = max64(start, c->die_busy[u]);
+		c->die_busy[u] = start + media;
+		start = max64(c->die_busy[u], c->chan_busy[ch]);
+		c->chan_busy[ch] = done = start + xfer;
+		return done;
+	case nvme_cmd_write:
+	case nvme_cmd_write_zeroes:
+	case nvme_cmd_write_uncor:
+		if (c->rc_sets)
+			emu_rc_access(c, slba, len, 0);
+		start = max64(start, c->chan_busy[ch]);
+		c->chan_busy[ch] = start + xfer;
+		if (c->cache) {
+			/* a full cache holds the write until enough drained */
+			done = c->chan_busy[ch];
+			if (c->dirty + len > c->cache)
+				done += (c->dirty + len - c->cache) * 1e9 /
+								c->drain;
+			done += media;
+			c->dirty = c->dirty + len > c->cache ?
+						c->cache : c->dirty + len;
+		} else {
+			start = max64(c->chan_busy[ch], c->die_busy[u]);
+			c->die_busy[u] = done = start + media;
+		}
+		if (c->gc_every) {
+			c->gc_written += len;
+			while (c->gc_written >= c->gc_every) {
+				c->gc_written -= c->gc_every;
+				c->gc_until = max64(done, c->gc_until) +
+						emu_sample(c, &c->gc);
+			}
+		}
+		return done;
+	default:
+		return start + media;
+	}
+}
+
+static void emu_wait(struct emu_ctrl *c, __u64 done)
+{
+	struct timespec ts;
+
+	if (c->virt) {
+		pthread_mutex_lock(&c->lock);
+		c->vclock = max64(c->vclock, done);
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	done += c->base;
+	ts.tv_sec = done / 1000000000ULL;
+	ts.tv_nsec = done % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+									EINTR)
+		;
+}
+
+/*
+ * Autonomous power state transitions: with 'apst' set the controller has
+ * two non-operational states, ps1 with a tenth of the exit latency of ps2.
+ * Idle time walks the APST table from ps0 and the first command after it
+ * pays the exit latency of the state reached.
+ */
+static __u32 emu_ps_lat(struct emu_ctrl *c, int ps)
+{
+	return ps == 2 ? c->apst / 1e3 : ps == 1 ? c->apst / 1e4 : 0;
+}
+
+static __u64 emu_wake(struct emu_ctrl *c, __u64 now)
+{
+	__u64 idle, t = 0, itpt;
+	int ps = 0, i;
+
+	if (!c->apst || !c->apste || now <= c->idle_at)
+		return 0;
+	idle = (now - c->idle_at) / 1000000;
+	for (i = 0; i < 32; i++) {
+		itpt = (c->apst_table[ps] >> 8) & 0xffffff;
+		if (!itpt || idle < t + itpt)
+			break;
+		t += itpt;
+		ps = (c->apst_table[ps] >> 3) & 0x1f;
+	}
+	return emu_ps_lat(c, ps) * 1000ULL;
+}
+
+static void emu_apst_init(struct emu_ctrl *c)
+{
+	int ps;
+
+	/* idle 50 times the entry plus exit latency, as Linux does */
+	c->apste = 1;
+	for (ps = 1; ps <= 2; ps++)
+		c->apst_table[ps - 1] = (__u64)ps << 3 |
+			(__u64)((emu_ps_lat(c, ps) * 2 * 50 + 999) / 1000) << 8;
+}
+
+/*
+ * 'extra' is media time on top of the opcode's own, such as error recovery
+ * for a read that fails.
+ */
+static __u64 emu_complete(struct emu_ctrl *c, int admin, __u8 opcode,
+				__u64 slba, __u64 len, double extra)
+{
+	__u64 done;
+
+	pthread_mutex_lock(&c->lock);
+	done = emu_wake(c, emu_now(c));
+	done += emu_model(c, admin, opcode, slba, len, extra);
+	c->idle_at = max64(c->idle_at, done);
+	pthread_mutex_unlock(&c->lock);
+	emu_wait(c, done);
+	return done;
+}
+
+static void emu_put128(__u8 *dst, __u64 val)
+{
+	int i;
+
+	memset(dst, 0, 16);
+	for (i = 0; i < 8; i++)
+		dst[i] = val >> (i * 8);
+}
+
+static void emu_strpad(char *dst, size_t len, const char *src)
+{
+	size_t n = strlen(src);
+
+	memset(dst, ' ', len);
+	memcpy(dst, src, n < len ? n : len);
+}
+
+static int emu_identify(struct emu_ctrl *c, __u32 nsid, __u8 cns, void *buf,
+								__u32 len)
+{
+	__u8 id[4096];
+	__u64 cap = c->st->nsze << c->st->lba_shift;
+
+	memset(id, 0, sizeof(id));
+	if (cns == 1) {
+		struct nvme_id_ctrl *ctrl = (struct nvme_id_ctrl *)id;
+
+		emu_strpad(ctrl->sn, sizeof(ctrl->sn), "EMU0001");
+		emu_strpad(ctrl->mn, sizeof(ctrl->mn),
+					"nvme-cli emulated controller");
+		emu_strpad(ctrl->fr, sizeof(ctrl->fr), "emu1");
+		ctrl->cmic = c->st->nr_ctrls > 1 ? 0x3 : 0;
+		ctrl->cntlid = c->cntlid;
+		ctrl->ver = NVME_VS(1, 2);
+		ctrl->oacs = 0x6;
+		ctrl->frmw = 0x2;
+		ctrl->elpe = 63;
+		ctrl->wctemp = 343;
+		ctrl->cctemp = 353;
+		emu_put128(ctrl->tnvmcap, cap);
+		ctrl->sqes = 0x66;
+		ctrl->cqes = 0x44;
+		ctrl->nn = 1;
+		ctrl->oncs = NVME_CTRL_ONCS_COMPARE | NVME_CTRL_ONCS_DSM |
+				NVME_CTRL_ONCS_WRITE_UNCORRECTABLE |
+								1 << 3 | 1 << 5;
+		ctrl->vwc = c->cache ? NVME_CTRL_VWC_PRESENT : 0;
+		if (c->apst) {
+			int ps;
+
+			ctrl->apsta = 1;
+			ctrl->npss = 2;
+			for (ps = 1; ps <= 2; ps++) {
+				ctrl->psd[ps].flags = 1 << 1;
+				ctrl->psd[ps].entry_lat = emu_ps_lat(c, ps);
+				ctrl->psd[ps].exit_lat = emu_ps_lat(c, ps);
+			}
+		}
+	} else if (cns == 0) {
+		struct nvme_id_ns *ns = (struct nvme_id_ns *)id;
+
+		if (nsid != EMU_NSID)
+			return NVME_SC_INVALID_NS | NVME_SC_DNR;
+		ns->nsze = ns->ncap = ns->nuse = c->st->nsze;
+		ns->nmic = c->st->nr_ctrls > 1;
+		ns->rescap = 0x7f;
+		ns->lbaf[0].ds = c->st->lba_shift;
+		emu_put128(ns->nvmcap, cap);
+		if (c->boundary) {
+			ns->nsfeat |= 1 << 1;
+			ns->nabsn = ns->nabspf = c->boundary - 1;
+		}
+	} else if (cns == 2) {
+		if (nsid < EMU_NSID)
+			*(__u32 *)id = EMU_NSID;
+	} else
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+
+	memcpy(buf, id, len < sizeof(id) ? len : sizeof(id));
+	return 0;
+}
+
+static int emu_get_log(struct emu_ctrl *c, __u8 lid, void *buf, __u32 len)
+{
+	union {
+		struct nvme_smart_log smart;
+		struct nvme_firmware_log_page fw;
+		__u8 raw[4096];
+	} log;
+	struct emu_state *st = c->st;
+	unsigned int temp;
+
+	memset(&log, 0, sizeof(log));
+	switch (lid) {
+	case NVME_LOG_ERROR:
+		break;
+	case NVME_LOG_SMART:
+		pthread_mutex_lock(&c->lock);
+		emu_heat(c, emu_now(c), 0);
+		temp = c->heat ? c->temp : 310;
+		if (emu_hot(c))
+			log.smart.critical_warning |= 1 << 1;
+		pthread_mutex_unlock(&c->lock);
+		log.smart.temperature[0] = temp & 0xff;
+		log.smart.temperature[1] = temp >> 8;
+		log.smart.avail_spare = 100;
+		log.smart.spare_thresh = 10;
+		emu_put128(log.smart.data_units_read,
+				(st->bytes_read / 512 + 999) / 1000);
+		emu_put128(log.smart.data_units_written,
+				(st->bytes_written / 512 + 999) / 1000);
+		emu_put128(log.smart.host_reads, st->host_reads);
+		emu_put128(log.smart.host_writes, st->host_writes);
+		emu_put128(log.smart.power_cycles, st->power_cycles);
+		emu_put128(log.smart.media_errors, st->media_errors);
+		break;
+	case NVME_LOG_FW_SLOT:
+		log.fw.afi = 1;
+		memcpy(&log.fw.frs[0], "emu1    ", 8);
+		break;
+	default:
+		return NVME_SC_INVALID_LOG_PAGE | NVME_SC_DNR;
+	}
+	if (len > sizeof(log))
+		len = sizeof(log);
+	memcpy(buf, &log, len);
+	return 0;
+}
+
+/* Drop namespace data so it reads back as zeroes. */
+static void emu_discard(struct emu_ctrl *c, __u64 off, __u64 len)
+{
+	if (c->sfd >= 0) {
+		if (!fallocate(c->sfd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, EMU_HDR_SIZE + off, len))
+			return;
+	} else if (!(off & 4095) && !(len & 4095) &&
+			!madvise(c->data + off, len, MADV_DONTNEED))
+		return;
+	memset(c->data + off, 0, len);
+}
+
+static __u64 *emu_hostid(struct emu_ctrl *c)
+{
+	return &c->st->hostid[c->cntlid - 1];
+}
+
+static struct emu_reg *emu_reg_find(struct emu_state *st, __u64 hostid)
+{
+	int i;
+
+	for (i = 0; i < EMU_MAX_CTRLS; i++)
+		if (st->regs[i].valid && st->regs[i].hostid == hostid)
+			return &st->regs[i];
+	return NULL;
+}
+
+/* Write Exclusive or Exclusive Access - All Registrants */
+static int emu_resv_all_regs(struct emu_state *st)
+{
+	return st->rtype == 5 || st->rtype == 6;
+}
+
+static int emu_resv_holds(struct emu_state *st, struct emu_reg *reg)
+{
+	if (!st->holder || !reg)
+		return 0;
+	return emu_resv_all_regs(st) || reg == &st->regs[st->holder - 1];
+}
+
+/*
+ * Removes a registrant. An all registrants reservation passes to any other
+ * registrant left, any other type is released with its holder.
+ */
+static void emu_reg_remove(struct emu_state *st, struct emu_reg *reg)
+{
+	int i, slot = reg - st->regs;
+
+	memset(reg, 0, sizeof(*reg));
+	if (st->holder != slot + 1)
+		return;
+	st->holder = 0;
+	if (emu_resv_all_regs(st))
+		for (i = 0; i < EMU_MAX_CTRLS; i++)
+			if (st->regs[i].valid) {
+				st->holder = i + 1;
+				return;
+			}
+	st->rtype = 0;
+}
+
+/* Does the reservation keep this controller's host from the namespace? */
+static int emu_resv_conflict(struct emu_ctrl *c, int write)
+{
+	struct emu_state *st = c->st;
+	struct emu_reg *reg;
+
+	if (!st->holder)
+		return 0;
+	reg = emu_reg_find(st, *emu_hostid(c));
+	if (emu_resv_holds(st, reg))
+		return 0;
+	switch (st->rtype) {
+	case 1:
+		return write;
+	case 2:
+		return 1;
+	case 3:
+	case 5:
+		return write && !reg;
+	case 4:
+	case 6:
+		return !reg;
+	}
+	return 0;
+}
+
+static int emu_resv_register(struct emu_state *st, struct emu_ctrl *c,
+					__u32 cdw10, const __u64 *keys)
+{
+	struct emu_reg *reg = emu_reg_find(st, *emu_hostid(c));
+	int iekey = cdw10 >> 3 & 1, i;
+
+	switch (cdw10 & 7) {
+	case 0:
+		if (reg)
+			return reg->rkey == keys[1] ? 0 :
+						NVME_SC_RESERVATION_CONFLICT;
+		for (i = 0; i < EMU_MAX_CTRLS && st->regs[i].valid; i++)
+			;
+		if (i == EMU_MAX_CTRLS)
+			return NVME_SC_INTERNAL;
+		reg = &st->regs[i];
+		reg->hostid = *emu_hostid(c);
+		reg->rkey = keys[1];
+		reg->cntlid = c->cntlid;
+		reg->valid = 1;
+		st->resv_gen++;
+		break;
+	case 1:
+		if (!reg || (!iekey && reg->rkey != keys[0]))
+			return NVME_SC_RESERVATION_CONFLICT;
+		emu_reg_remove(st, reg);
+		st->resv_gen++;
+		break;
+	case 2:
+		if (!reg || (!iekey && reg->rkey != keys[0]))
+			return NVME_SC_RESERVATION_CONFLICT;
+		reg->rkey = keys[1];
+		st->resv_gen++;
+		break;
+	default:
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	}
+	if (cdw10 >> 30 == 2)
+		st->ptpls = 0;
+	else if (cdw10 >> 30 == 3)
+		st->ptpls = 1;
+	return 0;
+}
+
+static int emu_resv_acquire(struct emu_state *st, struct emu_ctrl *c,
+					__u32 cdw10, const __u64 *keys)
+{
+	struct emu_reg *reg = emu_reg_find(st, *emu_hostid(c)), *holder;
+	__u8 rtype = cdw10 >> 8;
+	int i, n = 0;
+
+	if (rtype < 1 || rtype > 6)
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	if (!reg || (!(cdw10 >> 3 & 1) && reg->rkey != keys[0]))
+		return NVME_SC_RESERVATION_CONFLICT;
+
+	switch (cdw10 & 7) {
+	case 0:
+		if (!st->holder) {
+			st->holder = reg - st->regs + 1;
+			st->rtype = rtype;
+		} else if (!emu_resv_holds(st, reg) || st->rtype != rtype)
+			return NVME_SC_RESERVATION_CONFLICT;
+		return 0;
+	case 1:
+	case 2:
+		/*
+		 * Preempting the holder's key (or key 0 for an all
+		 * registrants reservation) takes over the reservation,
+		 * any other key only removes those registrants. There
+		 * are never commands outstanding here to abort.
+		 */
+		holder = st->holder ? &st->regs[st->holder - 1] : NULL;
+		if (holder && (emu_resv_all_regs(st) ? !keys[1] :
+						holder->rkey == keys[1])) {
+			for (i = 0; i < EMU_MAX_CTRLS; i++)
+				if (st->regs[i].valid && &st->regs[i] != reg &&
+				    (!keys[1] || st->regs[i].rkey == keys[1]))
+					emu_reg_remove(st, &st->regs[i]);
+			st->holder = reg - st->regs + 1;
+			st->rtype = rtype;
+		} else {
+			if (!keys[1])
+				return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+			for (i = 0; i < EMU_MAX_CTRLS; i++)
+				if (st->regs[i].valid && &st->regs[i] != reg &&
+						st->regs[i].rkey == keys[1]) {
+					emu_reg_remove(st, &st->regs[i]);
+					n++;
+				}
+			if (!n)
+				return NVME_SC_RESERVATION_CONFLICT;
+		}
+		st->resv_gen++;
+		return 0;
+	default:
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	}
+}
+
+static int emu_resv_release(struct emu_state *st, struct emu_ctrl *c,
+					__u32 cdw10, const __u64 *keys)
+{
+	struct emu_reg *reg = emu_reg_find(st, *emu_hostid(c));
+
+	if (!reg || (!(cdw10 >> 3 & 1) && reg->rkey != keys[0]))
+		return NVME_SC_RESERVATION_CONFLICT;
+
+	switch (cdw10 & 7) {
+	case 0:
+		if (!emu_resv_holds(st, reg))
+			return 0;
+		if (st->rtype != (__u8)(cdw10 >> 8))
+			return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		st->holder = 0;
+		st->rtype = 0;
+		return 0;
+	case 1:
+		memset(st->regs, 0, sizeof(st->regs));
+		st->holder = 0;
+		st->rtype = 0;
+		st->resv_gen++;
+		return 0;
+	default:
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	}
+}
+
+static void emu_resv_report(struct emu_state *st, void *buf, __u32 len)
+{
+	struct {
+		struct nvme_reservation_status rs;
+		__u8 regctl_ds[EMU_MAX_CTRLS * 24];
+	} data;
+	struct nvme_reservation_status *rs = &data.rs;
+	int i, n = 0;
+
+	memset(&data, 0, sizeof(data));
+	rs->gen = st->resv_gen;
+	rs->rtype = st->rtype;
+	rs->ptpls = st->ptpls;
+	for (i = 0; i < EMU_MAX_CTRLS; i++) {
+		if (!st->regs[i].valid)
+			continue;
+		rs->regctl_ds[n].cntlid = st->regs[i].cntlid;
+		rs->regctl_ds[n].rcsts = emu_resv_holds(st, &st->regs[i]);
+		rs->regctl_ds[n].hostid = st->regs[i].hostid;
+		rs->regctl_ds[n].rkey = st->regs[i].rkey;
+		n++;
+	}
+	rs->regctl[0] = n;
+	rs->regctl[1] = n >> 8;
+	memcpy(buf, &data, len < sizeof(data) ? len : sizeof(data));
+}
+
+/*
+ * Reservation state is shared by every controller on the state file, so
+ * the commands also take a file lock against other processes.
+ */
+static int emu_resv(struct emu_ctrl *c, struct nvme_passthru_cmd *cmd)
+{
+	void *buf = (void *)(uintptr_t)cmd->addr;
+	__u64 keys[2] = { 0, 0 };
+	__u32 len = cmd->opcode == nvme_cmd_resv_release ? 8 : 16;
+	int status = 0;
+
+	if (cmd->opcode == nvme_cmd_resv_report) {
+		len = (cmd->cdw10 + 1) * 4;
+		if (cmd->data_len < len)
+			len = cmd->data_len;
+	} else if (cmd->data_len >= len && buf)
+		memcpy(keys, buf, len);
+	else
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	if (!buf)
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->sfd >= 0)
+		flock(c->sfd, LOCK_EX);
+	switch (cmd->opcode) {
+	case nvme_cmd_resv_register:
+		status = emu_resv_register(c->st, c, cmd->cdw10, keys);
+		break;
+	case nvme_cmd_resv_acquire:
+		status = emu_resv_acquire(c->st, c, cmd->cdw10, keys);
+		break;
+	case nvme_cmd_resv_release:
+		status = emu_resv_release(c->st, c, cmd->cdw10, keys);
+		break;
+	default:
+		emu_resv_report(c->st, buf, len);
+		break;
+	}
+	if (c->sfd >= 0)
+		flock(c->sfd, LOCK_UN);
+	pthread_mutex_unlock(&c->lock);
+	return status;
+}
+
+static int emu_admin(struct emu_ctrl *c, struct nvme_admin_cmd *cmd)
+{
+	void *buf = (void *)(uintptr_t)cmd->addr;
+	__u32 fid = cmd->cdw10 & 0xff, numd;
+	int status = 0;
+
+	cmd->result = 0;
+	switch (cmd->opcode) {
+	case nvme_admin_identify:
+		status = emu_identify(c, cmd->nsid, cmd->cdw10 & 0xff, buf,
+								cmd->data_len);
+		break;
+	case nvme_admin_get_log_page:
+		numd = ((cmd->cdw10 >> 16) & 0xfff) + 1;
+		status = emu_get_log(c, cmd->cdw10 & 0xff, buf,
+				cmd->data_len < numd * 4 ? cmd->data_len : numd * 4);
+		break;
+	case nvme_admin_get_features:
+		if (!fid)
+			status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		else if (fid == NVME_FEAT_HOST_ID) {
+			if (!buf || cmd->data_len < 8)
+				status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+			else
+				memcpy(buf, emu_hostid(c), 8);
+		} else if (fid == NVME_FEAT_AUTO_PST) {
+			if (!c->apst)
+				status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+			else {
+				cmd->result = c->apste;
+				if (buf && cmd->data_len >=
+						sizeof(c->apst_table))
+					memcpy(buf, c->apst_table,
+						sizeof(c->apst_table));
+			}
+		} else
+			cmd->result = c->st->features[fid];
+		break;
+	case nvme_admin_set_features:
+		if (!fid || fid == NVME_FEAT_NUM_QUEUES)
+			status = NVME_SC_FEATURE_NOT_CHANGEABLE | NVME_SC_DNR;
+		else if (fid == NVME_FEAT_HOST_ID) {
+			if (!buf || cmd->data_len < 8)
+				status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+			else if (emu_reg_find(c->st, *emu_hostid(c)))
+				status = NVME_SC_CMD_SEQ_ERROR | NVME_SC_DNR;
+			else
+				memcpy(emu_hostid(c), buf, 8);
+		} else if (fid == NVME_FEAT_AUTO_PST) {
+			if (!c->apst || !buf ||
+					cmd->data_len < sizeof(c->apst_table))
+				status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+			else {
+				c->apste = cmd->cdw11 & 1;
+				memcpy(c->apst_table, buf,
+						sizeof(c->apst_table));
+			}
+		} else if (fid == NVME_FEAT_TEMP_THRESH &&
+						(cmd->cdw11 >> 16) & 0x3f)
+			/* only the composite over temperature threshold */
+			status = NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		else
+			cmd->result = c->st->features[fid] = cmd->cdw11;
+		break;
+	case nvme_admin_activate_fw:
+	case nvme_admin_download_fw:
+		break;
+	case nvme_admin_format_nvm:
+		if (cmd->cdw10 & 0xf)
+			status = NVME_SC_INVALID_FORMAT | NVME_SC_DNR;
+		else {
+			emu_discard(c, 0, c->st->nsze << c->st->lba_shift);
+			c->st->nr_uncor = 0;
+		}
+		break;
+	default:
+		status = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+		break;
+	}
+	emu_complete(c, 1, cmd->opcode, 0, 0, 0);
+	return status;
+}
+
+/* Whether any block of [slba, slba + nlb) is marked uncorrectable. */
+static int emu_uncor_hit(struct emu_state *st, __u64 slba, __u64 nlb)
+{
+	__u32 i;
+
+	for (i = 0; i < st->nr_uncor; i++)
+		if (slba < st->uncor[i].slba + st->uncor[i].nlb &&
+					st->uncor[i].slba < slba + nlb)
+			return 1;
+	return 0;
+}
+
+/*
+ * Writing blocks makes them readable again. An extent split in two when
+ * the list is full keeps only its head, so a few marked blocks may
+ * quietly heal.
+ */
+static void emu_uncor_clear(struct emu_state *st, __u64 slba, __u64 nlb)
+{
+	struct emu_extent *e;
+	__u64 end = slba + nlb, e_end;
+	__u32 i;
+
+	for (i = 0; i < st->nr_uncor; ) {
+		e = &st->uncor[i];
+		e_end = e->slba + e->nlb;
+		if (end <= e->slba || e_end <= slba) {
+			i++;
+			continue;
+		}
+		if (e->slba < slba && e_end > end &&
+					st->nr_uncor < EMU_MAX_UNCOR) {
+			st->uncor[st->nr_uncor].slba = end;
+			st->uncor[st->nr_uncor++].nlb = e_end - end;
+		}
+		if (e->slba < slba) {
+			e->nlb = slba - e->slba;
+			i++;
+		} else if (e_end > end) {
+			e->nlb = e_end - end;
+			e->slba = end;
+			i++;
+		} else
+			*e = st->uncor[--st->nr_uncor];
+	}
+}
+
+static int emu_uncor_mark(struct emu_state *st, __u64 slba, __u64 nlb)
+{
+	struct emu_extent *last;
+
+	emu_uncor_clear(st, slba, nlb);
+	last = st->nr_uncor ? &st->uncor[st->nr_uncor - 1] : NULL;
+	if (last && last->slba + last->nlb == slba) {
+		last->nlb += nlb;
+		return 0;
+	}
+	if (st->nr_uncor == EMU_MAX_UNCOR)
+		return NVME_SC_CAP_EXCEEDED;
+	st->uncor[st->nr_uncor].slba = slba;
+	st->uncor[st->nr_uncor++].nlb = nlb;
+	return 0;
+}
+
+/*
+ * Error recovery on a read of marked or weak blocks: the controller needs
+ * a 'recovery' sample to get the data back, but gives up at the Error
+ * Recovery feature's time limit (TLER, in 100ms units) or, with Limited
+ * Retry, at 'lr-limit'. Marked blocks never come back. Returns the
+ * recovery time and sets *failed.
+ */
+static double emu_recover(struct emu_ctrl *c, int marked, int lr,
+								int *failed)
+{
+	double t = emu_sample(c, &c->recovery), limit;
+
+	limit = (c->st->features[NVME_FEAT_ERR_RECOVERY] & 0xffff) * 1e8;
+	if (lr && (!limit || c->lr_limit < limit))
+		limit = c->lr_limit;
+	*failed = marked;
+	if (limit && t > limit) {
+		t = limit;
+		*failed = 1;
+	}
+	return t;
+}
+
+static int emu_io(struct emu_ctrl *c, struct nvme_passthru_cmd *cmd)
+{
+	void *buf = (void *)(uintptr_t)cmd->addr;
+	__u64 slba = cmd->cdw10 | (__u64)cmd->cdw11 << 32;
+	__u64 nlb = (cmd->cdw12 & 0xffff) + 1;
+	__u64 off = slba << c->st->lba_shift, len = nlb << c->st->lba_shift;
+	double extra = 0;
+	int status = 0, marked, failed;
+
+	cmd->result = 0;
+	if (cmd->nsid != EMU_NSID && !(cmd->opcode == nvme_cmd_flush &&
+						cmd->nsid == 0xffffffff))
+		return NVME_SC_INVALID_NS | NVME_SC_DNR;
+
+	switch (cmd->opcode) {
+	case nvme_cmd_resv_register:
+	case nvme_cmd_resv_report:
+	case nvme_cmd_resv_acquire:
+	case nvme_cmd_resv_release:
+		status = emu_resv(c, cmd);
+		emu_complete(c, 0, cmd->opcode, 0, 0, 0);
+		return status;
+	case nvme_cmd_flush:
+		len = 0;
+		break;
+	case nvme_cmd_dsm:
+		if (emu_resv_conflict(c, 1))
+			return NVME_SC_RESERVATION_CONFLICT;
+		len = 0;
+		break;
+	case nvme_cmd_read:
+	case nvme_cmd_write:
+	case nvme_cmd_compare:
+	case nvme_cmd_write_zeroes:
+	case nvme_cmd_write_uncor:
+		if (slba + nlb > c->st->nsze || slba + nlb < slba)
+			return NVME_SC_LBA_RANGE | NVME_SC_DNR;
+		if (cmd->opcode != nvme_cmd_write_zeroes &&
+				cmd->opcode != nvme_cmd_write_uncor &&
+				(!buf || cmd->data_len < len))
+			return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		if (emu_resv_conflict(c, cmd->opcode != nvme_cmd_read &&
+				cmd->opcode != nvme_cmd_compare))
+			return NVME_SC_RESERVATION_CONFLICT;
+		break;
+	default:
+		return NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+	}
+
+	if (cmd->opcode != nvme_cmd_flush && cmd->opcode != nvme_cmd_dsm) {
+		pthread_mutex_lock(&c->lock);
+		if (cmd->opcode == nvme_cmd_write_uncor)
+			status = emu_uncor_mark(c->st, slba, nlb);
+		else if (cmd->opcode == nvme_cmd_read ||
+					cmd->opcode == nvme_cmd_compare) {
+			marked = emu_uncor_hit(c->st, slba, nlb);
+			if (marked || (slba < c->weak.slba + c->weak.nlb &&
+					c->weak.slba < slba + nlb)) {
+				extra = emu_recover(c, marked,
+					!!(cmd->cdw12 & (NVME_RW_LR << 16)),
+						&failed);
+				if (failed) {
+					status = NVME_SC_READ_ERROR;
+					c->st->media_errors++;
+				}
+			}
+		} else
+			emu_uncor_clear(c->st, slba, nlb);
+		pthread_mutex_unlock(&c->lock);
+		if (status) {
+			emu_complete(c, 0, cmd->opcode, slba, 0, extra);
+			return status;
+		}
+	}
+
+	switch (cmd->opcode) {
+	case nvme_cmd_read:
+		memcpy(buf, c->data + off, len);
+		__sync_fetch_and_add(&c->st->bytes_read, len);
+		__sync_fetch_and_add(&c->st->host_reads, 1);
+		break;
+	case nvme_cmd_compare:
+		if (memcmp(buf, c->data + off, len))
+			status = NVME_SC_COMPARE_FAILED;
+		__sync_fetch_and_add(&c->st->host_reads, 1);
+		break;
+	case nvme_cmd_write:
+		memcpy(c->data + off, buf, len);
+		__sync_fetch_and_add(&c->st->bytes_written, len);
+		__sync_fetch_and_add(&c->st->host_writes, 1);
+		break;
+	case nvme_cmd_write_zeroes:
+		emu_discard(c, off, len);
+		__sync_fetch_and_add(&c->st->host_writes, 1);
+		break;
+	}
+	emu_complete(c, 0, cmd->opcode, slba, len, extra);
+	return status;
+}
+
+static int emu_parse_time(const char *s, double *ns)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (end == s || v < 0)
+		return -1;
+	if (!strcmp(end, "ns"))
+		*ns = v;
+	else if (!strcmp(end, "us") || !*end)
+		*ns = v * 1e3;
+	else if (!strcmp(end, "ms"))
+		*ns = v * 1e6;
+	else if (!strcmp(end, "s"))
+		*ns = v * 1e9;
+	else
+		return -1;
+	return 0;
+}
+
+static int emu_parse_size(const char *s, __u64 *val)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
+
+	if (end == s)
+		return -1;
+	switch (*end) {
+	case 'T': v <<= 10;
+	case 'G': v <<= 10;
+	case 'M': v <<= 10;
+	case 'K': v <<= 10;
+		end++;
+	}
+	if (*end)
+		return -1;
+	*val = v;
+	return 0;
+}
+
+/*
+ * <time>, fixed:<time>, uniform:<lo>:<hi>, exp:<mean>, normal:<mean>:<sd>
+ * or lognormal:<median>:<sigma>, optionally followed by /<prob>:<time> for
+ * a tail added with the given probability.
+ */
+static int emu_parse_dist(char *s, struct emu_dist *d)
+{
+	static const char *kinds[] = {
+		[EMU_DIST_FIXED] = "fixed",
+		[EMU_DIST_UNIFORM] = "uniform",
+		[EMU_DIST_EXP] = "exp",
+		[EMU_DIST_NORMAL] = "normal",
+		[EMU_DIST_LOGNORMAL] = "lognormal",
+	};
+	char *tail = strchr(s, '/'), *a, *b;
+	unsigned int i;
+
+	memset(d, 0, sizeof(*d));
+	if (tail) {
+		*tail++ = '\0';
+		a = strchr(tail, ':');
+		if (!a)
+			return -1;
+		*a++ = '\0';
+		d->tail_p = strtod(tail, &b);
+		if (*b || d->tail_p < 0 || d->tail_p > 1 ||
+						emu_parse_time(a, &d->tail))
+			return -1;
+	}
+
+	a = strchr(s, ':');
+	if (!a)
+		return emu_parse_time(s, &d->a);
+	*a++ = '\0';
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+		if (!strcmp(s, kinds[i]))
+			break;
+	if (i == sizeof(kinds) / sizeof(kinds[0]))
+		return -1;
+	d->kind = i;
+
+	b = strchr(a, ':');
+	if (b)
+		*b++ = '\0';
+	if ((i == EMU_DIST_FIXED || i == EMU_DIST_EXP) != !b)
+		return -1;
+	if (emu_parse_time(a, &d->a))
+		return -1;
+	if (i == EMU_DIST_LOGNORMAL) {
+		d->b = strtod(b, &a);
+		return *a || d->b < 0 ? -1 : 0;
+	}
+	return b ? emu_parse_time(b, &d->b) : 0;
+}
+
+static int emu_parse(struct emu_ctrl *c, char *spec);
+
+static int emu_parse_file(struct emu_ctrl *c, const char *path)
+{
+	char line[512];
+	FILE *f = fopen(path, "r");
+	int err = 0;
+
+	if (!f)
+		return -1;
+	while (!err && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		err = emu_parse(c, line);
+	}
+	fclose(f);
+	return err;
+}
+
+static const struct {
+	const char *name;
+	__u8 opcode;
+} emu_io_names[] = {
+	{ "flush", nvme_cmd_flush },
+	{ "write", nvme_cmd_write },
+	{ "read", nvme_cmd_read },
+	{ "compare", nvme_cmd_compare },
+	{ "write-zeroes", nvme_cmd_write_zeroes },
+	{ "dsm", nvme_cmd_dsm },
+	{ "resv-register", nvme_cmd_resv_register },
+	{ "resv-report", nvme_cmd_resv_report },
+	{ "resv-acquire", nvme_cmd_resv_acquire },
+	{ "resv-release", nvme_cmd_resv_release },
+};
+
+static int emu_set(struct emu_ctrl *c, char *key, char *val)
+{
+	__u64 v;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(emu_io_names) / sizeof(emu_io_names[0]); i++)
+		if (!strcmp(key, emu_io_names[i].name))
+			return emu_parse_dist(val,
+					&c->io[emu_io_names[i].opcode]);
+
+	if (!strcmp(key, "file"))
+		return emu_parse_file(c, val);
+	if (!strcmp(key, "state")) {
+		free(c->state_path);
+		c->state_path = strdup(val);
+		return c->state_path ? 0 : -1;
+	}
+	if (!strcmp(key, "admin"))
+		return emu_parse_dist(val, &c->admin);
+	if (!strcmp(key, "recovery"))
+		return emu_parse_dist(val, &c->recovery);
+	if (!strcmp(key, "lr-limit"))
+		return emu_parse_time(val, &c->lr_limit);
+	if (!strcmp(key, "weak")) {
+		char *end;
+
+		c->weak.slba = strtoull(val, &end, 0);
+		if (*end != ':')
+			return -1;
+		c->weak.nlb = strtoull(end + 1, &end, 0);
+		return *end ? -1 : 0;
+	}
+	if (!strcmp(key, "gc"))
+		return emu_parse_dist(val, &c->gc);
+	if (!strcmp(key, "rcache-hit"))
+		return emu_parse_dist(val, &c->rcache_hit);
+	if (!strcmp(key, "apst"))
+		return emu_parse_time(val, &c->apst);
+	if (!strcmp(key, "cool"))
+		return emu_parse_time(val, &c->cool) || c->cool <= 0 ? -1 : 0;
+	if (!strcmp(key, "heat") || !strcmp(key, "ambient") ||
+						!strcmp(key, "throttle")) {
+		char *end;
+		double d = strtod(val, &end);
+
+		if (*end || d < 0)
+			return -1;
+		if (key[0] == 'h')
+			c->heat = d;
+		else if (key[0] == 'a')
+			c->ambient = d + 273;
+		else if (d >= 1)
+			c->throttle = d;
+		else
+			return -1;
+		return 0;
+	}
+	if (!strcmp(key, "delay")) {
+		if (emu_parse_dist(val, &c->admin))
+			return -1;
+		for (i = 0; i < 256; i++)
+			c->io[i] = c->admin;
+		return 0;
+	}
+	if (!strcmp(key, "clock")) {
+		if (strcmp(val, "real") && strcmp(val, "virtual"))
+			return -1;
+		c->virt = !strcmp(val, "virtual");
+		return 0;
+	}
+
+	if (emu_parse_size(val, &v))
+		return -1;
+	if (!strcmp(key, "size"))
+		c->size = v;
+	else if (!strcmp(key, "bs")) {
+		if (v < 512 || v > 65536 || (v & (v - 1)))
+			return -1;
+		c->lba_shift = ffs(v) - 1;
+	} else if (!strcmp(key, "ctrl") && v && v <= EMU_MAX_CTRLS)
+		c->cntlid = v;
+	else if (!strcmp(key, "ctrls") && v && v <= EMU_MAX_CTRLS)
+		c->nr_ctrls = v;
+	else if (!strcmp(key, "hostid") && v)
+		c->hostid = v;
+	else if (!strcmp(key, "seed"))
+		c->rng = v ? v : 1;
+	else if (!strcmp(key, "channels") && v && v <= EMU_MAX_UNITS)
+		c->channels = v;
+	else if (!strcmp(key, "dies") && v && v <= EMU_MAX_UNITS)
+		c->dies = v;
+	else if (!strcmp(key, "stripe") && v)
+		c->stripe = v;
+	else if (!strcmp(key, "xfer"))
+		c->xfer = v;
+	else if (!strcmp(key, "cache"))
+		c->cache = v;
+	else if (!strcmp(key, "drain") && v)
+		c->drain = v;
+	else if (!strcmp(key, "gc-every"))
+		c->gc_every = v;
+	else if (!strcmp(key, "rcache"))
+		c->rcache = v;
+	else if (!strcmp(key, "page") && v && !(v & (v - 1)))
+		c->page = v;
+	else if (!strcmp(key, "boundary") && v <= 65536)
+		c->boundary = v;
+	else
+		return -1;
+	return 0;
+}
+
+static int emu_parse(struct emu_ctrl *c, char *spec)
+{
+	char *tok, *save, *val;
+
+	for (tok = strtok_r(spec, ", \t", &save); tok;
+				tok = strtok_r(NULL, ", \t", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			fprintf(stderr, "emu: expected <key>=<value>: %s\n",
+									tok);
+			return -1;
+		}
+		*val++ = '\0';
+		if (emu_set(c, tok, val)) {
+			fprintf(stderr, "emu: bad value for %s: %s\n", tok,
+									val);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int emu_map(struct emu_ctrl *c)
+{
+	struct emu_state hdr;
+	struct stat sb;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, err;
+	int fresh = 1;
+	void *map;
+
+	c->sfd = -1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, EMU_MAGIC, sizeof(hdr.magic));
+	hdr.lba_shift = c->lba_shift;
+	hdr.nsze = c->size >> c->lba_shift;
+	if (!hdr.nsze) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (c->state_path) {
+		c->sfd = open(c->state_path, O_RDWR | O_CREAT, 0644);
+		if (c->sfd < 0 || fstat(c->sfd, &sb) < 0)
+			goto err;
+		if (sb.st_size >= EMU_HDR_SIZE) {
+			/* an existing state file keeps its own geometry */
+			if (pread(c->sfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+				goto err;
+			if (memcmp(hdr.magic, EMU_MAGIC, sizeof(hdr.magic))) {
+				fprintf(stderr, "emu: %s is not a state file\n",
+								c->state_path);
+				errno = EINVAL;
+				goto err;
+			}
+			fresh = 0;
+		} else if (ftruncate(c->sfd, EMU_HDR_SIZE +
+				(hdr.nsze << hdr.lba_shift)) < 0 ||
+				pwrite(c->sfd, &hdr, sizeof(hdr), 0) !=
+								sizeof(hdr))
+			goto err;
+		flags = MAP_SHARED | MAP_NORESERVE;
+	}
+
+	c->map_size = EMU_HDR_SIZE + (hdr.nsze << hdr.lba_shift);
+	map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, flags, c->sfd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+	c->st = map;
+	c->data = (__u8 *)map + EMU_HDR_SIZE;
+	c->lba_shift = hdr.lba_shift;
+
+	if (fresh) {
+		int i;
+
+		memcpy(c->st, &hdr, sizeof(hdr));
+		c->st->power_cycles = 1;
+		c->st->features[NVME_FEAT_TEMP_THRESH] = 343;
+		c->st->features[NVME_FEAT_VOLATILE_WC] = !!c->cache;
+		c->st->features[NVME_FEAT_NUM_QUEUES] = 63 | 63 << 16;
+		c->st->nr_ctrls = c->nr_ctrls > c->cntlid ? c->nr_ctrls :
+								c->cntlid;
+		for (i = 0; i < EMU_MAX_CTRLS; i++)
+			c->st->hostid[i] = i + 1;
+	}
+	if (c->cntlid > c->st->nr_ctrls) {
+		fprintf(stderr, "emu: controller %u of %u\n", c->cntlid,
+							c->st->nr_ctrls);
+		munmap(map, c->map_size);
+		c->st = NULL;
+		errno = EINVAL;
+		goto err;
+	}
+	if (c->hostid)
+		*emu_hostid(c) = c->hostid;
+	return 0;
+ err:
+	err = errno;
+	if (c->sfd >= 0)
+		close(c->sfd);
+	c->sfd = -1;
+	errno = err;
+	return -1;
+}
+
+static void emu_free(struct emu_ctrl *c)
+{
+	if (c->st)
+		munmap(c->st, c->map_size);
+	if (c->sfd >= 0)
+		close(c->sfd);
+	pthread_mutex_destroy(&c->lock);
+	free(c->state_path);
+	free(c->rc_tag);
+	free(c->rc_used);
+	free(c);
+}
+
+int emu_open(const char *spec)
+{
+	struct emu_ctrl *c;
+	char *s;
+	int fd, err;
+
+	c = calloc(1, sizeof(*c));
+	s = strdup(spec);
+	if (!c || !s) {
+		free(c);
+		free(s);
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->sfd = -1;
+	c->size = 1ULL << 30;
+	c->lba_shift = 9;
+	c->cntlid = c->nr_ctrls = 1;
+	c->channels = c->dies = 1;
+	c->stripe = 128 << 10;
+	c->drain = 1e9;
+	c->rng = 1;
+	c->rcache_hit.a = 10000;
+	c->recovery.a = 10000000;
+	c->lr_limit = 1000000;
+	c->ambient = 308;
+	c->cool = 60e9;
+	c->throttle = 2;
+
+	if (emu_parse(c, s)) {
+		free(s);
+		emu_free(c);
+		errno = EINVAL;
+		return -1;
+	}
+	free(s);
+	if (c->channels * c->dies > EMU_MAX_UNITS) {
+		fprintf(stderr, "emu: at most %d channels * dies\n",
+							EMU_MAX_UNITS);
+		emu_free(c);
+		errno = EINVAL;
+		return -1;
+	}
+	if (c->rcache) {
+		c->rc_sets = c->rcache / EMU_RC_LINE / EMU_RC_WAYS;
+		if (!c->rc_sets)
+			c->rc_sets = 1;
+		c->rc_tag = calloc(c->rc_sets * EMU_RC_WAYS, sizeof(__u64));
+		c->rc_used = calloc(c->rc_sets * EMU_RC_WAYS, sizeof(__u64));
+		if (!c->rc_tag || !c->rc_used) {
+			errno = ENOMEM;
+			goto err;
+		}
+	}
+	if (emu_map(c) < 0)
+		goto err;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		goto err;
+	if (fd >= EMU_MAX_FDS) {
+		close(fd);
+		errno = EMFILE;
+		goto err;
+	}
+	c->base = emu_mono();
+	c->temp = c->ambient;
+	if (c->apst)
+		emu_apst_init(c);
+	pthread_mutex_lock(&emu_lock);
+	emu_ctrls[fd] = c;
+	pthread_mutex_unlock(&emu_lock);
+	return fd;
+ err:
+	err = errno;
+	emu_free(c);
+	errno = err;
+	return -1;
+}
+
+int emu_fd(int fd)
+{
+	int ret;
+
+	if (fd < 0 || fd >= EMU_MAX_FDS)
+		return 0;
+	pthread_mutex_lock(&emu_lock);
+	ret = emu_ctrls[fd] != NULL;
+	pthread_mutex_unlock(&emu_lock);
+	return ret;
+}
+
+int emu_close(int fd)
+{
+	struct emu_ctrl *c;
+
+	pthread_mutex_lock(&emu_lock);
+	c = emu_ctrls[fd];
+	emu_ctrls[fd] = NULL;
+	pthread_mutex_unlock(&emu_lock);
+	emu_free(c);
+	return close(fd);
+}
+
+int emu_ioctl(int fd, unsigned long req, void *arg)
+{
+	struct emu_ctrl *c = emu_ctrls[fd];
+	struct nvme_user_io *io = arg;
+	struct nvme_passthru_cmd cmd;
+
+	switch (req) {
+	case NVME_IOCTL_ID:
+		return EMU_NSID;
+	case NVME_IOCTL_ADMIN_CMD:
+		return emu_admin(c, arg);
+	case NVME_IOCTL_IO_CMD:
+		return emu_io(c, arg);
+	case NVME_IOCTL_SUBMIT_IO:
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.opcode = io->opcode;
+		cmd.nsid = EMU_NSID;
+		cmd.addr = io->addr;
+		cmd.data_len = (io->nblocks + 1) << c->st->lba_shift;
+		cmd.cdw10 = io->slba;
+		cmd.cdw11 = io->slba >> 32;
+		cmd.cdw12 = io->nblocks | io->control << 16;
+		cmd.cdw13 = io->dsmgmt;
+		return emu_io(c, &cmd);
+	case BLKRRPART:
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
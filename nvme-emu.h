@@ -0,0 +1,31 @@
+/*
+ * nvme-emu.h -- emulated NVMe controllers for the nvme utility.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NVME_EMU_H
+#define _NVME_EMU_H
+
+/*
+ * A device argument of the form "emu:<key>=<value>,..." opens an emulated
+ * controller instead of a kernel device. The returned descriptor is a real
+ * one (to /dev/null) so it can be fstat'ed and closed like any other, but
+ * its ioctls must go through emu_ioctl().
+ */
+#define EMU_PREFIX	"emu:"
+
+int emu_open(const char *spec);
+int emu_close(int fd);
+int emu_fd(int fd);
+int emu_ioctl(int fd, unsigned long req, void *arg);
+
+#endif /* _NVME_EMU_H */
@@ -21,14 +21,21 @@
  * This program uses NVMe IOCTLs to run native nvme commands to a device.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef LIBUDEV_EXISTS
 #include <libudev.h>
@@ -42,6 +49,7 @@
 #include <sys/stat.h>
 
 #include "linux/nvme.h"
+#include "nvme-emu.h"
 
 static int fd;
 static struct stat nvme_stat;
@@ -66,6 +74,7 @@ static const char *devicename;
 	ENTRY(IO_PASSTHRU, "io-passthru", "Submit an arbitrary IO command, return results", io_passthru) \
 	ENTRY(SECURITY_SEND, "security-send", "Submit a Security Send command, return results", sec_send) \
 	ENTRY(SECURITY_RECV, "security-recv", "Submit a Security Receive command, return results", sec_recv) \
+	ENTRY(SECURITY_SESSION, "security-session", "Run a script of Security Send/Receive exchanges on devices", sec_session) \
 	ENTRY(RESV_ACQUIRE, "resv-acquire", "Submit a Reservation Acquire, return results", resv_acquire) \
 	ENTRY(RESV_REGISTER, "resv-register", "Submit a Reservation Register, return results", resv_register) \
 	ENTRY(RESV_RELEASE, "resv-release", "Submit a Reservation Release, return results", resv_release) \
@@ -75,6 +84,21 @@ static const char *devicename;
 	ENTRY(READ_CMD, "read", "Submit a read command, return results", read_cmd) \
 	ENTRY(WRITE_CMD, "write", "Submit a write command, return results", write_cmd) \
 	ENTRY(REGISTERS, "show-regs", "Shows the controller registers. Requires admin character device", show_registers) \
+	ENTRY(SNAPSHOT, "snapshot", "Capture identify and log data from many devices into a columnar file", snapshot) \
+	ENTRY(QUERY, "query", "Filter and aggregate columns of snapshot files", query) \
+	ENTRY(INTERFERENCE, "interference", "Measure foreground I/O latency with and without admin polling", interference) \
+	ENTRY(LAT_LOG, "lat-log", "Decode a per-I/O latency log to CSV or histograms", lat_log) \
+	ENTRY(ENDURANCE, "endurance", "Write at a drive-writes-per-day rate while tracking SMART wear", endurance) \
+	ENTRY(READ_DISTURB, "read-disturb", "Hammer a hot region with reads and watch its neighbors for drift and errors", read_disturb) \
+	ENTRY(PROFILE_FROM_SMART, "profile-from-smart", "Derive a replayable workload from two SMART logs", profile_from_smart) \
+	ENTRY(DATA_REDUCTION, "data-reduction", "Detect controller compression and deduplication", data_reduction) \
+	ENTRY(READ_CACHE, "read-cache", "Find the controller read cache size and hit latency", read_cache) \
+	ENTRY(ALIGNMENT, "alignment", "Measure misaligned and atomic boundary crossing I/O penalties", alignment) \
+	ENTRY(THERMAL, "thermal", "Characterize thermal throttling under sustained writes", thermal) \
+	ENTRY(APST, "apst", "Measure autonomous power state wake latency", apst) \
+	ENTRY(WRITE_UNCOR, "write-uncor", "Mark LBA ranges uncorrectable", write_uncor) \
+	ENTRY(UNCOR_LATENCY, "uncor-latency", "Time reads of uncorrectable ranges", uncor_latency) \
+	ENTRY(TLER_SWEEP, "tler-sweep", "Sweep error recovery time limits on bad ranges", tler_sweep) \
 	ENTRY(HELP, "help", "Display this help", help)
 
 #define ENTRY(i, n, h, f) \
@@ -110,11 +134,32 @@ struct command commands[] = {
 	#undef ENTRY
 };
 
+static int nvme_open(const char *path)
+{
+	if (!strncmp(path, EMU_PREFIX, strlen(EMU_PREFIX)))
+		return emu_open(path + strlen(EMU_PREFIX));
+	return open(path, O_RDONLY);
+}
+
+static int nvme_close(int fd)
+{
+	if (emu_fd(fd))
+		return emu_close(fd);
+	return close(fd);
+}
+
+static int nvme_ioctl(int fd, unsigned long req, void *arg)
+{
+	if (emu_fd(fd))
+		return emu_ioctl(fd, req, arg);
+	return ioctl(fd, req, arg);
+}
+
 static void open_dev(const char *dev)
 {
 	int err;
 	devicename = dev;
-	fd = open(dev, O_RDONLY);
+	fd = nvme_open(dev);
 	if (fd < 0)
 		goto perror;
 
@@ -149,6 +194,14 @@ static void get_long(char *optarg, __u64 *val)
 	exit(EINVAL);
 }
 
+static void get_double(char *optarg, double *val)
+{
+	if (sscanf(optarg, "%lf", val) == 1)
+		return;
+	fprintf(stderr, "bad param for command value:%s\n", optarg);
+	exit(EINVAL);
+}
+
 static void get_int(char *optarg, __u32 *val)
 {
 	if (sscanf(optarg, "%i", val) == 1)
@@ -173,24 +226,587 @@ static void get_byte(char *optarg, __u8 *val)
 	exit(EINVAL);
 }
 
-static void show_error_log(struct nvme_error_log_page *err_log, int entries)
+static __uint128_t int128_to_u128(const __u8 *data)
 {
+	__uint128_t result = 0;
 	int i;
-	
+
+	for (i = 15; i >= 0; i--)
+		result = (result << 8) | data[i];
+	return result;
+}
+
+/* 39 digits, with a multibyte separator between each for 1 digit groups */
+#define U128_STR_LEN	(39 + 38 * MB_LEN_MAX + 1)
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+static char *u64_digits(uint64_t val, char *end, int min_digits)
+{
+	char *p = end;
+
+	while (val >= 100) {
+		unsigned int r = val % 100;
+
+		val /= 100;
+		p -= 2;
+		memcpy(p, &digit_pairs[r * 2], 2);
+	}
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[val * 2], 2);
+	} else
+		*--p = '0' + val;
+	while (end - p < min_digits)
+		*--p = '0';
+	return p;
+}
+
+/*
+ * Formats val in decimal into buf, which must hold U128_STR_LEN bytes, and
+ * returns buf. When 'group' is set, digits are grouped with the thousands
+ * separator and grouping of the current locale, like printf's ' flag; the
+ * locale is read on every call so a later setlocale() takes effect.
+ */
+static char *u128_to_str(__uint128_t val, char *buf, int group)
+{
+	char digits[40], *p, *end = digits + sizeof(digits);
+	char out[U128_STR_LEN], *q = out + sizeof(out);
+	const char *sep, *grouping;
+	int n, i, seplen, size, cnt;
+	struct lconv *lc;
+
+	p = end;
+	while (val > UINT64_MAX) {
+		uint64_t lo = val % 10000000000000000000ULL;
+
+		val /= 10000000000000000000ULL;
+		p = u64_digits(lo, p, 19);
+	}
+	p = u64_digits(val, p, 1);
+	n = end - p;
+
+	if (!group) {
+		memcpy(buf, p, n);
+		buf[n] = '\0';
+		return buf;
+	}
+
+	lc = localeconv();
+	sep = lc->thousands_sep;
+	seplen = strlen(sep);
+	if (seplen > MB_LEN_MAX)
+		seplen = 0;
+	grouping = lc->grouping;
+	size = *grouping > 0 && *grouping < CHAR_MAX ? *grouping : 0;
+	if (!seplen)
+		size = 0;
+
+	/*
+	 * Build from the least significant digit. Each grouping entry sizes
+	 * the next group to the left, the last one repeats and CHAR_MAX or a
+	 * negative one ends grouping.
+	 */
+	*--q = '\0';
+	for (i = n - 1, cnt = 0; i >= 0; i--, cnt++) {
+		if (size && cnt == size) {
+			q -= seplen;
+			memcpy(q, sep, seplen);
+			cnt = 0;
+			if (grouping[1]) {
+				grouping++;
+				size = *grouping > 0 && *grouping < CHAR_MAX ?
+								*grouping : 0;
+			}
+		}
+		*--q = p[i];
+	}
+	memcpy(buf, q, out + sizeof(out) - q);
+	return buf;
+}
+
+static char *i128_to_str(__int128 val, char *buf)
+{
+	if (val >= 0)
+		return u128_to_str(val, buf, 0);
+	buf[0] = '-';
+	u128_to_str(-(__uint128_t)val, buf + 1, 0);
+	return buf;
+}
+
+enum field_fmt {
+	FIELD_DEC,		/* unsigned decimal */
+	FIELD_HEX,		/* hex with 0x prefix */
+	FIELD_XNUM,		/* hex without prefix */
+	FIELD_STR,		/* fixed width ascii, not nul terminated */
+	FIELD_BYTES,		/* each byte in hex, in memory order */
+	FIELD_INT128,		/* 128-bit little endian counter */
+	FIELD_INT128_GROUP,	/* as above, with locale digit grouping */
+	FIELD_TEMP,		/* Kelvin, shown in Celsius */
+	FIELD_PCT,		/* percentage */
+};
+
+/*
+ * Describes one field of a structure returned by the device so a single
+ * field can be located and printed without decoding the rest of it.
+ */
+struct field_desc {
+	const char *name;
+	unsigned short offset;
+	unsigned short width;
+	enum field_fmt fmt;
+};
+
+#define FIELD(type, name, member, fmt) \
+	{ name, offsetof(type, member), sizeof(((type *)0)->member), fmt }
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const struct field_desc id_ctrl_fields[] = {
+	FIELD(struct nvme_id_ctrl, "vid", vid, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "ssvid", ssvid, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "sn", sn, FIELD_STR),
+	FIELD(struct nvme_id_ctrl, "mn", mn, FIELD_STR),
+	FIELD(struct nvme_id_ctrl, "fr", fr, FIELD_STR),
+	FIELD(struct nvme_id_ctrl, "rab", rab, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "ieee", ieee, FIELD_BYTES),
+	FIELD(struct nvme_id_ctrl, "cmic", cmic, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "mdts", mdts, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "cntlid", cntlid, FIELD_XNUM),
+	FIELD(struct nvme_id_ctrl, "ver", ver, FIELD_XNUM),
+	FIELD(struct nvme_id_ctrl, "rtd3r", rtd3r, FIELD_XNUM),
+	FIELD(struct nvme_id_ctrl, "rtd3e", rtd3e, FIELD_XNUM),
+	FIELD(struct nvme_id_ctrl, "oacs", oacs, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "acl", acl, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "aerl", aerl, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "frmw", frmw, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "lpa", lpa, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "elpe", elpe, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "npss", npss, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "avscc", avscc, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "apsta", apsta, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "wctemp", wctemp, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "cctemp", cctemp, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "mtfa", mtfa, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "hmmin", hmmin, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "tnvmcap", tnvmcap, FIELD_INT128),
+	FIELD(struct nvme_id_ctrl, "unvmcap", unvmcap, FIELD_INT128),
+	FIELD(struct nvme_id_ctrl, "rpmbs", rpmbs, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "sqes", sqes, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "cqes", cqes, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "nn", nn, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "oncs", oncs, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "fuses", fuses, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "fna", fna, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "vwc", vwc, FIELD_HEX),
+	FIELD(struct nvme_id_ctrl, "awun", awun, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "awupf", awupf, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "nvscc", nvscc, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "acwu", acwu, FIELD_DEC),
+	FIELD(struct nvme_id_ctrl, "sgls", sgls, FIELD_DEC),
+};
+
+static const struct field_desc id_ns_fields[] = {
+	FIELD(struct nvme_id_ns, "nsze", nsze, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "ncap", ncap, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "nuse", nuse, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "nsfeat", nsfeat, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "nlbaf", nlbaf, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "flbas", flbas, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "mc", mc, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "dpc", dpc, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "dps", dps, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "nmic", nmic, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "rescap", rescap, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "fpi", fpi, FIELD_HEX),
+	FIELD(struct nvme_id_ns, "nawun", nawun, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nawupf", nawupf, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nacwu", nacwu, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nabsn", nabsn, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nabo", nabo, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nabspf", nabspf, FIELD_DEC),
+	FIELD(struct nvme_id_ns, "nvmcap", nvmcap, FIELD_INT128),
+	FIELD(struct nvme_id_ns, "nguid", nguid, FIELD_BYTES),
+	FIELD(struct nvme_id_ns, "eui64", eui64, FIELD_BYTES),
+};
+
+static const struct field_desc smart_log_fields[] = {
+	FIELD(struct nvme_smart_log, "critical_warning", critical_warning, FIELD_HEX),
+	FIELD(struct nvme_smart_log, "temperature", temperature, FIELD_TEMP),
+	FIELD(struct nvme_smart_log, "available_spare", avail_spare, FIELD_PCT),
+	FIELD(struct nvme_smart_log, "available_spare_threshold", spare_thresh, FIELD_PCT),
+	FIELD(struct nvme_smart_log, "percentage_used", percent_used, FIELD_PCT),
+	FIELD(struct nvme_smart_log, "data_units_read", data_units_read, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "data_units_written", data_units_written, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "host_read_commands", host_reads, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "host_write_commands", host_writes, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "controller_busy_time", ctrl_busy_time, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "power_cycles", power_cycles, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "power_on_hours", power_on_hours, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "unsafe_shutdowns", unsafe_shutdowns, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "media_errors", media_errors, FIELD_INT128_GROUP),
+	FIELD(struct nvme_smart_log, "num_err_log_entries", num_err_log_entries, FIELD_INT128_GROUP),
+};
+
+/* identify controller values alert rules may compare against */
+static const struct field_desc alert_ctrl_fields[] = {
+	FIELD(struct nvme_id_ctrl, "wctemp", wctemp, FIELD_TEMP),
+	FIELD(struct nvme_id_ctrl, "cctemp", cctemp, FIELD_TEMP),
+};
+
+static const struct field_desc regs_fields[] = {
+	FIELD(struct nvme_bar, "cap", cap, FIELD_XNUM),
+	FIELD(struct nvme_bar, "version", vs, FIELD_XNUM),
+	FIELD(struct nvme_bar, "intms", intms, FIELD_XNUM),
+	FIELD(struct nvme_bar, "intmc", intmc, FIELD_XNUM),
+	FIELD(struct nvme_bar, "cc", cc, FIELD_XNUM),
+	FIELD(struct nvme_bar, "csts", csts, FIELD_XNUM),
+	FIELD(struct nvme_bar, "nssr", nssr, FIELD_XNUM),
+	FIELD(struct nvme_bar, "aqa", aqa, FIELD_XNUM),
+	FIELD(struct nvme_bar, "asq", asq, FIELD_XNUM),
+	FIELD(struct nvme_bar, "acq", acq, FIELD_XNUM),
+	FIELD(struct nvme_bar, "cmbloc", cmbloc, FIELD_XNUM),
+	FIELD(struct nvme_bar, "cmbsz", cmbsz, FIELD_XNUM),
+};
+
+static const struct field_desc error_log_fields[] = {
+	FIELD(struct nvme_error_log_page, "error_count", error_count, FIELD_DEC),
+	FIELD(struct nvme_error_log_page, "sqid", sqid, FIELD_DEC),
+	FIELD(struct nvme_error_log_page, "cmdid", cmdid, FIELD_HEX),
+	FIELD(struct nvme_error_log_page, "status_field", status_field, FIELD_HEX),
+	FIELD(struct nvme_error_log_page, "parm_err_loc", parm_error_location, FIELD_HEX),
+	FIELD(struct nvme_error_log_page, "lba", lba, FIELD_HEX),
+	FIELD(struct nvme_error_log_page, "nsid", nsid, FIELD_DEC),
+	FIELD(struct nvme_error_log_page, "vs", vs, FIELD_DEC),
+};
+
+static uint64_t field_int(const void *base, const struct field_desc *f)
+{
+	const __u8 *p = (const __u8 *)base + f->offset;
+	uint64_t val = 0;
+	int i;
+
+	for (i = f->width > 8 ? 7 : f->width - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+static void show_field(const void *base, const struct field_desc *f, int pad)
+{
+	const __u8 *p = (const __u8 *)base + f->offset;
+	char str[U128_STR_LEN];
+	int i;
+
+	printf("%-*s: ", pad, f->name);
+	switch (f->fmt) {
+	case FIELD_DEC:
+		printf("%"PRIu64"\n", field_int(base, f));
+		break;
+	case FIELD_HEX:
+		printf("%#"PRIx64"\n", field_int(base, f));
+		break;
+	case FIELD_XNUM:
+		printf("%"PRIx64"\n", field_int(base, f));
+		break;
+	case FIELD_STR:
+		printf("%.*s\n", f->width, (const char *)p);
+		break;
+	case FIELD_BYTES:
+		for (i = 0; i < f->width; i++)
+			printf("%02x", p[i]);
+		printf("\n");
+		break;
+	case FIELD_INT128:
+	case FIELD_INT128_GROUP:
+		puts(u128_to_str(int128_to_u128(p), str,
+					f->fmt == FIELD_INT128_GROUP));
+		break;
+	case FIELD_TEMP:
+		printf("%u C\n", (unsigned int)field_int(base, f) - 273);
+		break;
+	case FIELD_PCT:
+		printf("%u%%\n", (unsigned int)field_int(base, f));
+		break;
+	}
+}
+
+static void show_fields(const void *base, const struct field_desc **sel,
+							int nr, int pad)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		show_field(base, sel[i], pad);
+}
+
+/*
+ * Resolves a comma separated list of field names against a descriptor
+ * table. Returns the number of fields placed in 'sel', or -1 if a name is
+ * unknown or more names were given than the table holds.
+ */
+static int parse_fields(char *list, const struct field_desc *table, int nr,
+					const struct field_desc **sel)
+{
+	char *name, *save = NULL;
+	int i, n = 0;
+
+	for (name = strtok_r(list, ",", &save); name;
+					name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < nr; i++)
+			if (!strcmp(name, table[i].name))
+				break;
+		if (i == nr) {
+			fprintf(stderr, "unknown field:%s, valid fields are:\n",
+									name);
+			for (i = 0; i < nr; i++)
+				fprintf(stderr, "  %s\n", table[i].name);
+			return -1;
+		}
+		if (n == nr) {
+			fprintf(stderr, "too many fields requested\n");
+			return -1;
+		}
+		sel[n++] = &table[i];
+	}
+	return n;
+}
+
+/* numeric value of a field as it is displayed, temperatures in Celsius */
+static __int128 field_value(const void *base, const struct field_desc *f)
+{
+	if (f->fmt == FIELD_INT128 || f->fmt == FIELD_INT128_GROUP)
+		return int128_to_u128((const __u8 *)base + f->offset);
+	if (f->fmt == FIELD_TEMP)
+		return (__int128)field_int(base, f) - 273;
+	return field_int(base, f);
+}
+
+static const struct field_desc *find_field(const struct field_desc *table,
+						int nr, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(name, table[i].name))
+			return &table[i];
+	return NULL;
+}
+
+/*
+ * Alert rules for watch modes, e.g. "temperature > wctemp-5",
+ * "available_spare < available_spare_threshold", "media_errors increases"
+ * or "critical_warning & 0x4". Every new sample updates each rule's state
+ * and only changes between raised and clear are reported. Comparisons take
+ * an optional "hyst=<n>" margin the value has to move back past before the
+ * alert clears, and any rule takes "for=<n>" to require that many
+ * consecutive samples before its state changes.
+ */
+enum {
+	ALERT_LT, ALERT_LE, ALERT_GT, ALERT_GE, ALERT_EQ, ALERT_NE,
+	ALERT_AND, ALERT_INC,
+};
+
+struct alert_rule {
+	const char *text;
+	const struct field_desc *field;
+	int op;
+	const struct field_desc *ref;
+	int ref_ctx;
+	__int128 constant;
+	__int128 hyst;
+	int samples;
+
+	int active;
+	int streak;
+	int have_prev;
+	__int128 prev;
+};
+
+static const char *skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+static const char *parse_ident(const char *p, char *name, size_t len)
+{
+	size_t n = 0;
+
+	while ((p[n] >= 'a' && p[n] <= 'z') || (p[n] >= '0' && p[n] <= '9') ||
+								p[n] == '_')
+		n++;
+	if (!n || n >= len || (p[0] >= '0' && p[0] <= '9'))
+		return NULL;
+	memcpy(name, p, n);
+	name[n] = '\0';
+	return p + n;
+}
+
+/*
+ * Parses one rule. Names are looked up first in the sampled structure's
+ * table, then in the context table (e.g. identify controller fields) whose
+ * values are fixed for the whole watch.
+ */
+static int parse_alert(const char *text, struct alert_rule *r,
+		const struct field_desc *table, int nr,
+		const struct field_desc *ctx, int nr_ctx)
+{
+	static const struct { const char *s; int op; } ops[] = {
+		{ "<=", ALERT_LE }, { ">=", ALERT_GE }, { "==", ALERT_EQ },
+		{ "!=", ALERT_NE }, { "<", ALERT_LT }, { ">", ALERT_GT },
+		{ "=", ALERT_EQ }, { "&", ALERT_AND },
+		{ "increases", ALERT_INC },
+	};
+	const char *p = skip_ws(text), *q;
+	char name[32], *end;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->text = text;
+	r->samples = 1;
+
+	p = parse_ident(p, name, sizeof(name));
+	if (!p || !(r->field = find_field(table, nr, name)))
+		goto bad;
+	p = skip_ws(p);
+	for (i = 0; i < ARRAY_SIZE(ops); i++)
+		if (!strncmp(p, ops[i].s, strlen(ops[i].s)))
+			break;
+	if (i == ARRAY_SIZE(ops))
+		goto bad;
+	r->op = ops[i].op;
+	p = skip_ws(p + strlen(ops[i].s));
+
+	if (r->op != ALERT_INC) {
+		q = parse_ident(p, name, sizeof(name));
+		if (q && *q != '=') {
+			r->ref = find_field(table, nr, name);
+			if (!r->ref) {
+				r->ref = find_field(ctx, nr_ctx, name);
+				r->ref_ctx = 1;
+			}
+			if (!r->ref)
+				goto bad;
+			p = skip_ws(q);
+		}
+		if (*p == '+' || *p == '-' || (*p >= '0' && *p <= '9')) {
+			int neg = *p == '-';
+
+			if (*p == '+' || *p == '-')
+				p = skip_ws(p + 1);
+			r->constant = strtoll(p, &end, 0);
+			if (end == p)
+				goto bad;
+			if (neg)
+				r->constant = -r->constant;
+			p = skip_ws(end);
+		} else if (!r->ref)
+			goto bad;
+	}
+
+	while (*p) {
+		long long v;
+
+		q = parse_ident(p, name, sizeof(name));
+		if (!q || *q != '=')
+			goto bad;
+		v = strtoll(q + 1, &end, 0);
+		if (end == q + 1 || v < 0)
+			goto bad;
+		if (!strcmp(name, "hyst"))
+			r->hyst = v;
+		else if (!strcmp(name, "for") && v > 0)
+			r->samples = v;
+		else
+			goto bad;
+		p = skip_ws(end);
+	}
+	return 0;
+ bad:
+	fprintf(stderr, "bad alert rule:'%s', expected '<field> <op> "
+		"[<field>][+-<n>] [hyst=<n>] [for=<n>]' or "
+		"'<field> increases [for=<n>]'\n", text);
+	return EINVAL;
+}
+
+static int alert_cond(struct alert_rule *r, __int128 v, __int128 ref)
+{
+	__int128 hyst = r->active ? r->hyst : 0;
+
+	switch (r->op) {
+	case ALERT_LT: return v < ref + hyst;
+	case ALERT_LE: return v <= ref + hyst;
+	case ALERT_GT: return v > ref - hyst;
+	case ALERT_GE: return v >= ref - hyst;
+	case ALERT_EQ: return v == ref;
+	case ALERT_NE: return v != ref;
+	case ALERT_AND: return (v & ref) != 0;
+	case ALERT_INC: return r->have_prev && v > r->prev;
+	}
+	return 0;
+}
+
+/*
+ * Feeds one sample to every rule and prints the rules whose state changed.
+ * Returns the number of rules currently raised.
+ */
+static int alert_update(struct alert_rule *rules, int nr, const void *sample,
+					const void *ctx, const char *dev)
+{
+	char num[U128_STR_LEN], stamp[32];
+	time_t now = time(NULL);
+	int i, raised = 0, cond;
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	for (i = 0; i < nr; i++) {
+		struct alert_rule *r = &rules[i];
+		__int128 v = field_value(sample, r->field), ref = r->constant;
+
+		if (r->ref)
+			ref += field_value(r->ref_ctx ? ctx : sample, r->ref);
+		cond = alert_cond(r, v, ref);
+		r->prev = v;
+		r->have_prev = 1;
+
+		if (cond == r->active)
+			r->streak = 0;
+		else if (++r->streak >= r->samples) {
+			r->active = cond;
+			r->streak = 0;
+			printf("%s %s %s: %s value:%s\n", stamp,
+				cond ? "ALERT" : "CLEAR", dev, r->text,
+				i128_to_str(v, num));
+			fflush(stdout);
+		}
+		raised += r->active;
+	}
+	return raised;
+}
+
+static void show_error_log(struct nvme_error_log_page *err_log, int entries,
+				const struct field_desc **sel, int nr_sel)
+{
+	const struct field_desc *all[ARRAY_SIZE(error_log_fields)];
+	int i;
+
+	if (!sel) {
+		for (i = 0; i < ARRAY_SIZE(error_log_fields); i++)
+			all[i] = &error_log_fields[i];
+		sel = all;
+		nr_sel = ARRAY_SIZE(error_log_fields);
+	}
+
 	printf("Error Log Entries for device:%s entries:%d\n", devicename,
 								entries);
 	printf(".................\n");
 	for (i = 0; i < entries; i++) {
 		printf(" Entry[%2d]   \n", i);
 		printf(".................\n");
-		printf("error_count  : %lld\n", err_log[i].error_count);
-		printf("sqid         : %d\n", err_log[i].sqid);
-		printf("cmdid        : %#x\n", err_log[i].cmdid);
-		printf("status_field : %#x\n", err_log[i].status_field);
-		printf("parm_err_loc : %#x\n", err_log[i].parm_error_location);
-		printf("lba          : %#llx\n", err_log[i].lba);
-		printf("nsid         : %d\n", err_log[i].nsid);
-		printf("vs           : %d\n", err_log[i].vs);
+		show_fields(&err_log[i], sel, nr_sel, 13);
 		printf(".................\n");
 	}
 }
@@ -211,8 +827,8 @@ static void show_nvme_resv_report(struct nvme_reservation_status *status)
 		printf("regctl[%d] :\n", i);
 		printf("  cntlid  : %x\n", le16toh(status->regctl_ds[i].cntlid));
 		printf("  rcsts   : %x\n", status->regctl_ds[i].rcsts);
-		printf("  hostid  : %llx\n", le64toh(status->regctl_ds[i].hostid));
-		printf("  rkey    : %llx\n", le64toh(status->regctl_ds[i].rkey));
+		printf("  hostid  : %llx\n", (unsigned long long)le64toh(status->regctl_ds[i].hostid));
+		printf("  rkey    : %llx\n", (unsigned long long)le64toh(status->regctl_ds[i].rkey));
 	}
 	printf("\n");
 }
@@ -241,50 +857,13 @@ static void show_fw_log(struct nvme_firmware_log_page *fw_log)
 						fw_to_string(fw_log->frs[i]));
 }
 
-static long double int128_to_double(__u8 *data)
-{
-	int i;
-	long double result = 0;
-
-	for (i = 0; i < 16; i++) {
-		result *= 256;
-		result += data[15 - i];
-	}
-	return result;
-}
-
 static void show_smart_log(struct nvme_smart_log *smart, unsigned int nsid)
 {
-	/* convert temperature from Kelvin to Celsius */
-	unsigned int temperature = ((smart->temperature[1] << 8) |
-		smart->temperature[0]) - 273;
+	int i;
 
 	printf("Smart Log for NVME device:%s namespace-id:%x\n", devicename, nsid);
-	printf("critical_warning          : %#x\n", smart->critical_warning);
-	printf("temperature               : %u C\n", temperature);
-	printf("available_spare           : %u%%\n", smart->avail_spare);
-	printf("available_spare_threshold : %u%%\n", smart->spare_thresh);
-	printf("percentage_used           : %u%%\n", smart->percent_used);
-	printf("data_units_read           : %'.0Lf\n",
-		int128_to_double(smart->data_units_read));
-	printf("data_units_written        : %'.0Lf\n",
-		int128_to_double(smart->data_units_written));
-	printf("host_read_commands        : %'.0Lf\n",
-		int128_to_double(smart->host_reads));
-	printf("host_write_commands       : %'.0Lf\n",
-		int128_to_double(smart->host_writes));
-	printf("controller_busy_time      : %'.0Lf\n",
-		int128_to_double(smart->ctrl_busy_time));
-	printf("power_cycles              : %'.0Lf\n",
-		int128_to_double(smart->power_cycles));
-	printf("power_on_hours            : %'.0Lf\n",
-		int128_to_double(smart->power_on_hours));
-	printf("unsafe_shutdowns          : %'.0Lf\n",
-		int128_to_double(smart->unsafe_shutdowns));
-	printf("media_errors              : %'.0Lf\n",
-		int128_to_double(smart->media_errors));
-	printf("num_err_log_entries       : %'.0Lf\n",
-		int128_to_double(smart->num_err_log_entries));
+	for (i = 0; i < ARRAY_SIZE(smart_log_fields); i++)
+		show_field(smart, &smart_log_fields[i], 26);
 }
 
 char* nvme_feature_to_string(int feature)
@@ -326,6 +905,7 @@ static const char *nvme_status_to_string(__u32 status)
 	case NVME_SC_LBA_RANGE:		return "LBA_RANGE";
 	case NVME_SC_CAP_EXCEEDED:	return "CAP_EXCEEDED";
 	case NVME_SC_NS_NOT_READY:	return "NS_NOT_READY";
+	case NVME_SC_RESERVATION_CONFLICT:	return "RESERVATION_CONFLICT";
 	case NVME_SC_CQ_INVALID:	return "CQ_INVALID";
 	case NVME_SC_QID_INVALID:	return "QID_INVALID";
 	case NVME_SC_QUEUE_SIZE:	return "QUEUE_SIZE";
@@ -349,7 +929,7 @@ static const char *nvme_status_to_string(__u32 status)
 	}
 }
 
-static int identify(int namespace, void *ptr, int cns)
+static int identify(int fd, int namespace, void *ptr, int cns)
 {
 	struct nvme_admin_cmd cmd;
 
@@ -359,10 +939,11 @@ static int identify(int namespace, void *ptr, int cns)
 	cmd.addr = (unsigned long)ptr;
 	cmd.data_len = 4096;
 	cmd.cdw10 = cns;
-	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	return nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
 }
 
-static int nvme_get_log(void *log_addr, __u32 data_len, __u32 dw10, __u32 nsid)
+static int nvme_get_log(int fd, void *log_addr, __u32 data_len, __u32 dw10,
+								__u32 nsid)
 {
 	struct nvme_admin_cmd cmd;
 
@@ -372,7 +953,27 @@ static int nvme_get_log(void *log_addr, __u32 data_len, __u32 dw10, __u32 nsid)
 	cmd.data_len = data_len;
 	cmd.cdw10 = dw10;
 	cmd.nsid = nsid;
-	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	return nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+}
+
+static int nvme_feature(int fd, int opcode, void *buf, int data_len, __u32 fid,
+					__u32 nsid, __u32 cdw11, __u32 *result)
+{
+	int err;
+	struct nvme_admin_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = opcode;
+	cmd.nsid = nsid;
+	cmd.cdw10 = fid;
+	cmd.cdw11 = cdw11;
+	cmd.addr = (__u64)buf;
+	cmd.data_len = data_len;
+
+	err = nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (err >= 0 && result)
+			*result = cmd.result;
+	return err;
 }
 
 static void d_raw(unsigned char *buf, unsigned len)
@@ -382,26 +983,26 @@ static void d_raw(unsigned char *buf, unsigned len)
 		putchar(*(buf+i));
 }
 
-static void d(unsigned char *buf, int len, int width, int group)
+static void d_file(FILE *f, unsigned char *buf, int len, int width, int group)
 {
 	int i, offset = 0, line_done = 0;
 	char ascii[width + 1];
 
-	printf("     ");
+	fprintf(f, "     ");
 	for (i = 0; i <= 15; i++)
-		printf("%3x", i);
+		fprintf(f, "%3x", i);
 	for (i = 0; i < len; i++) {
 		line_done = 0;
 		if (i % width == 0)
-			fprintf(stdout, "\n%04x:", offset);
+			fprintf(f, "\n%04x:", offset);
 		if (i % group == 0)
-			fprintf(stdout, " %02x", buf[i]);
+			fprintf(f, " %02x", buf[i]);
 		else
-			fprintf(stdout, "%02x", buf[i]);
+			fprintf(f, "%02x", buf[i]);
 		ascii[i % width] = (buf[i] >= '!' && buf[i] <= '~') ? buf[i] : '.';
 		if (((i + 1) % width) == 0) {
 			ascii[i % width + 1] = '\0';
-			fprintf(stdout, " \"%.*s\"", width, ascii);
+			fprintf(f, " \"%.*s\"", width, ascii);
 			offset += width;
 			line_done = 1;
 		}
@@ -409,71 +1010,25 @@ static void d(unsigned char *buf, int len, int width, int group)
 	if (!line_done) {
 		unsigned b = width - (i % width);
 		ascii[i % width + 1] = '\0';
-		fprintf(stdout, " %*s \"%.*s\"",
+		fprintf(f, " %*s \"%.*s\"",
 				2 * b + b / group + (b % group ? 1 : 0), "",
 				width, ascii);
 	}
-	fprintf(stdout, "\n");
+	fprintf(f, "\n");
+}
+
+static void d(unsigned char *buf, int len, int width, int group)
+{
+	d_file(stdout, buf, len, width, group);
 }
 
 static void show_nvme_id_ctrl(struct nvme_id_ctrl *ctrl, int vs)
 {
 	int i;
-	char sn[sizeof(ctrl->sn) + 1];
-	char mn[sizeof(ctrl->mn) + 1];
-	char fr[sizeof(ctrl->fr) + 1];
-
-	memcpy(sn, ctrl->sn, sizeof(ctrl->sn));
-	memcpy(mn, ctrl->mn, sizeof(ctrl->mn));
-	memcpy(fr, ctrl->fr, sizeof(ctrl->fr));
-
-	sn[sizeof(ctrl->sn)] = '\0';
-	mn[sizeof(ctrl->mn)] = '\0';
-	fr[sizeof(ctrl->fr)] = '\0';
 
 	printf("NVME Identify Controller:\n");
-	printf("vid     : %#x\n", ctrl->vid);
-	printf("ssvid   : %#x\n", ctrl->ssvid);
-	printf("sn      : %s\n", sn);
-	printf("mn      : %s\n", mn);
-	printf("fr      : %s\n", fr);
-	printf("rab     : %d\n", ctrl->rab);
-	printf("ieee    : %02x%02x%02x\n",
-		ctrl->ieee[0], ctrl->ieee[1], ctrl->ieee[2]);
-	printf("cmic    : %#x\n", ctrl->cmic);
-	printf("mdts    : %d\n", ctrl->mdts);
-	printf("cntlid  : %x\n", ctrl->cntlid);
-	printf("ver     : %x\n", ctrl->ver);
-	printf("rtd3r   : %x\n", ctrl->rtd3r);
-	printf("rtd3e   : %x\n", ctrl->rtd3e);
-	printf("oacs    : %#x\n", ctrl->oacs);
-	printf("acl     : %d\n", ctrl->acl);
-	printf("aerl    : %d\n", ctrl->aerl);
-	printf("frmw    : %#x\n", ctrl->frmw);
-	printf("lpa     : %#x\n", ctrl->lpa);
-	printf("elpe    : %d\n", ctrl->elpe);
-	printf("npss    : %d\n", ctrl->npss);
-	printf("avscc   : %#x\n", ctrl->avscc);
-	printf("apsta   : %#x\n", ctrl->apsta);
-	printf("wctemp  : %d\n", ctrl->wctemp);
-	printf("cctemp  : %d\n", ctrl->cctemp);
-	printf("mtfa    : %d\n", ctrl->mtfa);
-	printf("hmmin   : %d\n", ctrl->hmmin);
-	printf("tnvmcap : %.0Lf\n", int128_to_double(ctrl->tnvmcap));
-	printf("unvmcap : %.0Lf\n", int128_to_double(ctrl->unvmcap));
-	printf("rpmbs   : %#x\n", ctrl->rpmbs);
-	printf("sqes    : %#x\n", ctrl->sqes);
-	printf("cqes    : %#x\n", ctrl->cqes);
-	printf("nn      : %d\n", ctrl->nn);
-	printf("oncs    : %#x\n", ctrl->oncs);
-	printf("fuses   : %#x\n", ctrl->fuses);
-	printf("fna     : %#x\n", ctrl->fna);
-	printf("vwc     : %#x\n", ctrl->vwc);
-	printf("awun    : %d\n", ctrl->awun);
-	printf("awupf   : %d\n", ctrl->awupf);
-	printf("nvscc   : %d\n", ctrl->nvscc);
-	printf("acwu    : %d\n", ctrl->acwu);
-	printf("sgls    : %d\n", ctrl->sgls);
+	for (i = 0; i < ARRAY_SIZE(id_ctrl_fields); i++)
+		show_field(ctrl, &id_ctrl_fields[i], 8);
 
 	for (i = 0; i <= ctrl->npss; i++) {
 		printf("ps %4d : mp:%d flags:%x enlat:%d exlat:%d rrt:%d rrl:%d\n"
@@ -512,35 +1067,8 @@ static void show_nvme_id_ns(struct nvme_id_ns *ns, int id, int vs)
 	int i;
 
 	printf("NVME Identify Namespace %d:\n", id);
-	printf("nsze    : %#llx\n", ns->nsze);
-	printf("ncap    : %#llx\n", ns->ncap);
-	printf("nuse    : %#llx\n", ns->nuse);
-	printf("nsfeat  : %#x\n", ns->nsfeat);
-	printf("nlbaf   : %d\n", ns->nlbaf);
-	printf("flbas   : %#x\n", ns->flbas);
-	printf("mc      : %#x\n", ns->mc);
-	printf("dpc     : %#x\n", ns->dpc);
-	printf("dps     : %#x\n", ns->dps);
-	printf("nmic    : %#x\n", ns->nmic);
-	printf("rescap  : %#x\n", ns->rescap);
-	printf("fpi     : %#x\n", ns->fpi);
-	printf("nawun   : %d\n", ns->nawun);
-	printf("nawupf  : %d\n", ns->nawupf);
-	printf("nacwu   : %d\n", ns->nacwu);
-	printf("nabsn   : %d\n", ns->nabsn);
-	printf("nabo    : %d\n", ns->nabo);
-	printf("nabspf  : %d\n", ns->nabspf);
-	printf("nvmcap  : %.0Lf\n", int128_to_double(ns->nvmcap));
-
-	printf("nguid   : ");
-	for (i = 0; i < 16; i++)
-		printf("%02x", ns->nguid[i]);
-	printf("\n");
-
-	printf("eui64   : ");
-	for (i = 0; i < 8; i++)
-		printf("%02x", ns->eui64[i]);
-	printf("\n");
+	for (i = 0; i < ARRAY_SIZE(id_ns_fields); i++)
+		show_field(ns, &id_ns_fields[i], 8);
 
 	for (i = 0; i <= ns->nlbaf; i++) {
 		printf("lbaf %2d : ms:%-3d ds:%-2d rp:%#x %s\n", i,
@@ -553,18 +1081,29 @@ static void show_nvme_id_ns(struct nvme_id_ns *ns, int id, int vs)
 	}
 }
 
+#define MAX_ALERTS	16
+#define WATCH_MAX_MISSES	5	/* consecutive failures --watch rides out */
+
 static int get_smart_log(int argc, char **argv)
 {
 	struct nvme_smart_log smart_log;
-	int long_index, opt, err;
-	unsigned int raw = 0, nsid = 0xffffffff;
+	struct nvme_id_ctrl ctrl;
+	const struct field_desc *sel[ARRAY_SIZE(smart_log_fields)];
+	struct alert_rule rules[MAX_ALERTS];
+	int long_index, opt, err, nr_sel = 0, nr_rules = 0;
+	unsigned int raw = 0, nsid = 0xffffffff, watch = 0, count = 0, n;
+	unsigned int misses = 0, missed = 0;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
 		{"raw-binary", no_argument, 0, 'b'},
+		{"fields", required_argument, 0, 'f'},
+		{"watch", required_argument, 0, 'w'},
+		{"count", required_argument, 0, 'c'},
+		{"alert", required_argument, 0, 'a'},
 		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:b", opts,
+	while ((opt = getopt_long(argc, (char **)argv, "n:bf:w:c:a:", opts,
 							&long_index)) != -1) {
 		switch (opt) {
 		case 'n':
@@ -573,39 +1112,144 @@ static int get_smart_log(int argc, char **argv)
 		case 'b':
 			raw = 1;
 			break;
+		case 'f':
+			nr_sel = parse_fields(optarg, smart_log_fields,
+					ARRAY_SIZE(smart_log_fields), sel);
+			if (nr_sel < 0)
+				return EINVAL;
+			break;
+		case 'w':
+			get_int(optarg, &watch);
+			break;
+		case 'c':
+			get_int(optarg, &count);
+			break;
+		case 'a':
+			if (nr_rules == MAX_ALERTS) {
+				fprintf(stderr, "too many alert rules\n");
+				return EINVAL;
+			}
+			if (parse_alert(optarg, &rules[nr_rules++],
+					smart_log_fields,
+					ARRAY_SIZE(smart_log_fields),
+					alert_ctrl_fields,
+					ARRAY_SIZE(alert_ctrl_fields)))
+				return EINVAL;
+			break;
 		default:
 			return EINVAL;
 		}
 	}
 	get_dev(optind, argc, argv);
-	err = nvme_get_log(&smart_log,
-		sizeof(smart_log), 0x2 | (((sizeof(smart_log) / 4) - 1) << 16),
-		nsid);
-	if (!err) {
-		if (!raw)
-			show_smart_log(&smart_log, nsid);
-		else
+	if (!watch)
+		count = 1;
+	memset(&ctrl, 0, sizeof(ctrl));
+	/* rules may compare against controller thresholds like wctemp */
+	if (nr_rules) {
+		err = identify(fd, 0, &ctrl, 1);
+		if (err > 0)
+			fprintf(stderr, "NVMe Status: %s\n",
+						nvme_status_to_string(err));
+		else if (err < 0)
+			perror("identify controller");
+		if (err)
+			return err;
+	}
+
+	for (n = 0; !count || n < count; n++) {
+		if (n)
+			sleep(watch);
+		err = nvme_get_log(fd, &smart_log, sizeof(smart_log),
+			0x2 | (((sizeof(smart_log) / 4) - 1) << 16), nsid);
+		if (err && watch && ++misses < WATCH_MAX_MISSES) {
+			if (err > 0)
+				fprintf(stderr, "NVMe Status: %s, sample missed\n",
+						nvme_status_to_string(err));
+			else
+				perror("smart log, sample missed");
+			missed++;
+			err = 0;
+			continue;
+		}
+		if (err)
+			break;
+		misses = 0;
+		if (raw)
 			d_raw((unsigned char *)&smart_log, sizeof(smart_log));
+		else if (nr_rules)
+			alert_update(rules, nr_rules, &smart_log, &ctrl,
+								devicename);
+		else if (nr_sel)
+			show_fields(&smart_log, sel, nr_sel, 26);
+		else
+			show_smart_log(&smart_log, nsid);
+		fflush(stdout);
 	}
-	else if (err > 0)
+	if (err > 0)
 		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
+	else if (err < 0)
+		perror("smart log");
+	if (missed)
+		fprintf(stderr, "%u of %u samples missed\n", missed + !!err,
+								n + !!err);
 	return err;
 }
 
+/* error-log --aggregate group keys */
+enum {
+	ERR_KEY_DEV	= 1 << 0,
+	ERR_KEY_STATUS	= 1 << 1,
+	ERR_KEY_SQID	= 1 << 2,
+	ERR_KEY_NSID	= 1 << 3,
+	ERR_KEY_REGION	= 1 << 4,
+};
+
+static int error_log_aggregate(char **devs, int nr, unsigned int log_entries,
+			__u32 nsid, int keys, __u64 region_size, int jobs);
+static int parse_err_keys(char *list);
+
 static int get_error_log(int argc, char **argv)
 {
-	int opt, err, long_index = 0;
-	unsigned int raw = 0, log_entries = 64, nsid = 0xffffffff;
+	const struct field_desc *sel[ARRAY_SIZE(error_log_fields)];
+	int opt, err, long_index = 0, nr_sel = 0, aggregate = 0;
+	int keys = ERR_KEY_STATUS | ERR_KEY_SQID | ERR_KEY_NSID | ERR_KEY_REGION;
+	unsigned int raw = 0, log_entries = 64, nsid = 0xffffffff, jobs = 0;
+	__u64 region_size = 1 << 20;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
 		{"log-entries", required_argument, 0, 'e'},
 		{"raw-binary", no_argument, 0, 'b'},
+		{"fields", required_argument, 0, 'f'},
+		{"aggregate", no_argument, 0, 'a'},
+		{"group-by", required_argument, 0, 'g'},
+		{"region-size", required_argument, 0, 'r'},
+		{"jobs", required_argument, 0, 'j'},
 		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:e:b", opts,
+	while ((opt = getopt_long(argc, (char **)argv, "n:e:bf:ag:r:j:", opts,
 							&long_index)) != -1) {
 		switch (opt) {
+		case 'a':
+			aggregate = 1;
+			break;
+		case 'g':
+			keys = parse_err_keys(optarg);
+			if (keys < 0)
+				return EINVAL;
+			break;
+		case 'r':
+			get_long(optarg, &region_size);
+			break;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		case 'f':
+			nr_sel = parse_fields(optarg, error_log_fields,
+					ARRAY_SIZE(error_log_fields), sel);
+			if (nr_sel < 0)
+				return EINVAL;
+			break;
 		case 'n':
 			get_int(optarg, &nsid);
 			break;
@@ -619,19 +1263,30 @@ static int get_error_log(int argc, char **argv)
 			return EINVAL;
 		}
 	}
-	get_dev(optind, argc, argv);
 	if (!log_entries) {
 		fprintf(stderr, "non-zero log-entires is required param\n");
 		return EINVAL;
+	} else if (aggregate) {
+		if (optind >= argc) {
+			errno = EINVAL;
+			perror(argv[0]);
+			return errno;
+		}
+		if (!region_size)
+			region_size = 1;
+		return error_log_aggregate(&argv[optind], argc - optind,
+				log_entries, nsid, keys, region_size, jobs);
 	} else {
 		struct nvme_error_log_page err_log[log_entries];
-	
-		err = nvme_get_log(err_log,
+
+		get_dev(optind, argc, argv);
+		err = nvme_get_log(fd, err_log,
 				sizeof(err_log), 0x1 | (((sizeof(err_log) / 4) - 1) << 16),
 				nsid);
 		if (!err) {
 			if (!raw)
-				show_error_log(err_log, log_entries);
+				show_error_log(err_log, log_entries,
+						nr_sel ? sel : NULL, nr_sel);
 			else
 				d_raw((unsigned char *)err_log, sizeof(err_log));
 		}
@@ -659,7 +1314,7 @@ static int get_fw_log(int argc, char **argv)
 		}
 	}
 	get_dev(optind, argc, argv);
-	err = nvme_get_log(&fw_log,
+	err = nvme_get_log(fd, &fw_log,
 			sizeof(fw_log), 0x3 | (((sizeof(fw_log) / 4) - 1) << 16),
 			0xffffffff);
 	if (!err) {
@@ -713,7 +1368,7 @@ static int get_log(int argc, char **argv)
 	} else {
 		unsigned char log[log_len];
 
-		err = nvme_get_log(log, log_len, lid | (((log_len / 4) - 1) << 16), nsid);
+		err = nvme_get_log(fd, log, log_len, lid | (((log_len / 4) - 1) << 16), nsid);
 		if (!err) {
 			if (!raw) {
 				printf("Device:%s log-id:%d namespace-id:%#x",
@@ -749,7 +1404,7 @@ static int list_ns(int argc, char **argv)
 		}
 	}
 	get_dev(optind, argc, argv);
-	err = identify(nsid, ns_list, 2);
+	err = identify(fd, nsid, ns_list, 2);
 	if (!err) {
 		for (i = 0; i < 1024; i++)
 			if (ns_list[i])
@@ -769,1186 +1424,6860 @@ static int list(int argc, char **argv)
 }
 #endif
 
-#ifdef LIBUDEV_EXISTS
-static int list(int argc, char **argv)
+static int ctrl_dev_filter(const struct dirent *d)
 {
-  struct udev *udev;
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *devices, *dev_list_entry;
-  struct udev_device *dev;
-  
-  udev = udev_new();
-  if (!udev) {
-    perror("nvme-list: Can not create udev context.");
-    return errno;
-  }
-  
-  enumerate = udev_enumerate_new(udev);
-  udev_enumerate_add_match_subsystem(enumerate, "block");
-  udev_enumerate_scan_devices(enumerate);
-  devices = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(dev_list_entry, devices) {
-
-    const char *path, *node;
-    path = udev_list_entry_get_name(dev_list_entry);
-    dev = udev_device_new_from_syspath(udev, path);
-    node = udev_device_get_devnode(dev);
-    if (strstr(node,"nvme")!=NULL){
-      struct nvme_id_ctrl ctrl;
-
-      open_dev(node);
-      int err = identify(0, &ctrl, 1);
-      if (err > 0)
-	return err;
-      printf("  %s\t: NVM Express - %#x - %s - %x\n", node, 
-	     ctrl.vid, ctrl.mn, ctrl.ver);
-    }
-
-  }
-  udev_enumerate_unref(enumerate);
-  udev_unref(udev);
+	int n = 0;
+	unsigned int instance;
 
-  return 0;
+	return sscanf(d->d_name, "nvme%u%n", &instance, &n) == 1 &&
+						d->d_name[n] == '\0';
 }
-#endif
 
-static int id_ctrl(int argc, char **argv)
+/*
+ * Finds every NVMe controller character device. Returns the number found
+ * and an array of "/dev/nvmeX" paths the caller frees with free_devs().
+ */
+static int scan_ctrl_devs(char ***devs)
 {
-	int opt, err, raw = 0, vs = 0, long_index = 0;
-	struct nvme_id_ctrl ctrl;
-	static struct option opts[] = {
-		{"vendor-specific", no_argument, 0, 'v'},
-		{"raw-binary", no_argument, 0, 'b'},
-		{0, 0, 0, 0 }
-	};
+	struct dirent **ents;
+	int i, n;
 
-	while ((opt = getopt_long(argc, (char **)argv, "vb", opts,
-							&long_index)) != -1) {
-		switch (opt) {
-		case 'v':
-			vs = 1;
-			break;
-		case 'b':
-			raw = 1;
-			break;
-		default:
-			return EINVAL;
-		}
+	n = scandir("/dev", &ents, ctrl_dev_filter, versionsort);
+	if (n < 0) {
+		perror("/dev");
+		return -errno;
 	}
-	get_dev(optind, argc, argv);
-	err = identify(0, &ctrl, 1);
-	if (!err) {
-		if (raw)
+	*devs = calloc(n ? n : 1, sizeof(char *));
+	for (i = 0; i < n; i++) {
+		if (asprintf(&(*devs)[i], "/dev/%s", ents[i]->d_name) < 0)
+			(*devs)[i] = NULL;
+		free(ents[i]);
+	}
+	free(ents);
+	return n;
+}
+
+static void free_devs(char **devs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		free(devs[i]);
+	free(devs);
+}
+
+/*
+ * Work-stealing task executor for commands that fan out over many devices
+ * or ranges. Each worker owns a deque: it pushes and pops its own tasks at
+ * the bottom, so a task's follow-up work stays on the thread that has it
+ * warm, and when it runs dry it steals from the top of another worker's
+ * deque. A slow device or region then only holds up the worker running it
+ * instead of everything statically assigned to that worker.
+ *
+ * Tasks are whole admin commands or larger, so a lock per deque is cheap
+ * next to the work and keeps this simple.
+ */
+struct exec_task {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct exec_deque {
+	pthread_mutex_t lock;
+	struct exec_task *tasks;
+	unsigned int top, bottom, size;	/* ring, size a power of two */
+};
+
+struct exec {
+	struct exec_deque *q;
+	pthread_t *threads;
+	int nr_workers;
+	int nr_threads;
+	unsigned int next;		/* round robin for outside submitters */
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	int queued;			/* tasks in deques */
+	int stop;
+};
+
+struct exec_worker {
+	struct exec *ex;
+	int id;
+};
+
+static __thread struct exec_worker *exec_self;
+
+static int exec_push(struct exec_deque *q, struct exec_task *t)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom - q->top == q->size) {
+		unsigned int i, size = q->size ? q->size * 2 : 64;
+		struct exec_task *tasks = malloc(size * sizeof(*tasks));
+
+		if (!tasks) {
+			pthread_mutex_unlock(&q->lock);
+			return ENOMEM;
+		}
+		for (i = q->top; i != q->bottom; i++)
+			tasks[i & (size - 1)] = q->tasks[i & (q->size - 1)];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->size = size;
+	}
+	q->tasks[q->bottom++ & (q->size - 1)] = *t;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/* own work comes off the bottom, stolen work off the top */
+static int exec_pop(struct exec_deque *q, struct exec_task *t, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->top != q->bottom) {
+		if (steal)
+			*t = q->tasks[q->top++ & (q->size - 1)];
+		else
+			*t = q->tasks[--q->bottom & (q->size - 1)];
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static int exec_take(struct exec *ex, int self, struct exec_task *t)
+{
+	int i;
+
+	if (exec_pop(&ex->q[self], t, 0))
+		return 1;
+	for (i = 1; i < ex->nr_workers; i++)
+		if (exec_pop(&ex->q[(self + i) % ex->nr_workers], t, 1))
+			return 1;
+	return 0;
+}
+
+/*
+ * Queues fn(arg). From a worker the task goes on that worker's own deque;
+ * from anywhere else the deques are filled round robin.
+ */
+static int exec_submit(struct exec *ex, void (*fn)(void *), void *arg)
+{
+	struct exec_task t = { fn, arg };
+	int q, err;
+
+	if (exec_self && exec_self->ex == ex)
+		q = exec_self->id;
+	else
+		q = __sync_fetch_and_add(&ex->next, 1) % ex->nr_workers;
+
+	err = exec_push(&ex->q[q], &t);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&ex->lock);
+	ex->queued++;
+	pthread_cond_signal(&ex->work_cond);
+	pthread_mutex_unlock(&ex->lock);
+	return 0;
+}
+
+static void *exec_worker(void *arg)
+{
+	struct exec_worker *w = arg;
+	struct exec *ex = w->ex;
+	struct exec_task t;
+
+	exec_self = w;
+	for (;;) {
+		if (exec_take(ex, w->id, &t)) {
+			pthread_mutex_lock(&ex->lock);
+			ex->queued--;
+			pthread_mutex_unlock(&ex->lock);
+
+			t.fn(t.arg);
+			continue;
+		}
+		pthread_mutex_lock(&ex->lock);
+		while (!ex->queued && !ex->stop)
+			pthread_cond_wait(&ex->work_cond, &ex->lock);
+		if (!ex->queued && ex->stop) {
+			pthread_mutex_unlock(&ex->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ex->lock);
+	}
+	free(w);
+	return NULL;
+}
+
+static void exec_stop(struct exec *ex);
+
+/* Starts 'workers' threads. Returns 0 if at least one could be started. */
+static int exec_start(struct exec *ex, int workers)
+{
+	struct exec_worker *w;
+	int i;
+
+	memset(ex, 0, sizeof(*ex));
+	if (workers <= 0)
+		workers = 1;
+	ex->q = calloc(workers, sizeof(*ex->q));
+	ex->threads = calloc(workers, sizeof(*ex->threads));
+	if (!ex->q || !ex->threads) {
+		free(ex->q);
+		free(ex->threads);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&ex->lock, NULL);
+	pthread_cond_init(&ex->work_cond, NULL);
+	for (i = 0; i < workers; i++)
+		pthread_mutex_init(&ex->q[i].lock, NULL);
+
+	/*
+	 * A deque whose thread failed to start is still filled round robin;
+	 * the others steal its tasks.
+	 */
+	ex->nr_workers = workers;
+	for (i = 0; i < workers; i++) {
+		w = malloc(sizeof(*w));
+		if (!w)
+			break;
+		w->ex = ex;
+		w->id = i;
+		if (pthread_create(&ex->threads[i], NULL, exec_worker, w)) {
+			free(w);
+			break;
+		}
+		ex->nr_threads++;
+	}
+	if (!ex->nr_threads) {
+		exec_stop(ex);
+		return EAGAIN;
+	}
+	return 0;
+}
+
+/* Runs what is still queued, then joins the workers and frees everything. */
+static void exec_stop(struct exec *ex)
+{
+	int i;
+
+	pthread_mutex_lock(&ex->lock);
+	ex->stop = 1;
+	pthread_cond_broadcast(&ex->work_cond);
+	pthread_mutex_unlock(&ex->lock);
+	for (i = 0; i < ex->nr_threads; i++)
+		pthread_join(ex->threads[i], NULL);
+	for (i = 0; i < ex->nr_workers; i++)
+		free(ex->q[i].tasks);
+	free(ex->q);
+	free(ex->threads);
+}
+
+/*
+ * Per device collection pipeline for commands that work on many devices.
+ * Each device runs its stages in order with one admin command outstanding,
+ * as one executor task, so up to 'jobs' workers keep different devices
+ * busy at once and a worker stuck on a slow device has its queued devices
+ * stolen by the others. As each device finishes it is handed back to the
+ * calling thread through 'done', so results are formatted while other
+ * devices are still being queried.
+ */
+struct pipe_stage {
+	const char *name;
+	int (*fn)(int fd, void *ctx);
+};
+
+struct pipeline;
+
+struct pipe_dev {
+	const char *path;
+	void *ctx;
+	int fd;
+	int stage;
+	int err;
+	struct pipeline *pipe;
+};
+
+struct pipeline {
+	const struct pipe_stage *stages;
+	int nr_stages;
+	struct pipe_dev *devs;
+	struct exec ex;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	int *done, done_head, nr_done;
+	int nr_devs;
+};
+
+static void pipe_push(int *ring, int head, int *count, int size, int idx)
+{
+	ring[(head + (*count)++) % size] = idx;
+}
+
+static int pipe_pop(int *ring, int *head, int *count, int size)
+{
+	int idx = ring[*head];
+
+	*head = (*head + 1) % size;
+	(*count)--;
+	return idx;
+}
+
+static void pipe_step(struct pipeline *p, struct pipe_dev *dev)
+{
+	int ret;
+
+	if (dev->fd < 0) {
+		dev->fd = nvme_open(dev->path);
+		if (dev->fd < 0) {
+			dev->err = errno;
+			dev->stage = p->nr_stages;
+			return;
+		}
+	}
+	ret = p->stages[dev->stage].fn(dev->fd, dev->ctx);
+	if (ret < 0) {
+		dev->err = -ret;
+		dev->stage = p->nr_stages;
+	} else
+		dev->stage++;
+}
+
+static void pipe_task(void *arg)
+{
+	struct pipe_dev *dev = arg;
+	struct pipeline *p = dev->pipe;
+
+	while (dev->stage < p->nr_stages)
+		pipe_step(p, dev);
+
+	pthread_mutex_lock(&p->lock);
+	pipe_push(p->done, p->done_head, &p->nr_done, p->nr_devs,
+							dev - p->devs);
+	pthread_cond_signal(&p->done_cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int run_pipeline(struct pipe_dev *devs, int nr,
+			const struct pipe_stage *stages, int nr_stages,
+			int jobs, void (*done)(struct pipe_dev *dev))
+{
+	struct pipeline p;
+	int i, submitted, err = 0;
+
+	if (!nr)
+		return 0;
+	memset(&p, 0, sizeof(p));
+	p.stages = stages;
+	p.nr_stages = nr_stages;
+	p.devs = devs;
+	p.nr_devs = nr;
+	p.done = calloc(nr, sizeof(int));
+	if (!p.done) {
+		fprintf(stderr, "No memory for %d device pipeline\n", nr);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.done_cond, NULL);
+	if (jobs <= 0 || jobs > nr)
+		jobs = nr;
+	err = exec_start(&p.ex, jobs);
+	if (err) {
+		fprintf(stderr, "failed to start pipeline workers\n");
+		goto free;
+	}
+
+	for (submitted = 0; submitted < nr; submitted++) {
+		devs[submitted].fd = -1;
+		devs[submitted].stage = 0;
+		devs[submitted].err = 0;
+		devs[submitted].pipe = &p;
+		err = exec_submit(&p.ex, pipe_task, &devs[submitted]);
+		if (err) {
+			fprintf(stderr, "No memory for %d device pipeline\n",
+									nr);
+			break;
+		}
+	}
+
+	for (i = 0; i < submitted; i++) {
+		struct pipe_dev *dev;
+
+		pthread_mutex_lock(&p.lock);
+		while (!p.nr_done)
+			pthread_cond_wait(&p.done_cond, &p.lock);
+		dev = &devs[pipe_pop(p.done, &p.done_head, &p.nr_done, nr)];
+		pthread_mutex_unlock(&p.lock);
+
+		if (dev->fd >= 0)
+			nvme_close(dev->fd);
+		done(dev);
+	}
+	exec_stop(&p.ex);
+ free:
+	free(p.done);
+	return err;
+}
+
+#ifdef LIBUDEV_EXISTS
+/*
+ * 'list' finds the NVMe block devices through udev and identifies them
+ * all at once on the device pipeline, then prints them in udev's order.
+ */
+struct list_dev {
+	struct nvme_id_ctrl ctrl;
+	int status;
+};
+
+static int list_id_ctrl(int fd, void *ctx)
+{
+	struct list_dev *ld = ctx;
+
+	ld->status = identify(fd, 0, &ld->ctrl, 1);
+	return ld->status < 0 ? -errno : 0;
+}
+
+static const struct pipe_stage list_stages[] = {
+	{ "id-ctrl", list_id_ctrl },
+};
+
+static void list_done(struct pipe_dev *dev)
+{
+	struct list_dev *ld = dev->ctx;
+
+	if (dev->err)
+		fprintf(stderr, "%s: %s\n", dev->path, strerror(dev->err));
+	else if (ld->status > 0)
+		fprintf(stderr, "%s: NVMe Status: %s\n", dev->path,
+					nvme_status_to_string(ld->status));
+}
+
+static int udev_nvme_devs(char ***devs)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	char **list = NULL, **tmp;
+	int n = 0, err = 0;
+
+	udev = udev_new();
+	if (!udev) {
+		fprintf(stderr, "nvme-list: Can not create udev context.\n");
+		return -ENOMEM;
+	}
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		fprintf(stderr, "nvme-list: Can not enumerate devices.\n");
+		udev_unref(udev);
+		return -ENOMEM;
+	}
+	udev_enumerate_add_match_subsystem(enumerate, "block");
+	udev_enumerate_scan_devices(enumerate);
+	udev_list_entry_foreach(entry,
+			udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *dev;
+		const char *node;
+
+		dev = udev_device_new_from_syspath(udev,
+					udev_list_entry_get_name(entry));
+		if (!dev)
+			continue;
+		node = udev_device_get_devnode(dev);
+		if (node && strstr(node, "nvme")) {
+			tmp = realloc(list, (n + 1) * sizeof(*list));
+			if (tmp) {
+				list = tmp;
+				list[n] = strdup(node);
+			}
+			if (!tmp || !list[n]) {
+				udev_device_unref(dev);
+				err = -ENOMEM;
+				break;
+			}
+			n++;
+		}
+		udev_device_unref(dev);
+	}
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	if (err) {
+		fprintf(stderr, "nvme-list: No memory for device list\n");
+		free_devs(list, n);
+		return err;
+	}
+	*devs = list;
+	return n;
+}
+
+static int list(int argc, char **argv)
+{
+	struct list_dev *lds;
+	struct pipe_dev *pdevs;
+	char **devs = NULL;
+	int i, nr, err;
+
+	nr = udev_nvme_devs(&devs);
+	if (nr < 0)
+		return -nr;
+
+	lds = calloc(nr ? nr : 1, sizeof(*lds));
+	pdevs = calloc(nr ? nr : 1, sizeof(*pdevs));
+	if (!lds || !pdevs) {
+		fprintf(stderr, "No memory for %d devices\n", nr);
+		err = ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < nr; i++) {
+		pdevs[i].path = devs[i];
+		pdevs[i].ctx = &lds[i];
+	}
+	err = run_pipeline(pdevs, nr, list_stages, ARRAY_SIZE(list_stages),
+							0, list_done);
+	if (err)
+		goto free;
+
+	for (i = 0; i < nr; i++) {
+		if (pdevs[i].err) {
+			err = pdevs[i].err;
+			continue;
+		}
+		if (lds[i].status) {
+			err = lds[i].status;
+			continue;
+		}
+		printf("  %s\t: NVM Express - %#x - %.*s - %x\n", devs[i],
+			lds[i].ctrl.vid, (int)sizeof(lds[i].ctrl.mn),
+			lds[i].ctrl.mn, lds[i].ctrl.ver);
+	}
+ free:
+	free(lds);
+	free(pdevs);
+	free_devs(devs, nr);
+	return err;
+}
+#endif
+
+/*
+ * Fleet snapshot file. Everything the 'snapshot' command gathers for one
+ * controller lands in a struct snap_record. The file stores a subset of
+ * those records' fields column by column, so a 'query' touching three
+ * fields reads only three columns no matter how many devices are in it.
+ *
+ * Layout: struct snap_header, nr_cols struct snap_col_hdr, then each
+ * column's nr_rows cells of 'width' bytes at its 'offset'. Cells hold the
+ * little endian bytes exactly as the device returned them.
+ */
+#define SNAP_MAGIC	"NVMESNAP"
+#define SNAP_VERSION	1
+
+struct snap_header {
+	char	magic[8];
+	__le32	version;
+	__le32	nr_cols;
+	__le64	nr_rows;
+};
+
+struct snap_col_hdr {
+	char	name[32];
+	__le16	width;
+	__u8	fmt;
+	__u8	rsvd[5];
+	__le64	offset;
+};
+
+enum {
+	SNAP_ID_CTRL	= 1 << 0,
+	SNAP_ID_NS	= 1 << 1,
+	SNAP_SMART	= 1 << 2,
+	SNAP_FW_LOG	= 1 << 3,
+	SNAP_ERR_LOG	= 1 << 4,
+	SNAP_FEATURES	= 1 << 5,
+};
+
+struct snap_err_summary {
+	__u64	entries;
+	__u64	max_count;
+	__u16	last_status;
+};
+
+struct snap_features {
+	__u32	power_mgmt;
+	__u32	temp_thresh;
+	__u32	err_recovery;
+	__u32	volatile_wc;
+	__u32	num_queues;
+};
+
+struct snap_record {
+	char				host[64];
+	char				dev[32];
+	__u32				valid;
+	__u32				nsid;
+	struct nvme_id_ctrl		ctrl;
+	struct nvme_id_ns		ns;
+	struct nvme_smart_log		smart;
+	struct nvme_firmware_log_page	fw;
+	struct snap_err_summary		err;
+	struct snap_features		feat;
+};
+
+static const struct field_desc snap_cols[] = {
+	FIELD(struct snap_record, "host", host, FIELD_STR),
+	FIELD(struct snap_record, "dev", dev, FIELD_STR),
+	FIELD(struct snap_record, "valid", valid, FIELD_HEX),
+	FIELD(struct snap_record, "vid", ctrl.vid, FIELD_HEX),
+	FIELD(struct snap_record, "ssvid", ctrl.ssvid, FIELD_HEX),
+	FIELD(struct snap_record, "sn", ctrl.sn, FIELD_STR),
+	FIELD(struct snap_record, "mn", ctrl.mn, FIELD_STR),
+	FIELD(struct snap_record, "fr", ctrl.fr, FIELD_STR),
+	FIELD(struct snap_record, "cntlid", ctrl.cntlid, FIELD_XNUM),
+	FIELD(struct snap_record, "ver", ctrl.ver, FIELD_XNUM),
+	FIELD(struct snap_record, "nn", ctrl.nn, FIELD_DEC),
+	FIELD(struct snap_record, "wctemp", ctrl.wctemp, FIELD_DEC),
+	FIELD(struct snap_record, "cctemp", ctrl.cctemp, FIELD_DEC),
+	FIELD(struct snap_record, "tnvmcap", ctrl.tnvmcap, FIELD_INT128),
+	FIELD(struct snap_record, "unvmcap", ctrl.unvmcap, FIELD_INT128),
+	FIELD(struct snap_record, "nsid", nsid, FIELD_DEC),
+	FIELD(struct snap_record, "nsze", ns.nsze, FIELD_DEC),
+	FIELD(struct snap_record, "ncap", ns.ncap, FIELD_DEC),
+	FIELD(struct snap_record, "nuse", ns.nuse, FIELD_DEC),
+	FIELD(struct snap_record, "flbas", ns.flbas, FIELD_HEX),
+	FIELD(struct snap_record, "nvmcap", ns.nvmcap, FIELD_INT128),
+	FIELD(struct snap_record, "critical_warning", smart.critical_warning, FIELD_HEX),
+	FIELD(struct snap_record, "temperature", smart.temperature, FIELD_TEMP),
+	FIELD(struct snap_record, "available_spare", smart.avail_spare, FIELD_PCT),
+	FIELD(struct snap_record, "available_spare_threshold", smart.spare_thresh, FIELD_PCT),
+	FIELD(struct snap_record, "percentage_used", smart.percent_used, FIELD_PCT),
+	FIELD(struct snap_record, "data_units_read", smart.data_units_read, FIELD_INT128),
+	FIELD(struct snap_record, "data_units_written", smart.data_units_written, FIELD_INT128),
+	FIELD(struct snap_record, "host_read_commands", smart.host_reads, FIELD_INT128),
+	FIELD(struct snap_record, "host_write_commands", smart.host_writes, FIELD_INT128),
+	FIELD(struct snap_record, "controller_busy_time", smart.ctrl_busy_time, FIELD_INT128),
+	FIELD(struct snap_record, "power_cycles", smart.power_cycles, FIELD_INT128),
+	FIELD(struct snap_record, "power_on_hours", smart.power_on_hours, FIELD_INT128),
+	FIELD(struct snap_record, "unsafe_shutdowns", smart.unsafe_shutdowns, FIELD_INT128),
+	FIELD(struct snap_record, "media_errors", smart.media_errors, FIELD_INT128),
+	FIELD(struct snap_record, "num_err_log_entries", smart.num_err_log_entries, FIELD_INT128),
+	FIELD(struct snap_record, "warning_temp_time", smart.warning_temp_time, FIELD_DEC),
+	FIELD(struct snap_record, "critical_comp_time", smart.critical_comp_time, FIELD_DEC),
+	FIELD(struct snap_record, "afi", fw.afi, FIELD_HEX),
+	FIELD(struct snap_record, "frs1", fw.frs[0], FIELD_STR),
+	FIELD(struct snap_record, "frs2", fw.frs[1], FIELD_STR),
+	FIELD(struct snap_record, "frs3", fw.frs[2], FIELD_STR),
+	FIELD(struct snap_record, "frs4", fw.frs[3], FIELD_STR),
+	FIELD(struct snap_record, "frs5", fw.frs[4], FIELD_STR),
+	FIELD(struct snap_record, "frs6", fw.frs[5], FIELD_STR),
+	FIELD(struct snap_record, "frs7", fw.frs[6], FIELD_STR),
+	FIELD(struct snap_record, "err_entries", err.entries, FIELD_DEC),
+	FIELD(struct snap_record, "err_max_count", err.max_count, FIELD_DEC),
+	FIELD(struct snap_record, "err_last_status", err.last_status, FIELD_HEX),
+	FIELD(struct snap_record, "feat_power_mgmt", feat.power_mgmt, FIELD_HEX),
+	FIELD(struct snap_record, "feat_temp_thresh", feat.temp_thresh, FIELD_HEX),
+	FIELD(struct snap_record, "feat_err_recovery", feat.err_recovery, FIELD_HEX),
+	FIELD(struct snap_record, "feat_volatile_wc", feat.volatile_wc, FIELD_HEX),
+	FIELD(struct snap_record, "feat_num_queues", feat.num_queues, FIELD_HEX),
+};
+
+static void summarize_error_log(struct nvme_error_log_page *err_log,
+				int entries, struct snap_err_summary *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < entries; i++) {
+		if (!err_log[i].error_count)
+			continue;
+		sum->entries++;
+		if (err_log[i].error_count > sum->max_count) {
+			sum->max_count = err_log[i].error_count;
+			sum->last_status = err_log[i].status_field;
+		}
+	}
+}
+
+static int snap_id_ctrl(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+
+	if (!identify(fd, 0, &rec->ctrl, 1))
+		rec->valid |= SNAP_ID_CTRL;
+	return 0;
+}
+
+static int snap_id_ns(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+	__u32 ns_list[1024];
+
+	rec->nsid = 1;
+	if (!identify(fd, 0, ns_list, 2) && ns_list[0])
+		rec->nsid = ns_list[0];
+	if (!identify(fd, rec->nsid, &rec->ns, 0))
+		rec->valid |= SNAP_ID_NS;
+	return 0;
+}
+
+static int snap_smart(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+
+	if (!nvme_get_log(fd, &rec->smart, sizeof(rec->smart),
+			0x2 | (((sizeof(rec->smart) / 4) - 1) << 16), 0xffffffff))
+		rec->valid |= SNAP_SMART;
+	return 0;
+}
+
+static int snap_err_log(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+	struct nvme_error_log_page err_log[64];
+
+	if (!nvme_get_log(fd, err_log, sizeof(err_log),
+			0x1 | (((sizeof(err_log) / 4) - 1) << 16), 0xffffffff)) {
+		summarize_error_log(err_log, ARRAY_SIZE(err_log), &rec->err);
+		rec->valid |= SNAP_ERR_LOG;
+	}
+	return 0;
+}
+
+static int snap_fw_log(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+
+	if (!nvme_get_log(fd, &rec->fw, sizeof(rec->fw),
+			0x3 | (((sizeof(rec->fw) / 4) - 1) << 16), 0xffffffff))
+		rec->valid |= SNAP_FW_LOG;
+	return 0;
+}
+
+static int snap_features(int fd, void *ctx)
+{
+	struct snap_record *rec = ctx;
+	struct {
+		__u32 fid;
+		__u32 *val;
+	} feats[] = {
+		{ NVME_FEAT_POWER_MGMT, &rec->feat.power_mgmt },
+		{ NVME_FEAT_TEMP_THRESH, &rec->feat.temp_thresh },
+		{ NVME_FEAT_ERR_RECOVERY, &rec->feat.err_recovery },
+		{ NVME_FEAT_VOLATILE_WC, &rec->feat.volatile_wc },
+		{ NVME_FEAT_NUM_QUEUES, &rec->feat.num_queues },
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(feats); i++)
+		if (!nvme_feature(fd, nvme_admin_get_features, NULL, 0,
+				feats[i].fid, 0, 0, feats[i].val))
+			rec->valid |= SNAP_FEATURES;
+	return 0;
+}
+
+/*
+ * Stages gathering one snapshot row. Pieces the device fails to return
+ * are left zeroed with their bit clear in rec->valid.
+ */
+static const struct pipe_stage snap_stages[] = {
+	{ "identify controller", snap_id_ctrl },
+	{ "identify namespace", snap_id_ns },
+	{ "smart log", snap_smart },
+	{ "error log", snap_err_log },
+	{ "firmware log", snap_fw_log },
+	{ "features", snap_features },
+};
+
+static void snapshot_done(struct pipe_dev *dev)
+{
+	if (dev->err)
+		fprintf(stderr, "%s: %s\n", dev->path, strerror(dev->err));
+}
+
+static int snapshot_write(FILE *f, struct snap_record *recs, int nr)
+{
+	struct snap_header hdr;
+	struct snap_col_hdr col;
+	__u64 offset;
+	int c, i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(SNAP_VERSION);
+	hdr.nr_cols = htole32(ARRAY_SIZE(snap_cols));
+	hdr.nr_rows = htole64(nr);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	offset = sizeof(hdr) + ARRAY_SIZE(snap_cols) * sizeof(col);
+	for (c = 0; c < ARRAY_SIZE(snap_cols); c++) {
+		memset(&col, 0, sizeof(col));
+		strncpy(col.name, snap_cols[c].name, sizeof(col.name) - 1);
+		col.width = htole16(snap_cols[c].width);
+		col.fmt = snap_cols[c].fmt;
+		col.offset = htole64(offset);
+		fwrite(&col, sizeof(col), 1, f);
+		offset += (__u64)nr * snap_cols[c].width;
+	}
+	for (c = 0; c < ARRAY_SIZE(snap_cols); c++)
+		for (i = 0; i < nr; i++)
+			fwrite((char *)&recs[i] + snap_cols[c].offset,
+						snap_cols[c].width, 1, f);
+	return ferror(f) ? EIO : 0;
+}
+
+static int snapshot(int argc, char **argv)
+{
+	int opt, err, i, nr, long_index = 0, scanned = 0;
+	unsigned int jobs = 0;
+	char *output = NULL, **devs = NULL, host[64];
+	struct snap_record *recs;
+	struct pipe_dev *pdevs;
+	FILE *f = stdout;
+	static struct option opts[] = {
+		{"output", required_argument, 0, 'o'},
+		{"jobs", required_argument, 0, 'j'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "o:j:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (optind < argc) {
+		devs = &argv[optind];
+		nr = argc - optind;
+	} else {
+		nr = scan_ctrl_devs(&devs);
+		if (nr < 0)
+			return -nr;
+		scanned = 1;
+	}
+	if (!output && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "refusing to write snapshot to a terminal, "
+					"use --output or redirect stdout\n");
+		return EINVAL;
+	}
+
+	recs = calloc(nr ? nr : 1, sizeof(*recs));
+	pdevs = calloc(nr ? nr : 1, sizeof(*pdevs));
+	if (!recs || !pdevs) {
+		fprintf(stderr, "No memory for %d snapshot records\n", nr);
+		err = ENOMEM;
+		goto free;
+	}
+	memset(host, 0, sizeof(host));
+	gethostname(host, sizeof(host) - 1);
+
+	for (i = 0; i < nr; i++) {
+		memcpy(recs[i].host, host, sizeof(recs[i].host));
+		strncpy(recs[i].dev, devs[i], sizeof(recs[i].dev) - 1);
+		pdevs[i].path = devs[i];
+		pdevs[i].ctx = &recs[i];
+	}
+	err = run_pipeline(pdevs, nr, snap_stages, ARRAY_SIZE(snap_stages),
+							jobs, snapshot_done);
+	if (err)
+		goto free;
+
+	if (output) {
+		f = fopen(output, "w");
+		if (!f) {
+			perror(output);
+			err = errno;
+			goto free;
+		}
+	}
+	err = snapshot_write(f, recs, nr);
+	if (fclose(f) && !err)
+		err = errno;
+	if (err)
+		fprintf(stderr, "failed to write snapshot\n");
+ free:
+	free(recs);
+	free(pdevs);
+	if (scanned)
+		free_devs(devs, nr);
+	return err;
+}
+
+struct snap_file {
+	const char *path;
+	void *map;
+	size_t size;
+	__u64 nr_rows;
+	int nr_cols;
+	struct snap_col_hdr *cols;
+};
+
+static int snap_open(const char *path, struct snap_file *sf)
+{
+	struct snap_header *hdr;
+	struct stat sb;
+	int i, sfd;
+
+	memset(sf, 0, sizeof(*sf));
+	sf->path = path;
+	sfd = open(path, O_RDONLY);
+	if (sfd < 0 || fstat(sfd, &sb) < 0) {
+		perror(path);
+		if (sfd >= 0)
+			close(sfd);
+		return errno;
+	}
+	sf->size = sb.st_size;
+	if (sf->size < sizeof(*hdr))
+		goto invalid;
+	sf->map = mmap(NULL, sf->size, PROT_READ, MAP_PRIVATE, sfd, 0);
+	close(sfd);
+	if (sf->map == MAP_FAILED) {
+		perror(path);
+		return errno;
+	}
+
+	hdr = sf->map;
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+				le32toh(hdr->version) != SNAP_VERSION)
+		goto unmap;
+	sf->nr_rows = le64toh(hdr->nr_rows);
+	sf->nr_cols = le32toh(hdr->nr_cols);
+	sf->cols = (struct snap_col_hdr *)(hdr + 1);
+	if (sizeof(*hdr) + sf->nr_cols * sizeof(*sf->cols) > sf->size)
+		goto unmap;
+	/* the fields are untrusted, so check without overflowing */
+	for (i = 0; i < sf->nr_cols; i++) {
+		__u64 offset = le64toh(sf->cols[i].offset);
+		__u16 width = le16toh(sf->cols[i].width);
+
+		if (!width || offset > sf->size ||
+				sf->nr_rows > (sf->size - offset) / width)
+			goto unmap;
+	}
+	return 0;
+ unmap:
+	munmap(sf->map, sf->size);
+ invalid:
+	fprintf(stderr, "%s: not a valid snapshot file\n", path);
+	return EINVAL;
+}
+
+static void snap_close(struct snap_file *sf)
+{
+	munmap(sf->map, sf->size);
+}
+
+static struct snap_col_hdr *snap_find_col(struct snap_file *sf,
+							const char *name)
+{
+	int i;
+
+	for (i = 0; i < sf->nr_cols; i++)
+		if (!strncmp(sf->cols[i].name, name, sizeof(sf->cols[i].name)))
+			return &sf->cols[i];
+	return NULL;
+}
+
+static const __u8 *snap_cell(struct snap_file *sf, struct snap_col_hdr *col,
+								__u64 row)
+{
+	return (const __u8 *)sf->map + le64toh(col->offset) +
+					row * le16toh(col->width);
+}
+
+static __int128 snap_cell_value(struct snap_col_hdr *col, const __u8 *p)
+{
+	int i, width = le16toh(col->width);
+	__uint128_t v = 0;
+
+	for (i = (width > 16 ? 16 : width) - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	if (col->fmt == FIELD_TEMP)
+		return (__int128)v - 273;
+	return v;
+}
+
+/* length of a fixed width string cell without its trailing pad */
+static int snap_cell_strlen(struct snap_col_hdr *col, const __u8 *p)
+{
+	int n = le16toh(col->width);
+
+	while (n && (p[n - 1] == ' ' || p[n - 1] == '\0'))
+		n--;
+	return n;
+}
+
+enum {
+	QUERY_EQ, QUERY_NE, QUERY_LT, QUERY_LE, QUERY_GT, QUERY_GE,
+};
+
+struct query_cond {
+	char name[32];
+	int op;
+	const char *str;
+	__int128 val;
+	struct snap_col_hdr *col;
+};
+
+enum {
+	AGG_MAX, AGG_MIN, AGG_SUM,
+};
+
+struct query_agg {
+	const char *name;
+	int type;
+	struct snap_col_hdr *col;
+};
+
+#define QUERY_MAX_KEYS	4
+#define QUERY_MAX_CONDS	16
+#define QUERY_MAX_AGGS	16
+
+/* a group of rows sharing a printable key, found through a group_table */
+struct agg_group {
+	char *key;
+	__u64 count;
+	__int128 agg[QUERY_MAX_AGGS];
+};
+
+struct group_table {
+	struct agg_group *groups;
+	unsigned int nr_groups, nr_slots;
+};
+
+struct query {
+	char *keys[QUERY_MAX_KEYS];
+	int nr_keys;
+	struct query_cond conds[QUERY_MAX_CONDS];
+	int nr_conds;
+	struct query_agg aggs[QUERY_MAX_AGGS];
+	int nr_aggs;
+
+	struct group_table table;
+};
+
+static int query_parse_cond(char *arg, struct query_cond *c)
+{
+	static const struct { const char *s; int op; } ops[] = {
+		{ "!=", QUERY_NE }, { "<=", QUERY_LE }, { ">=", QUERY_GE },
+		{ "=", QUERY_EQ }, { "<", QUERY_LT }, { ">", QUERY_GT },
+	};
+	size_t len = strcspn(arg, "!=<>");
+	int i;
+
+	if (!len || len >= sizeof(c->name) || !arg[len])
+		goto bad;
+	memcpy(c->name, arg, len);
+	c->name[len] = '\0';
+	for (i = 0; i < ARRAY_SIZE(ops); i++) {
+		size_t n = strlen(ops[i].s);
+
+		if (!strncmp(arg + len, ops[i].s, n)) {
+			c->op = ops[i].op;
+			c->str = arg + len + n;
+			c->val = strtoll(c->str, NULL, 0);
+			return 0;
+		}
+	}
+ bad:
+	fprintf(stderr, "bad condition:%s, expected <column><op><value>\n",
+									arg);
+	return EINVAL;
+}
+
+static int query_cmp(int op, int cmp)
+{
+	switch (op) {
+	case QUERY_EQ: return cmp == 0;
+	case QUERY_NE: return cmp != 0;
+	case QUERY_LT: return cmp < 0;
+	case QUERY_LE: return cmp <= 0;
+	case QUERY_GT: return cmp > 0;
+	case QUERY_GE: return cmp >= 0;
+	}
+	return 0;
+}
+
+static int query_match(struct query *q, struct snap_file *sf, __u64 row)
+{
+	int i;
+
+	for (i = 0; i < q->nr_conds; i++) {
+		struct query_cond *c = &q->conds[i];
+		const __u8 *p = snap_cell(sf, c->col, row);
+		int cmp;
+
+		if (c->col->fmt == FIELD_STR) {
+			int n = snap_cell_strlen(c->col, p);
+
+			cmp = strncmp((const char *)p, c->str, n);
+			if (!cmp && c->str[n])
+				cmp = -1;
+		} else {
+			__int128 v = snap_cell_value(c->col, p);
+
+			cmp = v < c->val ? -1 : v > c->val;
+		}
+		if (!query_cmp(c->op, cmp))
+			return 0;
+	}
+	return 1;
+}
+
+/* builds the printable group key for a row, keys separated by tabs */
+static void query_key(struct query *q, struct snap_file *sf,
+				struct snap_col_hdr **cols, __u64 row,
+				char *key, size_t len)
+{
+	char num[U128_STR_LEN];
+	size_t off = 0;
+	int i;
+
+	key[0] = '\0';
+	for (i = 0; i < q->nr_keys; i++) {
+		const __u8 *p = snap_cell(sf, cols[i], row);
+
+		if (i)
+			off += snprintf(key + off, len - off, "\t");
+		if (cols[i]->fmt == FIELD_STR)
+			off += snprintf(key + off, len - off, "%.*s",
+					snap_cell_strlen(cols[i], p), p);
+		else
+			off += snprintf(key + off, len - off, "%s",
+				i128_to_str(snap_cell_value(cols[i], p), num));
+		if (off >= len)
+			break;
+	}
+}
+
+static unsigned long hash_str(const char *s)
+{
+	unsigned long h = 14695981039346656037UL;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+	return h;
+}
+
+static struct agg_group *group_get(struct group_table *t, const char *key)
+{
+	struct agg_group *g;
+	unsigned int i;
+
+	if ((t->nr_groups + 1) * 2 > t->nr_slots) {
+		struct agg_group *old = t->groups;
+		unsigned int n = t->nr_slots;
+
+		t->nr_slots = n ? n * 2 : 64;
+		t->groups = calloc(t->nr_slots, sizeof(*t->groups));
+		if (!t->groups) {
+			fprintf(stderr, "No memory for groups\n");
+			exit(ENOMEM);
+		}
+		for (i = 0; i < n; i++) {
+			unsigned int j;
+
+			if (!old[i].key)
+				continue;
+			j = hash_str(old[i].key) & (t->nr_slots - 1);
+			while (t->groups[j].key)
+				j = (j + 1) & (t->nr_slots - 1);
+			t->groups[j] = old[i];
+		}
+		free(old);
+	}
+
+	i = hash_str(key) & (t->nr_slots - 1);
+	for (g = &t->groups[i]; g->key; g = &t->groups[i]) {
+		if (!strcmp(g->key, key))
+			return g;
+		i = (i + 1) & (t->nr_slots - 1);
+	}
+	g->key = strdup(key);
+	t->nr_groups++;
+	return g;
+}
+
+/*
+ * Packs the groups of a table to its front and sorts them. The table is
+ * no longer usable for lookups afterwards. Returns the number of groups.
+ */
+static unsigned int group_sort(struct group_table *t,
+			int (*cmp)(const void *, const void *))
+{
+	unsigned int i, n;
+
+	for (i = 0, n = 0; i < t->nr_slots; i++)
+		if (t->groups[i].key)
+			t->groups[n++] = t->groups[i];
+	qsort(t->groups, n, sizeof(*t->groups), cmp);
+	return n;
+}
+
+/*
+ * Frees the table and the keys of its first 'nr' groups: the count from
+ * group_sort, or nr_slots for a table that was never sorted.
+ */
+static void group_free(struct group_table *t, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		free(t->groups[i].key);
+	free(t->groups);
+}
+
+static int query_file(struct query *q, struct snap_file *sf)
+{
+	struct snap_col_hdr *keys[QUERY_MAX_KEYS];
+	char key[512];
+	__u64 row;
+	int i;
+
+	for (i = 0; i < q->nr_keys; i++) {
+		keys[i] = snap_find_col(sf, q->keys[i]);
+		if (!keys[i])
+			goto missing;
+	}
+	for (i = 0; i < q->nr_conds; i++) {
+		q->conds[i].col = snap_find_col(sf, q->conds[i].name);
+		if (!q->conds[i].col)
+			goto missing;
+	}
+	for (i = 0; i < q->nr_aggs; i++) {
+		q->aggs[i].col = snap_find_col(sf, q->aggs[i].name);
+		if (!q->aggs[i].col)
+			goto missing;
+		if (q->aggs[i].col->fmt == FIELD_STR) {
+			fprintf(stderr, "can not aggregate string column:%s\n",
+							q->aggs[i].name);
+			return EINVAL;
+		}
+	}
+
+	for (row = 0; row < sf->nr_rows; row++) {
+		struct agg_group *g;
+
+		if (!query_match(q, sf, row))
+			continue;
+		query_key(q, sf, keys, row, key, sizeof(key));
+		g = group_get(&q->table, key);
+		for (i = 0; i < q->nr_aggs; i++) {
+			struct query_agg *a = &q->aggs[i];
+			__int128 v = snap_cell_value(a->col,
+						snap_cell(sf, a->col, row));
+
+			if (!g->count)
+				g->agg[i] = v;
+			else if (a->type == AGG_SUM)
+				g->agg[i] += v;
+			else if (a->type == AGG_MAX && v > g->agg[i])
+				g->agg[i] = v;
+			else if (a->type == AGG_MIN && v < g->agg[i])
+				g->agg[i] = v;
+		}
+		g->count++;
+	}
+	return 0;
+ missing:
+	fprintf(stderr, "%s: missing a requested column, see --list-columns\n",
+								sf->path);
+	return EINVAL;
+}
+
+static int group_key_cmp(const void *a, const void *b)
+{
+	const struct agg_group *ga = a, *gb = b;
+
+	return strcmp(ga->key, gb->key);
+}
+
+static void query_show(struct query *q)
+{
+	static const char *agg_names[] = { "max", "min", "sum" };
+	char num[U128_STR_LEN];
+	unsigned int i, n;
+	int j;
+
+	n = group_sort(&q->table, group_key_cmp);
+
+	for (j = 0; j < q->nr_keys; j++)
+		printf("%s\t", q->keys[j]);
+	printf("count");
+	for (j = 0; j < q->nr_aggs; j++)
+		printf("\t%s(%s)", agg_names[q->aggs[j].type], q->aggs[j].name);
+	printf("\n");
+
+	for (i = 0; i < n; i++) {
+		struct agg_group *g = &q->table.groups[i];
+
+		if (q->nr_keys)
+			printf("%s\t", g->key);
+		printf("%llu", (unsigned long long)g->count);
+		for (j = 0; j < q->nr_aggs; j++)
+			printf("\t%s", i128_to_str(g->agg[j], num));
+		printf("\n");
+	}
+	group_free(&q->table, n);
+}
+
+static int query_add_aggs(struct query *q, char *list, int type)
+{
+	char *name, *save = NULL;
+
+	for (name = strtok_r(list, ",", &save); name;
+					name = strtok_r(NULL, ",", &save)) {
+		if (q->nr_aggs == QUERY_MAX_AGGS) {
+			fprintf(stderr, "too many aggregates\n");
+			return EINVAL;
+		}
+		q->aggs[q->nr_aggs].name = name;
+		q->aggs[q->nr_aggs++].type = type;
+	}
+	return 0;
+}
+
+static int query(int argc, char **argv)
+{
+	int opt, err = 0, i, long_index = 0;
+	char *name, *save = NULL;
+	struct query q;
+	static struct option opts[] = {
+		{"group-by", required_argument, 0, 'g'},
+		{"where", required_argument, 0, 'w'},
+		{"max", required_argument, 0, 'M'},
+		{"min", required_argument, 0, 'm'},
+		{"sum", required_argument, 0, 's'},
+		{"list-columns", no_argument, 0, 'l'},
+		{0, 0, 0, 0 }
+	};
+
+	memset(&q, 0, sizeof(q));
+	while ((opt = getopt_long(argc, (char **)argv, "g:w:M:m:s:l", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'g':
+			for (name = strtok_r(optarg, ",", &save); name;
+					name = strtok_r(NULL, ",", &save)) {
+				if (q.nr_keys == QUERY_MAX_KEYS) {
+					fprintf(stderr, "too many group-by keys\n");
+					return EINVAL;
+				}
+				q.keys[q.nr_keys++] = name;
+			}
+			break;
+		case 'w':
+			if (q.nr_conds == QUERY_MAX_CONDS) {
+				fprintf(stderr, "too many conditions\n");
+				return EINVAL;
+			}
+			if (query_parse_cond(optarg, &q.conds[q.nr_conds++]))
+				return EINVAL;
+			break;
+		case 'M':
+			err = query_add_aggs(&q, optarg, AGG_MAX);
+			break;
+		case 'm':
+			err = query_add_aggs(&q, optarg, AGG_MIN);
+			break;
+		case 's':
+			err = query_add_aggs(&q, optarg, AGG_SUM);
+			break;
+		case 'l':
+			for (i = 0; i < ARRAY_SIZE(snap_cols); i++)
+				printf("%s\n", snap_cols[i].name);
+			return 0;
+		default:
+			return EINVAL;
+		}
+		if (err)
+			return err;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "no snapshot file provided\n");
+		return EINVAL;
+	}
+
+	for (i = optind; i < argc && !err; i++) {
+		struct snap_file sf;
+
+		err = snap_open(argv[i], &sf);
+		if (err)
+			break;
+		err = query_file(&q, &sf);
+		snap_close(&sf);
+	}
+	if (!err)
+		query_show(&q);
+	else
+		group_free(&q.table, q.table.nr_slots);
+	return err;
+}
+
+/*
+ * Error log aggregation: every entry of each controller's error log is
+ * decoded once and counted into groups keyed by any of device, status,
+ * submission queue, namespace and LBA region, so patterns across a fleet
+ * show up without reading every entry of every drive.
+ */
+static const struct {
+	const char *name;
+	int key;
+} err_keys[] = {
+	{ "dev", ERR_KEY_DEV },
+	{ "status", ERR_KEY_STATUS },
+	{ "sqid", ERR_KEY_SQID },
+	{ "nsid", ERR_KEY_NSID },
+	{ "region", ERR_KEY_REGION },
+};
+
+struct err_agg {
+	struct group_table table;
+	int keys;
+	__u64 region_size;
+	unsigned int log_entries;
+	__u32 nsid;
+	int failed;
+};
+
+struct err_agg_dev {
+	struct err_agg *agg;
+	struct nvme_error_log_page *log;
+	int err;
+};
+
+static int parse_err_keys(char *list)
+{
+	char *name, *save = NULL;
+	int i, keys = 0;
+
+	for (name = strtok_r(list, ",", &save); name;
+					name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < ARRAY_SIZE(err_keys); i++)
+			if (!strcmp(name, err_keys[i].name))
+				break;
+		if (i == ARRAY_SIZE(err_keys)) {
+			fprintf(stderr, "unknown group-by key:%s, expected "
+				"dev, status, sqid, nsid or region\n", name);
+			return -1;
+		}
+		keys |= err_keys[i].key;
+	}
+	return keys;
+}
+
+static void err_agg_merge(struct err_agg *agg, const char *dev,
+			struct nvme_error_log_page *log, unsigned int entries)
+{
+	char key[256];
+	unsigned int i;
+	size_t off;
+
+	for (i = 0; i < entries; i++) {
+		struct nvme_error_log_page *e = &log[i];
+		struct agg_group *g;
+		int status = (le16toh(e->status_field) >> 1) & 0x7ff;
+
+		if (!e->error_count)
+			continue;
+		off = 0;
+		key[0] = '\0';
+		if (agg->keys & ERR_KEY_DEV)
+			off += snprintf(key + off, sizeof(key) - off, "%s\t", dev);
+		if (agg->keys & ERR_KEY_STATUS)
+			off += snprintf(key + off, sizeof(key) - off, "%s(%#x)\t",
+					nvme_status_to_string(status), status);
+		if (agg->keys & ERR_KEY_SQID)
+			off += snprintf(key + off, sizeof(key) - off, "%u\t",
+							le16toh(e->sqid));
+		if (agg->keys & ERR_KEY_NSID)
+			off += snprintf(key + off, sizeof(key) - off, "%#x\t",
+							le32toh(e->nsid));
+		if (agg->keys & ERR_KEY_REGION)
+			snprintf(key + off, sizeof(key) - off, "%#llx\t",
+				(unsigned long long)(le64toh(e->lba) /
+				agg->region_size * agg->region_size));
+
+		g = group_get(&agg->table, key);
+		if (!g->count || e->error_count < g->agg[0])
+			g->agg[0] = e->error_count;
+		if (!g->count || e->error_count > g->agg[1])
+			g->agg[1] = e->error_count;
+		g->count++;
+	}
+}
+
+static int err_agg_fetch(int fd, void *ctx)
+{
+	struct err_agg_dev *ad = ctx;
+	size_t len = ad->agg->log_entries * sizeof(*ad->log);
+
+	ad->log = calloc(1, len);
+	if (!ad->log)
+		return -ENOMEM;
+	ad->err = nvme_get_log(fd, ad->log, len, 0x1 | (((len / 4) - 1) << 16),
+							ad->agg->nsid);
+	if (ad->err < 0)
+		return -errno;
+	return 0;
+}
+
+static const struct pipe_stage err_agg_stages[] = {
+	{ "error log", err_agg_fetch },
+};
+
+static void err_agg_done(struct pipe_dev *dev)
+{
+	struct err_agg_dev *ad = dev->ctx;
+
+	if (dev->err) {
+		fprintf(stderr, "%s: %s\n", dev->path, strerror(dev->err));
+		ad->agg->failed++;
+	} else if (ad->err) {
+		fprintf(stderr, "%s: NVMe Status: %s\n", dev->path,
+					nvme_status_to_string(ad->err));
+		ad->agg->failed++;
+	} else
+		err_agg_merge(ad->agg, dev->path, ad->log,
+						ad->agg->log_entries);
+	free(ad->log);
+	ad->log = NULL;
+}
+
+static int group_count_cmp(const void *a, const void *b)
+{
+	const struct agg_group *ga = a, *gb = b;
+
+	if (ga->count != gb->count)
+		return ga->count < gb->count ? 1 : -1;
+	return strcmp(ga->key, gb->key);
+}
+
+static int error_log_aggregate(char **devs, int nr, unsigned int log_entries,
+			__u32 nsid, int keys, __u64 region_size, int jobs)
+{
+	struct err_agg agg;
+	struct err_agg_dev *ads;
+	struct pipe_dev *pdevs;
+	unsigned int i, n;
+	int err;
+
+	memset(&agg, 0, sizeof(agg));
+	agg.keys = keys;
+	agg.region_size = region_size;
+	agg.log_entries = log_entries;
+	agg.nsid = nsid;
+
+	ads = calloc(nr, sizeof(*ads));
+	pdevs = calloc(nr, sizeof(*pdevs));
+	if (!ads || !pdevs) {
+		fprintf(stderr, "No memory for %d devices\n", nr);
+		err = ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < nr; i++) {
+		ads[i].agg = &agg;
+		pdevs[i].path = devs[i];
+		pdevs[i].ctx = &ads[i];
+	}
+	err = run_pipeline(pdevs, nr, err_agg_stages,
+			ARRAY_SIZE(err_agg_stages), jobs, err_agg_done);
+	if (err)
+		goto free;
+
+	n = group_sort(&agg.table, group_count_cmp);
+	printf("Error Log Aggregate for %d device(s) region-size:%#llx\n",
+				nr - agg.failed, (unsigned long long)region_size);
+	for (i = 0; i < ARRAY_SIZE(err_keys); i++)
+		if (keys & err_keys[i].key)
+			printf("%s\t", err_keys[i].name);
+	printf("count\tfirst\tlast\n");
+	for (i = 0; i < n; i++) {
+		struct agg_group *g = &agg.table.groups[i];
+
+		printf("%s%llu\t%llu\t%llu\n", g->key,
+			(unsigned long long)g->count,
+			(unsigned long long)g->agg[0],
+			(unsigned long long)g->agg[1]);
+	}
+	group_free(&agg.table, n);
+	if (agg.failed)
+		err = EIO;
+ free:
+	free(ads);
+	free(pdevs);
+	return err;
+}
+
+static int id_ctrl(int argc, char **argv)
+{
+	int opt, err, raw = 0, vs = 0, long_index = 0, nr_sel = 0;
+	struct nvme_id_ctrl ctrl;
+	const struct field_desc *sel[ARRAY_SIZE(id_ctrl_fields)];
+	static struct option opts[] = {
+		{"vendor-specific", no_argument, 0, 'v'},
+		{"raw-binary", no_argument, 0, 'b'},
+		{"fields", required_argument, 0, 'f'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "vbf:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'f':
+			nr_sel = parse_fields(optarg, id_ctrl_fields,
+					ARRAY_SIZE(id_ctrl_fields), sel);
+			if (nr_sel < 0)
+				return EINVAL;
+			break;
+		case 'v':
+			vs = 1;
+			break;
+		case 'b':
+			raw = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+	err = identify(fd, 0, &ctrl, 1);
+	if (!err) {
+		if (raw)
 			d_raw((unsigned char *)&ctrl, sizeof(ctrl));
+		else if (nr_sel)
+			show_fields(&ctrl, sel, nr_sel, 8);
+		else
+			show_nvme_id_ctrl(&ctrl, vs);
+	}
+	else if (err > 0)
+		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
+
+	return err;
+}
+
+static int id_ns(int argc, char **argv)
+{
+	struct nvme_id_ns ns;
+	const struct field_desc *sel[ARRAY_SIZE(id_ns_fields)];
+	int opt, err, long_index = 0, nr_sel = 0;
+	unsigned int nsid = 0, vs = 0, raw = 0;
+
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"vendor-specific", no_argument, 0, 'v'},
+		{"raw-binary", no_argument, 0, 'b'},
+		{"fields", required_argument, 0, 'f'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:vbf:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'f':
+			nr_sel = parse_fields(optarg, id_ns_fields,
+					ARRAY_SIZE(id_ns_fields), sel);
+			if (nr_sel < 0)
+				return EINVAL;
+			break;
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'v':
+			vs = 1;
+			break;
+		case 'b':
+			raw = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+	if (!nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			exit(ENOTBLK);
+		}
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			perror(devicename);
+			exit(errno);
+		}
+	}
+	err = identify(fd, nsid, &ns, 0);
+	if (!err) {
+		if (raw)
+			d_raw((unsigned char *)&ns, sizeof(ns));
+		else if (nr_sel)
+			show_fields(&ns, sel, nr_sel, 8);
+		else
+			show_nvme_id_ns(&ns, nsid, vs);
+	}
+	else if (err > 0)
+		fprintf(stderr, "NVMe Status: %s NSID:%d\n", nvme_status_to_string(err), nsid);
+	return err;
+}
+
+static int get_ns_id(int argc, char **argv)
+{
+	int nsid;
+
+	open_dev(argv[1]);
+	if (!S_ISBLK(nvme_stat.st_mode)) {
+		fprintf(stderr, "%s: requesting nsid from non-block device\n",
+								devicename);
+		exit(ENOTBLK);
+	}
+	nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+	if (nsid <= 0) {
+		perror(devicename);
+		exit(errno);
+	}
+	printf("%s: namespace-id:%d\n", devicename, nsid);
+	return 0;
+}
+
+static int get_feature(int argc, char **argv)
+{
+	int opt, err, long_index = 0;
+	unsigned int f, result, raw = 0, cdw10, cdw11 = 0, nsid = 0, data_len = 0;
+	unsigned char sel = 0;
+	void *buf = NULL;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"feature-id", required_argument, 0, 'f'},
+		{"sel", required_argument, 0, 's'},
+		{"cdw11", required_argument, 0, 0},
+		{"data-len", required_argument, 0, 'l'},
+		{"raw-binary", no_argument, 0, 'b'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:f:l:s:b", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 0:
+			get_int(optarg, &cdw11);
+			break;
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'f':
+			get_int(optarg, &f);
+			break;
+		case 'l':
+			get_int(optarg, &data_len);
+			break;
+		case 's':
+			get_byte(optarg, &sel);
+			break;
+		case 'b':
+			raw = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+	if (sel > 7) {
+		fprintf(stderr, "invalid 'select' param:%d\n", sel);
+		return EINVAL;
+	}
+	if (!f) {
+		fprintf(stderr, "feature-id required param\n");
+		return EINVAL;
+	}
+	if (f == NVME_FEAT_LBA_RANGE)
+		data_len = 4096;
+	if (data_len)
+		buf = malloc(data_len);
+
+	cdw10 = sel << 8 | f;
+	err = nvme_feature(fd, nvme_admin_get_features, buf, data_len, cdw10, nsid,
+							cdw11, &result);
+	if (!err) {
+		printf("get-feature:%d(%s), value:%#08x\n", f,
+			nvme_feature_to_string(f), result);
+		if (buf) {
+			if (!raw) {
+				if (f == NVME_FEAT_LBA_RANGE)
+					show_lba_range((struct nvme_lba_range_type *)buf,
+									result);
+				else
+					d(buf, data_len, 16, 1);
+			}
+			else
+				d_raw(buf, data_len);
+		}
+	}
+	else if (err > 0)
+		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
+	if (buf)
+		free(buf);
+	return err;
+}
+
+#define min(x, y) x > y ? y : x;
+static int fw_download(int argc, char **argv)
+{
+	int opt, err, long_index = 0, fw_fd = -1;
+	unsigned int fw_size, xfer_size = 4096, offset = 0;
+	struct stat sb;
+	struct nvme_admin_cmd cmd;
+	void *fw_buf;
+	static struct option opts[] = {
+		{"fw", required_argument, 0, 'f'},
+		{"xfer", required_argument, 0, 'x'},
+		{"offset", required_argument, 0, 'o'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "x:f:o:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'f':
+			fw_fd = open(optarg, O_RDONLY);
+			break;
+		case 'x':
+			get_int(optarg, &xfer_size);
+			break;
+		case 'p':
+			get_int(optarg, &offset);
+			offset <<= 2;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (fw_fd < 0) {
+		fprintf(stderr, "no firmware file provided\n");
+		return EINVAL;
+	}
+	err = fstat(fw_fd, &sb);
+	if (err < 0) {
+		perror("fstat");
+		exit(errno);
+	}
+
+	fw_size = sb.st_size;
+	if (fw_size & 0x3) {
+		fprintf(stderr, "Invalid size:%d for f/w image\n", fw_size);
+		return EINVAL;
+	} 
+	if (posix_memalign(&fw_buf, getpagesize(), fw_size)) {
+		fprintf(stderr, "No memory for f/w size:%d\n", fw_size);
+		return ENOMEM;
+	}
+	if (xfer_size % 4096)
+		xfer_size = 4096;
+
+	while (fw_size > 0) {
+		xfer_size = min(xfer_size, fw_size);
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.opcode = nvme_admin_download_fw;
+		cmd.addr = (__u64)fw_buf;
+		cmd.data_len = xfer_size;
+		cmd.cdw10 = (xfer_size >> 2) - 1;
+		cmd.cdw11 = offset >> 2; 
+
+		err = nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+		if (err < 0) {
+			perror("ioctl");
+			exit(errno);
+		} else if (err != 0) {
+			fprintf(stderr, "NVME Admin command error:%d\n", err);
+			break;
+		}
+		fw_buf += xfer_size;
+		fw_size -= xfer_size;
+		offset += xfer_size;
+	}
+	if (!err)
+		printf("Firmware download success\n");
+	return err;
+}
+
+static int fw_activate(int argc, char **argv)
+{
+	int opt, err, long_index;
+	unsigned char slot = 0, action = 1;
+	struct nvme_admin_cmd cmd;
+	static struct option opts[] = {
+		{"slot", required_argument, 0, 's'},
+		{"action", required_argument, 0, 'a'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "s:a:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 's':
+			get_byte(optarg, &slot);
+			if (slot > 7) {
+				fprintf(stderr, "invalid slot:%d\n", slot);
+				return EINVAL;
+			}
+			break;
+		case 'a':
+			get_byte(optarg, &action);
+			if (action > 3) {
+				fprintf(stderr, "invalid action:%d\n", action);
+				return EINVAL;
+			}
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = nvme_admin_activate_fw;
+	cmd.cdw10 = (action << 3) | slot;
+
+	err = nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (err < 0)
+		perror("ioctl");
+	else if (err != 0)
+		fprintf(stderr, "NVME Admin command error:%d\n", err);
+	else
+		printf("Success activating firmware action:%d slot:%d\n", action, slot);
+	return err;
+}
+
+/* registers must be read a dword at a time */
+static void read_bar(const volatile __u32 *regs, struct nvme_bar *bar)
+{
+	__u32 *p = (__u32 *)bar;
+	int i;
+
+	for (i = 0; i < sizeof(*bar) / sizeof(__u32); i++)
+		p[i] = regs[i];
+}
+
+static int show_registers(int argc, char **argv)
+{
+	int opt, long_index, pci_fd, nr_rules = 0;
+	unsigned int watch = 0, count = 0, n, i;
+	char *base, path[512];
+	void *membase;
+	struct nvme_bar bar;
+	struct alert_rule rules[MAX_ALERTS];
+	static struct option opts[] = {
+		{"watch", required_argument, 0, 'w'},
+		{"count", required_argument, 0, 'c'},
+		{"alert", required_argument, 0, 'a'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "w:c:a:", opts,
+					&long_index)) != -1) {
+		switch (opt) {
+		case 'w':
+			get_int(optarg, &watch);
+			break;
+		case 'c':
+			get_int(optarg, &count);
+			break;
+		case 'a':
+			if (nr_rules == MAX_ALERTS) {
+				fprintf(stderr, "too many alert rules\n");
+				return EINVAL;
+			}
+			if (parse_alert(optarg, &rules[nr_rules++],
+					regs_fields, ARRAY_SIZE(regs_fields),
+					NULL, 0))
+				return EINVAL;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!S_ISCHR(nvme_stat.st_mode)) {
+		fprintf(stderr, "%s is not character device\n", devicename);
+		exit(ENODEV);
+	}
+
+	base = basename(devicename);
+	sprintf(path, "/sys/class/misc/%s/device/resource0", base);
+	pci_fd = open(path, O_RDONLY);
+	if (pci_fd < 0) {
+		fprintf(stderr, "%s did not find a pci resource\n", devicename);
+		exit(ENODEV);
+	}
+
+	membase = mmap(0, getpagesize(), PROT_READ, MAP_SHARED, pci_fd, 0);
+	if (membase == MAP_FAILED) {
+		fprintf(stderr, "%s failed to map\n", devicename);
+		exit(ENODEV);
+	}
+
+	if (!watch)
+		count = 1;
+	for (n = 0; !count || n < count; n++) {
+		if (n)
+			sleep(watch);
+		read_bar(membase, &bar);
+		if (nr_rules) {
+			alert_update(rules, nr_rules, &bar, NULL, devicename);
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(regs_fields); i++)
+			show_field(&bar, &regs_fields[i], 8);
+		fflush(stdout);
+	}
+	munmap(membase, getpagesize());
+	close(pci_fd);
+	return 0;
+}
+
+static int format(int argc, char **argv)
+{
+	int opt, err, long_index;
+	unsigned int nsid = 0xffffffff;
+	unsigned char lbaf = 0, ses = 0, pil = 0, pi = 0, ms = 0;
+	struct nvme_admin_cmd cmd;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"lbaf", required_argument, 0, 'l'},
+		{"ses", required_argument, 0, 's'},
+		{"pil", required_argument, 0, 'p'},
+		{"pi", required_argument, 0, 'i'},
+		{"ms", required_argument, 0, 'm'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:l:s:p:i:m:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		case 'l': get_byte(optarg, &lbaf); break;
+		case 's': get_byte(optarg, &ses); break;
+		case 'p': get_byte(optarg, &pil); break;
+		case 'i': get_byte(optarg, &pi); break;
+		case 'm': get_byte(optarg, &ms); break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (ms > 1) {
+		fprintf(stderr, "invalid pi:%d\n", ms);
+		return EINVAL;
+	}
+	if (pil > 1) {
+		fprintf(stderr, "invalid pi location:%d\n", pil);
+		return EINVAL;
+	}
+	if (ses > 7) {
+		fprintf(stderr, "invalid secure erase settings:%d\n", ses);
+		return EINVAL;
+	}
+	if (lbaf > 15) {
+		fprintf(stderr, "invalid lbaf:%d\n", lbaf);
+		return EINVAL;
+	}
+	if (pi > 7) {
+		fprintf(stderr, "invalid pi:%d\n", pi);
+		return EINVAL;
+	}
+	if (S_ISBLK(nvme_stat.st_mode)) {
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			fprintf(stderr,
+				"%s: failed to return namespace id\n",
+				devicename);
+			return errno;
+		}
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = nvme_admin_format_nvm;
+	cmd.nsid = nsid;
+	cmd.cdw10 = (lbaf << 0) | (ms << 4) | (pi << 5) | (pil << 8) | (ses << 9);
+	
+	err = nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (err < 0)
+		perror("ioctl");
+	else if (err != 0)
+		fprintf(stderr, "NVME Admin command error:%s(%d)\n",
+					nvme_status_to_string(err), err);
+	else {
+		printf("Success formatting namespace:%x\n", nsid);
+		nvme_ioctl(fd, BLKRRPART, NULL);
+	}
+	return err;
+}
+
+/* FIXME: read a buffer from a file if the feature requires one */
+static int set_feature(int argc, char **argv)
+{
+	int opt, err, long_index = 0, val = -1;
+	unsigned int f, v, result, nsid = 0, data_len = 0;
+	void *buf = NULL;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"feature-id", required_argument, 0, 'f'},
+		{"value", required_argument, 0, 'v'},
+		{"data-len", required_argument, 0, 'l'},
+		{0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:f:l:v:", opts,
+							&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'f':
+			get_int(optarg, &f);
+			break;
+		case 'l':
+			get_int(optarg, &data_len);
+			break;
+		case 'v':
+			get_int(optarg, &v);
+			val = (int)v;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+	if (val == -1) {
+		fprintf(stderr, "feature value required param\n");
+		return EINVAL;
+	}
+	if (!f) {
+		fprintf(stderr, "feature-id required param\n");
+		return EINVAL;
+	}
+	if (f == NVME_FEAT_LBA_RANGE)
+		data_len = 4096;
+	if (data_len)
+		buf = malloc(data_len);
+
+	err = nvme_feature(fd, nvme_admin_set_features, buf, data_len, f, nsid, v, &result);
+	if (!err) {
+		printf("set-feature:%d(%s), value:%#08x\n", f,
+			nvme_feature_to_string(f), result);
+		if (buf) {
+			if (f == NVME_FEAT_LBA_RANGE)
+				show_lba_range((struct nvme_lba_range_type *)buf,
+								result);
+			else
+				d(buf, data_len, 16, 1);
+		}
+	}
+	else if (err > 0)
+		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
+	if (buf)
+		free(buf);
+	return err;
+}
+
+/*
+ * Maps a payload file read only. An empty file yields a NULL map and a
+ * zero size. Returns 0 or an errno.
+ */
+static int map_file(const char *path, void **map, size_t *size)
+{
+	struct stat sb;
+	int mfd, err = 0;
+
+	*map = NULL;
+	*size = 0;
+	mfd = open(path, O_RDONLY);
+	if (mfd < 0 || fstat(mfd, &sb) < 0) {
+		err = errno;
+		perror(path);
+		goto close;
+	}
+	*size = sb.st_size;
+	if (!*size)
+		goto close;
+	*map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, mfd, 0);
+	if (*map == MAP_FAILED) {
+		err = errno;
+		perror(path);
+		*map = NULL;
+	}
+ close:
+	if (mfd >= 0)
+		close(mfd);
+	return err;
+}
+
+static int nvme_sec(int fd, int opcode, __u8 secp, __u16 spsp, __u32 cdw11,
+				void *buf, __u32 data_len, __u32 *result)
+{
+	struct nvme_admin_cmd cmd;
+	int err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = opcode;
+	cmd.cdw10 = secp << 24 | spsp << 8;
+	cmd.cdw11 = cdw11;
+	cmd.data_len = data_len;
+	cmd.addr = (__u64)buf;
+
+	err = nvme_ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (err >= 0 && result)
+		*result = cmd.result;
+	return err;
+}
+
+static int sec_send(int argc, char **argv)
+{
+	int err, opt, long_index = 0;
+	void *sec_buf;
+	char *file = NULL;
+	unsigned int tl = 0, result;
+	unsigned short spsp = 0;
+	unsigned char secp = 0;
+	size_t sec_size;
+	static struct option opts[] = {
+		{"file", required_argument, 0, 'f'},
+		{"secp", required_argument, 0, 'p'},
+		{"spsp", required_argument, 0, 's'},
+		{"tl", required_argument, 0, 't'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "f:p:s:t:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			get_byte(optarg, &secp);
+			break;
+		case 's':
+			get_short(optarg, &spsp);
+			break;
+		case 't':
+			get_int(optarg, &tl);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!file) {
+		fprintf(stderr, "no security file provided\n");
+		return EINVAL;
+	}
+	err = map_file(file, &sec_buf, &sec_size);
+	if (err)
+		return err;
+	if (!tl)
+		tl = sec_size;
+
+	err = nvme_sec(fd, nvme_admin_security_send, secp, spsp, tl, sec_buf,
+							sec_size, &result);
+	if (err < 0)
+		err = errno;
+	else if (err != 0)
+		fprintf(stderr, "NVME Security Send Command Error:%d\n", err);
+	else
+		printf("NVME Security Send Command Success:%d\n", result);
+	if (sec_buf)
+		munmap(sec_buf, sec_size);
+	return err;
+}
+
+static int flush(int argc, char **argv)
+{
+	struct nvme_passthru_cmd cmd;
+	unsigned int nsid = 0xffffffff;
+        int err, opt, long_index = 0;
+
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = nvme_cmd_flush;
+	cmd.nsid = nsid;
+
+	err = nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+	if (err < 0)
+		return errno;
+	else if (err != 0)
+		fprintf(stderr, "NVME IO command error:%s(%d)\n",
+				nvme_status_to_string(err), err);
+	else
+		printf("NVMe Flush: success\n");
+	return 0;
+}
+
+static int resv_acquire(int argc, char **argv)
+{
+	struct nvme_passthru_cmd cmd;
+        int err, opt, long_index = 0;
+	unsigned int nsid = 0;
+	unsigned char rtype = 0, racqa = 0, iekey = 0;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"crkey", required_argument, 0, 'c'},
+		{"prkey", required_argument, 0, 'p'},
+		{"rtype", required_argument, 0, 't'},
+		{"racqa", required_argument, 0, 'a'},
+		{"iekey", no_argument, 0, 'i'},
+		{ 0, 0, 0, 0}
+	};
+	__u64 prkey= 0, crkey = 0, payload[2];
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:a:i", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		case 'c': get_long(optarg, &crkey); break;
+		case 'p': get_long(optarg, &prkey); break;
+		case 't': get_byte(optarg, &rtype); break;
+		case 'a': get_byte(optarg, &racqa); break;
+		case 'i': iekey = 1; break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			exit(ENOTBLK);
+		}
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			fprintf(stderr,
+				"%s: failed to return namespace id\n",
+				devicename);
+			return errno;
+		}
+	}
+	if (racqa > 7) {
+		fprintf(stderr, "invalid racqa:%d\n", racqa);
+		return EINVAL;
+	}
+
+	payload[0] = crkey;
+	payload[1] = prkey;
+
+	memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = nvme_cmd_resv_acquire;
+        cmd.nsid = nsid;
+        cmd.cdw10 = rtype << 8 | iekey << 3 | racqa;
+
+        cmd.addr = (__u64)payload;
+        cmd.data_len = sizeof(payload);
+
+        err = nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+        if (err < 0)
+                return errno;
+        else if (err != 0)
+                fprintf(stderr, "NVME IO command error:%04x\n", err);
+        else
+                printf("NVME Reservation Acquire success\n");
+	return 0;
+}
+
+static int resv_register(int argc, char **argv)
+{
+	struct nvme_passthru_cmd cmd;
+        int err, opt, long_index = 0;
+	unsigned int nsid = 0;
+	unsigned char rrega = 0, iekey = 0, cptpl = 0;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"crkey", required_argument, 0, 'c'},
+		{"nrkey", required_argument, 0, 'k'},
+		{"rrega", required_argument, 0, 'r'},
+		{"cptpl", required_argument, 0, 'p'},
+		{"iekey", required_argument, 0, 'i'},
+		{ 0, 0, 0, 0}
+	};
+	__u64 nrkey= 0, crkey = 0, payload[2];
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:i:k:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		case 'c': get_long(optarg, &crkey); break;
+		case 'k': get_long(optarg, &nrkey); break;
+		case 'r': get_byte(optarg, &rrega); break;
+		case 'p': get_byte(optarg, &cptpl); break;
+		case 'i': get_byte(optarg, &iekey); break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			exit(ENOTBLK);
+		}
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			fprintf(stderr,
+				"%s: failed to return namespace id\n",
+				devicename);
+			return errno;
+		}
+	}
+	if (iekey > 1) {
+		fprintf(stderr, "invalid iekey:%d\n", iekey);
+		return EINVAL;
+	}
+	if (cptpl > 3) {
+		fprintf(stderr, "invalid cptpl:%d\n", cptpl);
+		return EINVAL;
+	}
+
+	payload[0] = crkey;
+	payload[1] = nrkey;
+
+	memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = nvme_cmd_resv_register;
+        cmd.nsid = nsid;
+	cmd.cdw10 = cptpl << 30 | iekey << 3 | rrega;
+
+        cmd.addr = (__u64)payload;
+        cmd.data_len = sizeof(payload);
+
+        err = nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+        if (err < 0)
+                return errno;
+        else if (err != 0)
+                fprintf(stderr, "NVME IO command error:%04x\n", err);
+        else
+                printf("NVME Reservation  success\n");
+	return 0;
+}
+
+static int resv_release(int argc, char **argv)
+{
+	struct nvme_passthru_cmd cmd;
+        int err, opt, long_index = 0;
+	unsigned int nsid = 0;
+	unsigned char rtype = 0, rrela = 0, iekey = 0;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"crkey", required_argument, 0, 'c'},
+		{"rtype", required_argument, 0, 't'},
+		{"rrela", required_argument, 0, 'a'},
+		{"iekey", required_argument, 0, 'i'},
+		{ 0, 0, 0, 0}
+	};
+	__u64 crkey = 0;
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:a:i:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		case 'c': get_long(optarg, &crkey); break;
+		case 't': get_byte(optarg, &rtype); break;
+		case 'a': get_byte(optarg, &rrela); break;
+		case 'i': get_byte(optarg, &iekey); break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			exit(ENOTBLK);
+		}
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			fprintf(stderr,
+				"%s: failed to return namespace id\n",
+				devicename);
+			return errno;
+		}
+	}
+	if (iekey > 1) {
+		fprintf(stderr, "invalid iekey:%d\n", iekey);
+		return EINVAL;
+	}
+	if (rrela > 7) {
+		fprintf(stderr, "invalid rrela:%d\n", rrela);
+		return EINVAL;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = nvme_cmd_resv_release;
+        cmd.nsid = nsid;
+	cmd.cdw10 = rtype << 8 | iekey << 3 | rrela;
+
+        cmd.addr = (__u64)&crkey;
+        cmd.data_len = sizeof(crkey);
+
+        err = nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+        if (err < 0)
+                return errno;
+        else if (err != 0)
+                fprintf(stderr, "NVME IO command error:%04x\n", err);
+        else
+                printf("NVME Reservation Register success\n");
+	return 0;
+}
+
+static int resv_report(int argc, char **argv)
+{
+	struct nvme_passthru_cmd cmd;
+        int err, opt, long_index = 0, raw = 0;
+	unsigned int nsid = 0, numd = 0x1000 >> 2;
+	struct nvme_reservation_status *status;
+	static struct option opts[] = {
+		{"namespace-id", required_argument, 0, 'n'},
+		{"numd", required_argument, 0, 'd'},
+		{"raw-binary", no_argument, 0, 'b'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "n:d:r", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'n': get_int(optarg, &nsid); break;
+		case 'd': get_int(optarg, &numd); break;
+		case 'r': raw = 0; break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (!nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			exit(ENOTBLK);
+		}
+		nsid = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (nsid <= 0) {
+			fprintf(stderr,
+				"%s: failed to return namespace id\n",
+				devicename);
+			return errno;
+		}
+	}
+	if (!numd || numd > (0x1000 >> 2))
+		numd = 0x1000 >> 2;
+
+	if (posix_memalign((void **)&status, getpagesize(), numd << 2)) {
+		fprintf(stderr, "No memory for resv report:%d\n", numd << 2);
+		return ENOMEM;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = nvme_cmd_resv_report;
+        cmd.nsid = nsid;
+        cmd.cdw10 = numd;
+
+        cmd.addr = (__u64)status;
+        cmd.data_len = numd << 2;
+
+        err = nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+        if (err < 0)
+                return errno;
+        else if (err != 0)
+                fprintf(stderr, "NVME IO command error:%04x\n", err);
+        else {
+		if (!raw) {
+                	printf("NVME Reservation Report success\n");
+			show_nvme_resv_report(status);
+		} else
+			d_raw((unsigned char *)status, numd << 2);
+	}
+	return 0;
+}
+
+/*
+ * Write data patterns. Controllers that compress or deduplicate internally
+ * give very different numbers for zeroes, leftover heap and real data, so
+ * commands that write let the user pick:
+ *
+ *	random		incompressible, every 4KiB chunk unique
+ *	zero		all zeroes
+ *	compress:<r>	compresses about r:1; each chunk is 1/r random bytes
+ *			followed by zeroes
+ *	dedupe:<pct>	pct% of chunks are copies from a pool of 64, the
+ *			rest unique random
+ *
+ * Random data comes from four independent xorshift lanes, which the
+ * compiler turns into vector instructions, so filling costs far less than
+ * the I/O it feeds.
+ */
+#define PATTERN_CHUNK		4096
+#define PATTERN_POOL		64
+
+enum {
+	PATTERN_RANDOM,
+	PATTERN_ZERO,
+	PATTERN_COMPRESS,
+	PATTERN_DEDUPE,
+};
+
+struct data_pattern {
+	int type;
+	double ratio;
+	unsigned int dup_pct;
+	__u64 lane[4];
+	__u64 pick;
+};
+
+static __u64 splitmix64(__u64 *s)
+{
+	__u64 z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void pattern_seed(struct data_pattern *p, __u64 seed)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p->lane[i] = splitmix64(&seed) | 1;
+	p->pick = splitmix64(&seed) | 1;
+}
+
+static void pattern_random(__u64 *lane, __u64 *p, size_t words)
+{
+	__u64 x[4];
+	size_t i;
+	int j;
+
+	memcpy(x, lane, sizeof(x));
+	for (i = 0; i + 4 <= words; i += 4) {
+		for (j = 0; j < 4; j++) {
+			x[j] ^= x[j] << 13;
+			x[j] ^= x[j] >> 7;
+			x[j] ^= x[j] << 17;
+			p[i + j] = x[j];
+		}
+	}
+	for (j = 0; i < words; i++, j++) {
+		x[j] ^= x[j] << 13;
+		x[j] ^= x[j] >> 7;
+		x[j] ^= x[j] << 17;
+		p[i] = x[j];
+	}
+	memcpy(lane, x, sizeof(x));
+}
+
+static int parse_data_pattern(const char *arg, struct data_pattern *p)
+{
+	memset(p, 0, sizeof(*p));
+	if (!strcmp(arg, "random"))
+		p->type = PATTERN_RANDOM;
+	else if (!strcmp(arg, "zero"))
+		p->type = PATTERN_ZERO;
+	else if (sscanf(arg, "compress:%lf", &p->ratio) == 1 && p->ratio >= 1)
+		p->type = PATTERN_COMPRESS;
+	else if (sscanf(arg, "dedupe:%u", &p->dup_pct) == 1 &&
+							p->dup_pct <= 100)
+		p->type = PATTERN_DEDUPE;
+	else {
+		fprintf(stderr, "unknown data pattern: %s\n", arg);
+		return EINVAL;
+	}
+	pattern_seed(p, time(NULL) ^ getpid());
+	return 0;
+}
+
+/* Fills 'len' bytes, a multiple of 8, with the next data of the pattern. */
+static void fill_pattern(struct data_pattern *p, void *buf, size_t len)
+{
+	__u64 *w = buf, pool[4], r;
+	size_t n, rand;
+
+	if (p->type == PATTERN_RANDOM) {
+		pattern_random(p->lane, w, len / 8);
+		return;
+	}
+	if (p->type == PATTERN_ZERO) {
+		memset(buf, 0, len);
+		return;
+	}
+	for (; len; len -= n, w += n / 8) {
+		n = len < PATTERN_CHUNK ? len : PATTERN_CHUNK;
+		if (p->type == PATTERN_COMPRESS) {
+			rand = (size_t)(n / p->ratio) & ~7UL;
+			pattern_random(p->lane, w, rand / 8);
+			memset((__u8 *)w + rand, 0, n - rand);
+			continue;
+		}
+		p->pick ^= p->pick << 13;
+		p->pick ^= p->pick >> 7;
+		p->pick ^= p->pick << 17;
+		if (p->pick % 100 >= p->dup_pct) {
+			pattern_random(p->lane, w, n / 8);
+			continue;
+		}
+		/* pool chunks are regenerated from their index */
+		r = (p->pick >> 32) % PATTERN_POOL;
+		pool[0] = splitmix64(&r) | 1;
+		pool[1] = splitmix64(&r) | 1;
+		pool[2] = splitmix64(&r) | 1;
+		pool[3] = splitmix64(&r) | 1;
+		pattern_random(pool, w, n / 8);
+	}
+}
+
+static int submit_io(int opcode, char *command, int argc, char **argv)
+{
+	struct nvme_user_io io;
+	void *buffer;
+        int err, opt, dfd = opcode & 1 ? STDIN_FILENO : STDOUT_FILENO,
+	  show = 0, dry_run = 0, long_index = 0;
+	unsigned int data_size = 0;
+	__u8 prinfo = 0;
+	struct data_pattern pattern;
+	int use_pattern = 0, use_seed = 0;
+	__u64 seed = 0;
+
+	/* XXX: metadata ? */
+	static struct option opts[] = {
+		{"start-block", required_argument, 0, 's'},
+		{"block-count", required_argument, 0, 'c'},
+		{"data-size", required_argument, 0, 'z'},
+		{"ref-tag", required_argument, 0, 'r'},
+		{"data", required_argument, 0, 'd'},
+		{"prinfo", required_argument, 0, 'p'},
+		{"app-tag-mask", required_argument, 0, 'm'},
+		{"app-tag", required_argument, 0, 'a'},
+		{"limited-retry", no_argument, 0, 'l'},
+		{"force-unit-access", no_argument, 0, 'f'},
+		{"show-command", no_argument, 0, 'v'},
+		{"dry-run", no_argument, 0, 'w'},
+		{"pattern", required_argument, 0, 'P'},
+		{"seed", required_argument, 0, 'S'},
+		{ 0, 0, 0, 0}
+	};
+
+	memset(&io, 0, sizeof(io));
+	while ((opt = getopt_long(argc, (char **)argv, "p:s:c:z:r:d:m:a:lfvwP:S:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 's': get_long(optarg, &io.slba); break;
+		case 'c': get_short(optarg, &io.nblocks); break;
+		case 'z': get_int(optarg, &data_size); break;
+		case 'r': get_int(optarg, &io.reftag); break;
+		case 'm': get_short(optarg, &io.appmask); break;
+		case 'a': get_short(optarg, &io.apptag); break;
+		case 'p':
+			get_byte(optarg, &prinfo);
+			if (prinfo > 0xf)
+				return EINVAL;
+			io.control |= (prinfo << 10);
+			break;
+		case 'l':
+			io.control |= NVME_RW_LR;
+			break;
+		case 'f':
+			io.control |= NVME_RW_FUA;
+			break;
+		case 'd': 
+		        if (opcode & 1)
+			  dfd = open(optarg, O_RDONLY);		  
+			else
+			  dfd = open(optarg, O_WRONLY | O_CREAT, 660);
+			if (dfd < 0) {
+				perror(optarg);
+				return EINVAL;
+			}
+			break;
+		case 'v': show = 1; break;
+		case 'w': dry_run = 1; break;
+		case 'P':
+			if (parse_data_pattern(optarg, &pattern))
+				return EINVAL;
+			use_pattern = 1;
+			break;
+		case 'S':
+			get_long(optarg, &seed);
+			use_seed = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	};
+	if ((use_pattern || use_seed) && !(opcode & 1)) {
+		fprintf(stderr, "--pattern and --seed apply only to write and "
+								"compare\n");
+		return EINVAL;
+	}
+	if (use_seed && !use_pattern) {
+		fprintf(stderr, "--seed needs --pattern\n");
+		return EINVAL;
+	}
+	/* the same pattern and seed regenerate a write's data to compare */
+	if (use_seed)
+		pattern_seed(&pattern, seed);
+	get_dev(optind, argc, argv);
+
+	if (!data_size)	{
+		fprintf(stderr, "data size not provided\n");
+		return EINVAL;
+	}
+	buffer = malloc((data_size + 7) & ~7);
+	if (use_pattern)
+		fill_pattern(&pattern, buffer, (data_size + 7) & ~7);
+	else if ((opcode & 1) && read(dfd, (void *)buffer, data_size) < 0) {
+		fprintf(stderr, "failed to read buffer from input file\n");
+		return EINVAL;
+	}
+
+        io.opcode = opcode;
+	io.addr = (__u64)buffer;
+
+	if (show) {
+		printf("opcode       : %02x\n" , io.opcode);
+		printf("flags        : %02x\n" , io.flags);
+		printf("control      : %04x\n" , io.control);
+		printf("nblocks      : %04x\n" , io.nblocks);
+		printf("rsvd         : %04x\n" , io.rsvd);
+		printf("metadata     : %p\n"   , (void *)io.metadata);
+		printf("addr         : %p\n"   , (void *)io.addr);
+		printf("sbla         : %p\n"   , (void *)io.slba);
+		printf("dsmgmt       : %08x\n" , io.dsmgmt);
+		printf("reftag       : %08x\n" , io.reftag);
+		printf("apptag       : %04x\n" , io.apptag);
+		printf("appmask      : %04x\n" , io.appmask);
+		if (dry_run)
+		  goto free_and_return;
+	}
+
+	err = nvme_ioctl(fd, NVME_IOCTL_SUBMIT_IO, &io);
+	if (err < 0)
+		perror("ioctl");
+	else if (err)
+		printf("%s:%s(%04x)\n", command, nvme_status_to_string(err), err);
+	else {
+		if (!(opcode & 1) && write(dfd, (void *)buffer, data_size) < 0) {
+			fprintf(stderr, "failed to write buffer to output file\n");
+			return EINVAL;
+		} else
+			printf("%s: success\n", command);
+	}
+ free_and_return:
+	free(buffer);
+	return 0;
+}
+
+static int compare(int argc, char **argv)
+{
+	return submit_io(nvme_cmd_compare, "compare", argc, argv); 
+}
+
+static int read_cmd(int argc, char **argv)
+{
+	return submit_io(nvme_cmd_read, "read", argc, argv); 
+}
+
+static int write_cmd(int argc, char **argv)
+{
+	return submit_io(nvme_cmd_write, "write", argc, argv); 
+}
+
+static int sec_recv(int argc, char **argv)
+{
+	int err, opt, long_index = 0, raw = 0;
+	void *sec_buf = NULL;
+	unsigned int al = 0, result;
+	unsigned short spsp = 0;
+	unsigned char secp = 0;
+	unsigned int sec_size = 0;
+	static struct option opts[] = {
+		{"size", required_argument, 0, 'x'},
+		{"secp", required_argument, 0, 'p'},
+		{"spsp", required_argument, 0, 's'},
+		{"al", required_argument, 0, 'a'},
+		{"raw-binary", no_argument, 0, 'b'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "x:p:s:a:b", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'x':
+			get_int(optarg, &sec_size);
+			break;
+		case 'p':
+			get_byte(optarg, &secp);
+			break;
+		case 's':
+			get_short(optarg, &spsp);
+			break;
+		case 'a':
+			get_int(optarg, &al);
+			break;
+		case 'b':
+			raw = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	get_dev(optind, argc, argv);
+
+	if (sec_size) {
+		if (posix_memalign(&sec_buf, getpagesize(), sec_size)) {
+			fprintf(stderr, "No memory for security size:%d\n",
+								sec_size);
+			return ENOMEM;
+		}
+	}
+	if (!al)
+		al = sec_size;
+
+	err = nvme_sec(fd, nvme_admin_security_recv, secp, spsp, al, sec_buf,
+							sec_size, &result);
+	if (err < 0)
+		err = errno;
+	else if (err != 0)
+		fprintf(stderr, "NVME Security Receive Command Error:%d\n",
+									err);
+	else {
+		if (!raw) {
+			printf("NVME Security Receive Command Success:%d\n",
+								result);
+			d(sec_buf, sec_size, 16, 1);
+		} else if (sec_size)
+			d_raw((unsigned char *)sec_buf, sec_size);
+	}
+	free(sec_buf);
+	return err;
+}
+
+/*
+ * Security session: runs a scripted sequence of Security Send and Receive
+ * exchanges on each device while keeping it open, e.g. TCG discovery,
+ * authenticate and unlock. Payload files are mapped once and shared by all
+ * devices unless their name holds "{dev}", which is replaced with the
+ * device's name to select a per-device payload.
+ */
+struct sec_step {
+	int line;
+	int send;
+	__u8 secp;
+	__u16 spsp;
+	__u32 len;
+	__u32 size;
+	char *file;
+	char *out;
+	void *map;
+	size_t map_size;
+};
+
+struct sec_session {
+	struct sec_step *steps;
+	int nr_steps;
+	__u32 max_size;
+};
+
+struct sec_dev {
+	struct sec_session *s;
+	const char *path;
+	FILE *log;
+	char *log_buf;
+	size_t log_len;
+	int err;
+};
+
+static char *expand_dev(const char *tmpl, const char *path)
+{
+	const char *dev = strrchr(path, '/'), *p = strstr(tmpl, "{dev}");
+	char *ret;
+
+	dev = dev ? dev + 1 : path;
+	if (!p)
+		return strdup(tmpl);
+	if (asprintf(&ret, "%.*s%s%s", (int)(p - tmpl), tmpl, dev, p + 5) < 0)
+		return NULL;
+	return ret;
+}
+
+static int sec_parse_step(char *line, int lineno, struct sec_step *step)
+{
+	char *tok, *save = NULL, *val;
+	unsigned long v;
+
+	memset(step, 0, sizeof(*step));
+	step->line = lineno;
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
+		goto bad;
+	if (!strcmp(tok, "send"))
+		step->send = 1;
+	else if (strcmp(tok, "recv"))
+		goto bad;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		val = strchr(tok, '=');
+		if (!val)
+			goto bad;
+		*val++ = '\0';
+		if (!strcmp(tok, "file")) {
+			free(step->file);
+			step->file = strdup(val);
+			continue;
+		} else if (!strcmp(tok, "out")) {
+			free(step->out);
+			step->out = strdup(val);
+			continue;
+		}
+		v = strtoul(val, &val, 0);
+		if (*val)
+			goto bad;
+		if (!strcmp(tok, "secp"))
+			step->secp = v;
+		else if (!strcmp(tok, "spsp"))
+			step->spsp = v;
+		else if (!strcmp(tok, "tl") || !strcmp(tok, "al"))
+			step->len = v;
+		else if (!strcmp(tok, "size"))
+			step->size = v;
 		else
-			show_nvme_id_ctrl(&ctrl, vs);
+			goto bad;
+	}
+	if (step->send ? !step->file : !step->size)
+		goto bad;
+	return 0;
+ bad:
+	fprintf(stderr, "security script line %d: expected 'send secp=<n> "
+		"spsp=<n> file=<path> [tl=<n>]' or 'recv secp=<n> spsp=<n> "
+		"size=<n> [al=<n>] [out=<path>]'\n", lineno);
+	free(step->file);
+	free(step->out);
+	step->file = step->out = NULL;
+	return EINVAL;
+}
+
+static int sec_parse_script(const char *path, struct sec_session *s)
+{
+	FILE *f = fopen(path, "r");
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0, err = 0;
+
+	memset(s, 0, sizeof(*s));
+	if (!f) {
+		perror(path);
+		return errno;
+	}
+	while (getline(&line, &len, f) > 0) {
+		struct sec_step *step;
+		char *p = line + strspn(line, " \t");
+
+		lineno++;
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+		/* on failure the old array stays for sec_free_script */
+		step = realloc(s->steps, (s->nr_steps + 1) * sizeof(*step));
+		if (!step) {
+			err = ENOMEM;
+			break;
+		}
+		s->steps = step;
+		step = &s->steps[s->nr_steps];
+		err = sec_parse_step(p, lineno, step);
+		if (err)
+			break;
+		s->nr_steps++;
+		if (step->size > s->max_size)
+			s->max_size = step->size;
+		if (step->send && !strstr(step->file, "{dev}")) {
+			err = map_file(step->file, &step->map, &step->map_size);
+			if (err)
+				break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return err;
+}
+
+static void sec_free_script(struct sec_session *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_steps; i++) {
+		if (s->steps[i].map)
+			munmap(s->steps[i].map, s->steps[i].map_size);
+		free(s->steps[i].file);
+		free(s->steps[i].out);
+	}
+	free(s->steps);
+}
+
+/* returns the NVMe status of the exchange, or a negative errno */
+static int sec_step_send(int fd, struct sec_dev *sd, struct sec_step *step,
+							__u32 *result)
+{
+	void *map = step->map;
+	size_t size = step->map_size;
+	char *file;
+	int err;
+
+	if (strstr(step->file, "{dev}")) {
+		file = expand_dev(step->file, sd->path);
+		if (!file)
+			return -ENOMEM;
+		err = map_file(file, &map, &size);
+		free(file);
+		if (err)
+			return -err;
+	}
+	err = nvme_sec(fd, nvme_admin_security_send, step->secp, step->spsp,
+			step->len ? step->len : size, map, size, result);
+	if (err < 0)
+		err = -errno;
+	if (map != step->map && map)
+		munmap(map, size);
+	return err;
+}
+
+static int sec_step_recv(int fd, struct sec_dev *sd, struct sec_step *step,
+						void *buf, __u32 *result)
+{
+	char *out;
+	FILE *f;
+	int err;
+
+	err = nvme_sec(fd, nvme_admin_security_recv, step->secp, step->spsp,
+			step->len ? step->len : step->size, buf, step->size,
+			result);
+	if (err < 0)
+		return -errno;
+	if (err || !step->out)
+		return err;
+
+	out = expand_dev(step->out, sd->path);
+	if (!out)
+		return -ENOMEM;
+	f = fopen(out, "w");
+	if (!f || fwrite(buf, step->size, 1, f) != 1)
+		err = -errno;
+	if (f && fclose(f) && !err)
+		err = -errno;
+	free(out);
+	return err;
+}
+
+static int sec_run_script(int fd, void *ctx)
+{
+	struct sec_dev *sd = ctx;
+	struct sec_session *s = sd->s;
+	void *buf = NULL;
+	__u32 result;
+	int i, err;
+
+	if (s->max_size && posix_memalign(&buf, getpagesize(), s->max_size))
+		return -ENOMEM;
+
+	for (i = 0; i < s->nr_steps; i++) {
+		struct sec_step *step = &s->steps[i];
+
+		result = 0;
+		if (step->send)
+			err = sec_step_send(fd, sd, step, &result);
+		else
+			err = sec_step_recv(fd, sd, step, buf, &result);
+
+		fprintf(sd->log, "line %d: %s secp:%#x spsp:%#x ", step->line,
+				step->send ? "send" : "recv", step->secp,
+				step->spsp);
+		if (err < 0) {
+			fprintf(sd->log, "%s\n", strerror(-err));
+			sd->err = -err;
+			break;
+		} else if (err) {
+			fprintf(sd->log, "NVMe Status:%s(%x)\n",
+					nvme_status_to_string(err), err);
+			sd->err = err;
+			break;
+		}
+		fprintf(sd->log, "result:%#x\n", result);
+		if (!step->send && !step->out)
+			d_file(sd->log, buf, step->size, 16, 1);
+	}
+	free(buf);
+	return 0;
+}
+
+static const struct pipe_stage sec_session_stages[] = {
+	{ "security script", sec_run_script },
+};
+
+static void sec_session_done(struct pipe_dev *dev)
+{
+	struct sec_dev *sd = dev->ctx;
+
+	fflush(sd->log);
+	printf("%s:\n", dev->path);
+	if (dev->err)
+		printf("%s\n", strerror(dev->err));
+	fwrite(sd->log_buf, 1, sd->log_len, stdout);
+	fflush(stdout);
+}
+
+static int sec_session(int argc, char **argv)
+{
+	int opt, err, i, nr, failed = 0, long_index = 0;
+	unsigned int jobs = 0;
+	char *script = NULL;
+	struct sec_session s;
+	struct sec_dev *sds;
+	struct pipe_dev *pdevs;
+	static struct option opts[] = {
+		{"script", required_argument, 0, 'f'},
+		{"jobs", required_argument, 0, 'j'},
+		{ 0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, (char **)argv, "f:j:", opts,
+							&long_index)) != -1) {
+		switch(opt) {
+		case 'f':
+			script = optarg;
+			break;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+	if (!script) {
+		fprintf(stderr, "no security script provided\n");
+		return EINVAL;
+	}
+	if (optind >= argc) {
+		errno = EINVAL;
+		perror(argv[0]);
+		return errno;
+	}
+	err = sec_parse_script(script, &s);
+	if (err)
+		goto free_script;
+
+	nr = argc - optind;
+	sds = calloc(nr, sizeof(*sds));
+	pdevs = calloc(nr, sizeof(*pdevs));
+	if (!sds || !pdevs) {
+		err = ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < nr; i++) {
+		sds[i].s = &s;
+		sds[i].path = argv[optind + i];
+		sds[i].log = open_memstream(&sds[i].log_buf, &sds[i].log_len);
+		if (!sds[i].log) {
+			err = ENOMEM;
+			goto free;
+		}
+		pdevs[i].path = sds[i].path;
+		pdevs[i].ctx = &sds[i];
+	}
+	err = run_pipeline(pdevs, nr, sec_session_stages,
+			ARRAY_SIZE(sec_session_stages), jobs, sec_session_done);
+	for (i = 0; i < nr; i++)
+		if (pdevs[i].err || sds[i].err)
+			failed++;
+	if (!err && failed) {
+		fprintf(stderr, "security script failed on %d of %d devices\n",
+								failed, nr);
+		err = EIO;
+	}
+ free:
+	for (i = 0; sds && i < nr; i++) {
+		if (sds[i].log)
+			fclose(sds[i].log);
+		free(sds[i].log_buf);
+	}
+	free(sds);
+	free(pdevs);
+ free_script:
+	sec_free_script(&s);
+	return err;
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int nvme_io(int fd, __u8 opcode, __u32 nsid, __u64 slba, __u32 nlb,
+					__u16 control, void *buf, __u32 len)
+{
+	struct nvme_passthru_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = opcode;
+	cmd.nsid = nsid;
+	cmd.addr = (unsigned long)buf;
+	cmd.data_len = len;
+	cmd.cdw10 = slba;
+	cmd.cdw11 = slba >> 32;
+	cmd.cdw12 = (nlb - 1) | control << 16;
+	return nvme_ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
+}
+
+/*
+ * Resolves the namespace to work on like id-ns does, and returns its size
+ * in blocks and block size shift from Identify Namespace.
+ */
+static int ns_geometry(__u32 *nsid, __u64 *nsze, int *lba_shift)
+{
+	struct nvme_id_ns ns;
+	int err;
+
+	if (!*nsid) {
+		if (!S_ISBLK(nvme_stat.st_mode)) {
+			fprintf(stderr,
+				"%s: non-block device requires namespace-id param\n",
+				devicename);
+			return ENOTBLK;
+		}
+		err = nvme_ioctl(fd, NVME_IOCTL_ID, NULL);
+		if (err <= 0) {
+			perror(devicename);
+			return errno;
+		}
+		*nsid = err;
+	}
+	err = identify(fd, *nsid, &ns, 0);
+	if (err) {
+		if (err > 0)
+			fprintf(stderr, "identify namespace: %s\n",
+						nvme_status_to_string(err));
+		else
+			perror("identify namespace");
+		return err > 0 ? err : errno;
+	}
+	*nsze = le64toh(ns.nsze);
+	*lba_shift = ns.lbaf[ns.flbas & 0xf].ds;
+	return 0;
+}
+
+/*
+ * Log-linear latency histogram: 16 buckets per power of two, so any
+ * percentile is within about 6% of the true value while adding a sample
+ * stays a few instructions.
+ */
+#define LAT_SUB_BITS	4
+#define LAT_BUCKETS	(61 << LAT_SUB_BITS)
+
+struct lat_hist {
+	__u64 count;
+	__u64 sum;
+	__u64 max;
+	__u64 bucket[LAT_BUCKETS];
+};
+
+static unsigned int lat_bucket(__u64 v)
+{
+	int msb;
+
+	if (v < (1 << LAT_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS |
+		((v >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+static __u64 lat_bucket_low(unsigned int b)
+{
+	unsigned int shift = b >> LAT_SUB_BITS;
+
+	if (!shift)
+		return b;
+	return (__u64)(1 << LAT_SUB_BITS | (b & ((1 << LAT_SUB_BITS) - 1)))
+								<< (shift - 1);
+}
+
+static void lat_add(struct lat_hist *h, __u64 v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[lat_bucket(v)]++;
+}
+
+static void lat_merge(struct lat_hist *to, const struct lat_hist *from)
+{
+	int i;
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
+}
+
+/* The value below which pct percent of the samples fall, mid-bucket. */
+static __u64 lat_pct(const struct lat_hist *h, double pct)
+{
+	__u64 want = ceil(h->count * pct / 100), seen = 0, lo, hi;
+	int i;
+
+	if (!h->count)
+		return 0;
+	if (!want)
+		want = 1;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	lo = lat_bucket_low(i);
+	hi = i + 1 < LAT_BUCKETS ? lat_bucket_low(i + 1) : lo;
+	lo += (hi - lo) / 2;
+	return lo < h->max ? lo : h->max;
+}
+
+static __u64 xorshift64(__u64 *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/*
+ * Per-I/O latency log. After a header come chunks, each a varint thread
+ * number and byte count followed by that thread's records:
+ *
+ *	varint	submit time, ns after the previous record of the thread
+ *	byte	opcode
+ *	varint	zigzag of slba minus the end of the previous I/O
+ *	varint	number of blocks
+ *	varint	latency in ns
+ *	varint	status
+ *
+ * so a sequential stream of successful I/O costs around ten bytes each.
+ * Threads fill private buffers that a background writer drains, keeping
+ * file I/O out of the workload.
+ */
+#define LATLOG_MAGIC	"NVMELAT1"
+#define LATLOG_BUF	(64 << 10)
+#define LATLOG_REC_MAX	(1 + 5 * 10)
+
+struct latlog_header {
+	char magic[8];
+	__le32 version;
+	__le32 rsvd;
+	__le64 start;		/* CLOCK_REALTIME ns of time 0 */
+};
+
+struct latlog_buf {
+	struct latlog_buf *next;
+	unsigned int thread;
+	unsigned int len;
+	__u8 data[LATLOG_BUF];
+};
+
+struct latlog {
+	FILE *f;
+	__u64 start;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct latlog_buf *full, **full_tail, *free;
+	int stop;
+	int err;
+};
+
+struct latlog_thread {
+	struct latlog *log;
+	struct latlog_buf *buf;
+	__u64 prev_time;
+	__u64 prev_end;
+};
+
+static __u8 *put_varint(__u8 *p, __u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const __u8 *get_varint(const __u8 *p, const __u8 *end, __u64 *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (__u64)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*
+ * Returns 0 for a varint, 1 at a clean end of file and -1 for an error,
+ * an overlong varint or a file ending part way through one.
+ */
+static int fget_varint(FILE *f, __u64 *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	while ((c = getc(f)) != EOF && shift < 64) {
+		*v |= (__u64)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return c == EOF && !shift && !ferror(f) ? 1 : -1;
+}
+
+static void *latlog_writer(void *arg)
+{
+	struct latlog *log = arg;
+	struct latlog_buf *b;
+	__u8 hdr[20], *p;
+
+	pthread_mutex_lock(&log->lock);
+	for (;;) {
+		while (!log->full && !log->stop)
+			pthread_cond_wait(&log->cond, &log->lock);
+		b = log->full;
+		if (!b)
+			break;
+		log->full = b->next;
+		if (!log->full)
+			log->full_tail = &log->full;
+		pthread_mutex_unlock(&log->lock);
+
+		p = put_varint(hdr, b->thread);
+		p = put_varint(p, b->len);
+		if (fwrite(hdr, p - hdr, 1, log->f) != 1 ||
+				fwrite(b->data, b->len, 1, log->f) != 1)
+			log->err = errno;
+
+		pthread_mutex_lock(&log->lock);
+		b->next = log->free;
+		log->free = b;
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+/*
+ * Hands the thread's buffer to the writer and, unless the thread is done
+ * logging, takes an empty one.
+ */
+static int latlog_flush(struct latlog_thread *lt, unsigned int thread,
+								int more)
+{
+	struct latlog *log = lt->log;
+	struct latlog_buf *b = lt->buf;
+
+	pthread_mutex_lock(&log->lock);
+	if (b && b->len) {
+		b->next = NULL;
+		*log->full_tail = b;
+		log->full_tail = &b->next;
+		pthread_cond_signal(&log->cond);
+		b = NULL;
+	}
+	if (!b && more) {
+		b = log->free;
+		if (b)
+			log->free = b->next;
+	}
+	pthread_mutex_unlock(&log->lock);
+	if (!more) {
+		free(b);
+		lt->buf = NULL;
+		return 0;
+	}
+	if (!b)
+		b = malloc(sizeof(*b));
+	lt->buf = b;
+	if (!b)
+		return -1;
+	b->thread = thread;
+	b->len = 0;
+	return 0;
+}
+
+static void latlog_add(struct latlog_thread *lt, __u64 time, __u8 opcode,
+		__u64 slba, __u32 nlb, __u64 lat, __u32 status)
+{
+	struct latlog_buf *b = lt->buf;
+	__s64 delta = slba - lt->prev_end;
+	__u8 *p;
+
+	if (!b)
+		return;
+	if (b->len + LATLOG_REC_MAX > LATLOG_BUF) {
+		if (latlog_flush(lt, b->thread, 1))
+			return;
+		b = lt->buf;
+	}
+	time -= lt->log->start;
+	p = put_varint(b->data + b->len, time - lt->prev_time);
+	*p++ = opcode;
+	p = put_varint(p, (__u64)(delta << 1) ^ (__u64)(delta >> 63));
+	p = put_varint(p, nlb);
+	p = put_varint(p, lat);
+	p = put_varint(p, status);
+	b->len = p - b->data;
+	lt->prev_time = time;
+	lt->prev_end = slba + nlb;
+}
+
+static int latlog_open(struct latlog *log, const char *path)
+{
+	struct latlog_header hdr;
+	struct timespec ts;
+	int err;
+
+	memset(log, 0, sizeof(*log));
+	log->f = fopen(path, "w");
+	if (!log->f) {
+		perror(path);
+		return errno;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LATLOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(1);
+	hdr.start = htole64((__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	log->start = now_ns();
+	if (fwrite(&hdr, sizeof(hdr), 1, log->f) != 1) {
+		perror(path);
+		fclose(log->f);
+		return EIO;
+	}
+	log->full_tail = &log->full;
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	err = pthread_create(&log->writer, NULL, latlog_writer, log);
+	if (err) {
+		fclose(log->f);
+		return err;
+	}
+	return 0;
+}
+
+static int latlog_close(struct latlog *log)
+{
+	struct latlog_buf *b;
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	log->stop = 1;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->writer, NULL);
+	while ((b = log->free)) {
+		log->free = b->next;
+		free(b);
+	}
+	err = log->err;
+	if (fclose(log->f) && !err)
+		err = errno;
+	if (err)
+		fprintf(stderr, "writing latency log: %s\n", strerror(err));
+	return err;
+}
+
+/*
+ * Admin versus I/O interference: the same foreground workload is run
+ * twice, alone and then while another thread polls admin commands at the
+ * requested rates, and the latency distributions of both are compared.
+ */
+enum {
+	ADMIN_IDENTIFY,
+	ADMIN_GET_LOG,
+	ADMIN_GET_FEATURES,
+	NR_ADMIN_POLLS,
+};
+
+static const char *admin_poll_names[NR_ADMIN_POLLS] = {
+	[ADMIN_IDENTIFY] = "identify",
+	[ADMIN_GET_LOG] = "get-log-page",
+	[ADMIN_GET_FEATURES] = "get-features",
+};
+
+struct interference {
+	__u32 nsid;
+	__u8 opcode;
+	int random;
+	__u32 nlb;
+	int lba_shift;
+	__u64 nr_lbas;
+	unsigned int rate[NR_ADMIN_POLLS];
+	struct data_pattern pattern;
+	struct latlog *log;
+	volatile int stop;
+	struct lat_hist admin[NR_ADMIN_POLLS];
+};
+
+struct interference_job {
+	struct interference *ifr;
+	pthread_t thread;
+	unsigned int id;
+	__u64 seed;
+	__u64 errors;
+	struct data_pattern pattern;
+	struct lat_hist lat;
+	struct latlog_thread lt;
+};
+
+static void *interference_io(void *arg)
+{
+	struct interference_job *job = arg;
+	struct interference *ifr = job->ifr;
+	__u32 len = ifr->nlb << ifr->lba_shift;
+	__u64 slots = ifr->nr_lbas / ifr->nlb, slot = job->seed % slots;
+	__u64 start, lat;
+	void *buf;
+	int err;
+
+	if (posix_memalign(&buf, getpagesize(), len))
+		return NULL;
+	memset(buf, 0, len);
+	job->pattern = ifr->pattern;
+	pattern_seed(&job->pattern, job->seed);
+	job->lt.log = ifr->log;
+	if (ifr->log)
+		latlog_flush(&job->lt, job->id, 1);
+	while (!ifr->stop) {
+		slot = ifr->random ? xorshift64(&job->seed) % slots :
+							(slot + 1) % slots;
+		if (ifr->opcode == nvme_cmd_write)
+			fill_pattern(&job->pattern, buf, len);
+		start = now_ns();
+		err = nvme_io(fd, ifr->opcode, ifr->nsid, slot * ifr->nlb,
+						ifr->nlb, 0, buf, len);
+		lat = now_ns() - start;
+		if (err)
+			job->errors++;
+		lat_add(&job->lat, lat);
+		latlog_add(&job->lt, start, ifr->opcode, slot * ifr->nlb,
+				ifr->nlb, lat, err < 0 ? 0xffff : err);
 	}
-	else if (err > 0)
-		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
+	if (ifr->log)
+		latlog_flush(&job->lt, job->id, 0);
+	free(buf);
+	return NULL;
+}
 
-	return err;
+static void *interference_admin(void *arg)
+{
+	struct interference *ifr = arg;
+	__u64 next[NR_ADMIN_POLLS], period[NR_ADMIN_POLLS], now, start;
+	struct timespec ts;
+	__u8 buf[4096];
+	__u32 result;
+	int i, due;
+
+	now = now_ns();
+	for (i = 0; i < NR_ADMIN_POLLS; i++) {
+		period[i] = ifr->rate[i] ? 1000000000ULL / ifr->rate[i] : 0;
+		next[i] = now + period[i];
+	}
+	while (!ifr->stop) {
+		due = -1;
+		for (i = 0; i < NR_ADMIN_POLLS; i++)
+			if (period[i] && (due < 0 || next[i] < next[due]))
+				due = i;
+		now = now_ns();
+		if (next[due] > now) {
+			ts.tv_sec = (next[due] - now) / 1000000000ULL;
+			ts.tv_nsec = (next[due] - now) % 1000000000ULL;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		start = now_ns();
+		switch (due) {
+		case ADMIN_IDENTIFY:
+			identify(fd, 0, buf, 1);
+			break;
+		case ADMIN_GET_LOG:
+			nvme_get_log(fd, buf, sizeof(struct nvme_smart_log),
+				0x2 | (((sizeof(struct nvme_smart_log) / 4) - 1)
+						<< 16), 0xffffffff);
+			break;
+		case ADMIN_GET_FEATURES:
+			nvme_feature(fd, nvme_admin_get_features, NULL, 0,
+				NVME_FEAT_TEMP_THRESH, 0, 0, &result);
+			break;
+		}
+		lat_add(&ifr->admin[due], now_ns() - start);
+		next[due] += period[due];
+	}
+	return NULL;
 }
 
-static int id_ns(int argc, char **argv)
+static void show_lat_row(const char *name, const struct lat_hist *h,
+							double secs)
 {
-	struct nvme_id_ns ns;
-	int opt, err, long_index = 0;
-	unsigned int nsid = 0, vs = 0, raw = 0;
+	printf("%-14s %10.0f %9.1f %9.1f %9.1f %9.1f\n", name,
+		h->count / secs, lat_pct(h, 50) / 1e3, lat_pct(h, 99) / 1e3,
+		lat_pct(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static int interference_phase(struct interference *ifr, int jobs,
+		unsigned int secs, int with_admin, struct lat_hist *lat)
+{
+	struct interference_job *job;
+	pthread_t admin;
+	__u64 errors = 0;
+	int i, err = 0;
+
+	job = calloc(jobs, sizeof(*job));
+	if (!job)
+		return ENOMEM;
+	ifr->stop = 0;
+	for (i = 0; i < jobs && !err; i++) {
+		job[i].ifr = ifr;
+		job[i].id = with_admin * jobs + i;
+		job[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		err = pthread_create(&job[i].thread, NULL, interference_io,
+								&job[i]);
+	}
+	jobs = i - !!err;
+	if (!err && with_admin)
+		err = pthread_create(&admin, NULL, interference_admin, ifr);
+	if (!err)
+		sleep(secs);
+	ifr->stop = 1;
+	if (!err && with_admin)
+		pthread_join(admin, NULL);
+	for (i = 0; i < jobs; i++) {
+		pthread_join(job[i].thread, NULL);
+		lat_merge(lat, &job[i].lat);
+		errors += job[i].errors;
+	}
+	free(job);
+	if (err) {
+		fprintf(stderr, "failed to start workers: %s\n", strerror(err));
+		return err;
+	}
+	if (errors)
+		fprintf(stderr, "%llu I/O commands failed\n",
+					(unsigned long long)errors);
+	return 0;
+}
 
+static int interference(int argc, char **argv)
+{
+	struct interference ifr;
+	struct lat_hist *base, *loaded;
+	unsigned int secs = 10, jobs = 1, bs = 4096;
+	int opt, long_index, err, i;
+	char *rw = "randread", *lat_log_path = NULL;
+	struct latlog log;
+	__u64 nsze = 0;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"vendor-specific", no_argument, 0, 'v'},
-		{"raw-binary", no_argument, 0, 'b'},
+		{"time", required_argument, 0, 't'},
+		{"jobs", required_argument, 0, 'j'},
+		{"block-size", required_argument, 0, 's'},
+		{"rw", required_argument, 0, 'r'},
+		{"identify-rate", required_argument, 0, 'I'},
+		{"log-rate", required_argument, 0, 'L'},
+		{"feature-rate", required_argument, 0, 'F'},
+		{"lat-log", required_argument, 0, 'l'},
+		{"pattern", required_argument, 0, 'P'},
 		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:vb", opts,
-							&long_index)) != -1) {
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.rate[ADMIN_GET_LOG] = 10;
+	parse_data_pattern("random", &ifr.pattern);
+	while ((opt = getopt_long(argc, (char **)argv, "n:t:j:s:r:I:L:F:l:P:",
+						opts, &long_index)) != -1) {
 		switch (opt) {
 		case 'n':
-			get_int(optarg, &nsid);
+			get_int(optarg, &ifr.nsid);
 			break;
-		case 'v':
-			vs = 1;
+		case 't':
+			get_int(optarg, &secs);
 			break;
-		case 'b':
-			raw = 1;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		case 's':
+			get_int(optarg, &bs);
+			break;
+		case 'r':
+			rw = optarg;
+			break;
+		case 'I':
+			get_int(optarg, &ifr.rate[ADMIN_IDENTIFY]);
+			break;
+		case 'L':
+			get_int(optarg, &ifr.rate[ADMIN_GET_LOG]);
+			break;
+		case 'F':
+			get_int(optarg, &ifr.rate[ADMIN_GET_FEATURES]);
+			break;
+		case 'l':
+			lat_log_path = optarg;
+			break;
+		case 'P':
+			if (parse_data_pattern(optarg, &ifr.pattern))
+				return EINVAL;
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!strcmp(rw, "read") || !strcmp(rw, "randread"))
+		ifr.opcode = nvme_cmd_read;
+	else if (!strcmp(rw, "write") || !strcmp(rw, "randwrite"))
+		ifr.opcode = nvme_cmd_write;
+	else {
+		fprintf(stderr, "unknown --rw pattern: %s\n", rw);
+		return EINVAL;
+	}
+	ifr.random = !strncmp(rw, "rand", 4);
+	if (!ifr.rate[ADMIN_IDENTIFY] && !ifr.rate[ADMIN_GET_LOG] &&
+					!ifr.rate[ADMIN_GET_FEATURES]) {
+		fprintf(stderr, "no admin command rate given\n");
+		return EINVAL;
+	}
+	if (!jobs || !secs) {
+		fprintf(stderr, "jobs and time must be non-zero\n");
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
-	if (!nsid) {
-		if (!S_ISBLK(nvme_stat.st_mode)) {
-			fprintf(stderr,
-				"%s: non-block device requires namespace-id param\n",
-				devicename);
-			exit(ENOTBLK);
-		}
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			perror(devicename);
-			exit(errno);
-		}
+
+	err = ns_geometry(&ifr.nsid, &nsze, &ifr.lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << ifr.lba_shift) || bs >> ifr.lba_shift > 65536 ||
+				bs >> ifr.lba_shift > nsze) {
+		fprintf(stderr, "block size must be a multiple of %d\n",
+							1 << ifr.lba_shift);
+		return EINVAL;
 	}
-	err = identify(nsid, &ns, 0);
-	if (!err) {
-		if (raw)
-			d_raw((unsigned char *)&ns, sizeof(ns));
-		else
-			show_nvme_id_ns(&ns, nsid, vs);
+	ifr.nlb = bs >> ifr.lba_shift;
+	ifr.nr_lbas = nsze;
+
+	base = calloc(1, sizeof(*base));
+	loaded = calloc(1, sizeof(*loaded));
+	if (!base || !loaded) {
+		err = ENOMEM;
+		goto free;
 	}
-	else if (err > 0)
-		fprintf(stderr, "NVMe Status: %s NSID:%d\n", nvme_status_to_string(err), nsid);
+	if (lat_log_path) {
+		err = latlog_open(&log, lat_log_path);
+		if (err)
+			goto free;
+		ifr.log = &log;
+	}
+	err = interference_phase(&ifr, jobs, secs, 0, base);
+	if (!err)
+		err = interference_phase(&ifr, jobs, secs, 1, loaded);
+	if (lat_log_path && latlog_close(&log) && !err)
+		err = EIO;
+	if (err)
+		goto free;
+
+	printf("%-14s %10s %9s %9s %9s %9s\n", "foreground", "iops",
+				"p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+	show_lat_row("alone", base, secs);
+	show_lat_row("with admin", loaded, secs);
+	printf("%-14s %+9.1f%% %+8.1f%% %+8.1f%% %+8.1f%%\n", "shift",
+		base->count ? (loaded->count * 100.0 / base->count) - 100 : 0,
+		lat_pct(base, 50) ?
+			lat_pct(loaded, 50) * 100.0 / lat_pct(base, 50) - 100 : 0,
+		lat_pct(base, 99) ?
+			lat_pct(loaded, 99) * 100.0 / lat_pct(base, 99) - 100 : 0,
+		lat_pct(base, 99.9) ?
+			lat_pct(loaded, 99.9) * 100.0 / lat_pct(base, 99.9) - 100 : 0);
+
+	printf("\n%-14s %10s %9s %9s %9s %9s\n", "admin", "per sec",
+				"p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+	for (i = 0; i < NR_ADMIN_POLLS; i++)
+		if (ifr.rate[i])
+			show_lat_row(admin_poll_names[i], &ifr.admin[i], secs);
+ free:
+	free(base);
+	free(loaded);
 	return err;
 }
 
-static int get_ns_id(int argc, char **argv)
+static const char *io_opcode_name(__u8 opcode)
 {
-	int nsid;
-
-	open_dev(argv[1]);
-	if (!S_ISBLK(nvme_stat.st_mode)) {
-		fprintf(stderr, "%s: requesting nsid from non-block device\n",
-								devicename);
-		exit(ENOTBLK);
-	}
-	nsid = ioctl(fd, NVME_IOCTL_ID);
-	if (nsid <= 0) {
-		perror(devicename);
-		exit(errno);
+	switch (opcode) {
+	case nvme_cmd_flush:		return "flush";
+	case nvme_cmd_write:		return "write";
+	case nvme_cmd_read:		return "read";
+	case nvme_cmd_write_uncor:	return "write-uncor";
+	case nvme_cmd_compare:		return "compare";
+	case nvme_cmd_write_zeroes:	return "write-zeroes";
+	case nvme_cmd_dsm:		return "dsm";
+	default:			return NULL;
 	}
-	printf("%s: namespace-id:%d\n", devicename, nsid);
-	return 0;
 }
 
-static int nvme_feature(int opcode, void *buf, int data_len, __u32 fid,
-					__u32 nsid, __u32 cdw11, __u32 *result)
+static void show_lat_hist(__u8 opcode, const struct lat_hist *h)
 {
-	int err;
-	struct nvme_admin_cmd cmd;
-
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.opcode = opcode;
-	cmd.nsid = nsid;
-	cmd.cdw10 = fid;
-	cmd.cdw11 = cdw11;
-	cmd.addr = (__u64)buf;
-	cmd.data_len = data_len;
+	const char *name = io_opcode_name(opcode);
+	__u64 seen = 0;
+	int i;
 
-	err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-	if (err >= 0 && result)
-			*result = cmd.result;
-	return err;
+	if (name)
+		printf("%s:", name);
+	else
+		printf("opcode %#04x:", opcode);
+	printf(" %llu I/Os, mean %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f usec\n",
+		(unsigned long long)h->count, h->sum / 1e3 / h->count,
+		lat_pct(h, 50) / 1e3, lat_pct(h, 99) / 1e3,
+		lat_pct(h, 99.9) / 1e3, h->max / 1e3);
+	printf("%12s %12s %12s %11s\n", "low(us)", "high(us)", "count",
+								"cumulative");
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		seen += h->bucket[i];
+		printf("%12.3f %12.3f %12llu %10.4f%%\n",
+			lat_bucket_low(i) / 1e3,
+			(i + 1 < LAT_BUCKETS ? lat_bucket_low(i + 1) :
+						lat_bucket_low(i)) / 1e3,
+			(unsigned long long)h->bucket[i],
+			seen * 100.0 / h->count);
+	}
+	printf("\n");
 }
 
-static int get_feature(int argc, char **argv)
+static int lat_log(int argc, char **argv)
 {
-	int opt, err, long_index = 0;
-	unsigned int f, result, raw = 0, cdw10, cdw11 = 0, nsid = 0, data_len = 0;
-	unsigned char sel = 0;
-	void *buf = NULL;
+	struct latlog_header hdr;
+	struct latlog_thread *threads = NULL;
+	struct lat_hist *hist[256];
+	int opt, long_index, histogram = 0, err = 0, ret, i;
+	__u64 thread, len, nr_threads = 0, dt, zz, nlb, lat, status;
+	const __u8 *p, *end;
+	__u8 *buf = NULL;
+	FILE *f;
 	static struct option opts[] = {
-		{"namespace-id", required_argument, 0, 'n'},
-		{"feature-id", required_argument, 0, 'f'},
-		{"sel", required_argument, 0, 's'},
-		{"cdw11", required_argument, 0, 0},
-		{"data-len", required_argument, 0, 'l'},
-		{"raw-binary", no_argument, 0, 'b'},
+		{"histogram", no_argument, 0, 'H'},
 		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:f:l:s:b", opts,
-							&long_index)) != -1) {
+	while ((opt = getopt_long(argc, (char **)argv, "H", opts,
+						&long_index)) != -1) {
 		switch (opt) {
-		case 0:
-			get_int(optarg, &cdw11);
-			break;
-		case 'n':
-			get_int(optarg, &nsid);
-			break;
-		case 'f':
-			get_int(optarg, &f);
-			break;
-		case 'l':
-			get_int(optarg, &data_len);
-			break;
-		case 's':
-			get_byte(optarg, &sel);
-			break;
-		case 'b':
-			raw = 1;
+		case 'H':
+			histogram = 1;
 			break;
 		default:
 			return EINVAL;
 		}
 	}
-	get_dev(optind, argc, argv);
-	if (sel > 7) {
-		fprintf(stderr, "invalid 'select' param:%d\n", sel);
+	if (optind >= argc) {
+		fprintf(stderr, "latency log file required param\n");
 		return EINVAL;
 	}
+	f = fopen(argv[optind], "r");
 	if (!f) {
-		fprintf(stderr, "feature-id required param\n");
+		perror(argv[optind]);
+		return errno;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, LATLOG_MAGIC, sizeof(hdr.magic)) ||
+			le32toh(hdr.version) != 1) {
+		fprintf(stderr, "%s is not a latency log\n", argv[optind]);
+		fclose(f);
 		return EINVAL;
 	}
-	if (f == NVME_FEAT_LBA_RANGE)
-		data_len = 4096;
-	if (data_len)
-		buf = malloc(data_len);
+	memset(hist, 0, sizeof(hist));
+	buf = malloc(LATLOG_BUF);
+	if (!buf) {
+		err = ENOMEM;
+		goto close;
+	}
 
-	cdw10 = sel << 8 | f;
-	err = nvme_feature(nvme_admin_get_features, buf, data_len, cdw10, nsid,
-							cdw11, &result);
-	if (!err) {
-		printf("get-feature:%d(%s), value:%#08x\n", f,
-			nvme_feature_to_string(f), result);
-		if (buf) {
-			if (!raw) {
-				if (f == NVME_FEAT_LBA_RANGE)
-					show_lba_range((struct nvme_lba_range_type *)buf,
-									result);
-				else
-					d(buf, data_len, 16, 1);
+	if (!histogram)
+		printf("time_ns,thread,opcode,slba,blocks,latency_ns,status\n");
+	while (!(ret = fget_varint(f, &thread))) {
+		struct latlog_thread *lt;
+
+		if (fget_varint(f, &len) || len > LATLOG_BUF || thread > 65535 ||
+				fread(buf, 1, len, f) != len)
+			goto corrupt;
+		if (thread >= nr_threads) {
+			lt = realloc(threads, (thread + 1) * sizeof(*lt));
+			if (!lt) {
+				err = ENOMEM;
+				goto close;
+			}
+			memset(lt + nr_threads, 0,
+				(thread + 1 - nr_threads) * sizeof(*lt));
+			threads = lt;
+			nr_threads = thread + 1;
+		}
+		lt = &threads[thread];
+
+		for (p = buf, end = buf + len; p < end; ) {
+			__u8 opcode;
+			__u64 slba;
+
+			p = get_varint(p, end, &dt);
+			if (!p || p == end)
+				goto corrupt;
+			opcode = *p++;
+			if (!(p = get_varint(p, end, &zz)) ||
+			    !(p = get_varint(p, end, &nlb)) ||
+			    !(p = get_varint(p, end, &lat)) ||
+			    !(p = get_varint(p, end, &status)))
+				goto corrupt;
+			slba = lt->prev_end + ((zz >> 1) ^ -(zz & 1));
+			lt->prev_time += dt;
+			lt->prev_end = slba + nlb;
+
+			if (histogram) {
+				if (!hist[opcode])
+					hist[opcode] = calloc(1, sizeof(*hist[0]));
+				if (!hist[opcode]) {
+					err = ENOMEM;
+					goto close;
+				}
+				lat_add(hist[opcode], lat);
+				continue;
 			}
+			printf("%llu,%llu,", (unsigned long long)lt->prev_time,
+						(unsigned long long)thread);
+			if (io_opcode_name(opcode))
+				printf("%s", io_opcode_name(opcode));
 			else
-				d_raw(buf, data_len);
+				printf("%#04x", opcode);
+			printf(",%llu,%llu,%llu,%#llx\n",
+				(unsigned long long)slba,
+				(unsigned long long)nlb,
+				(unsigned long long)lat,
+				(unsigned long long)status);
 		}
 	}
-	else if (err > 0)
-		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
-	if (buf)
-		free(buf);
+	if (ret < 0)
+		goto corrupt;
+	for (i = 0; i < 256; i++)
+		if (hist[i])
+			show_lat_hist(i, hist[i]);
+	goto close;
+ corrupt:
+	fprintf(stderr, "%s: truncated or corrupt record\n", argv[optind]);
+	err = EINVAL;
+ close:
+	for (i = 0; i < 256; i++)
+		free(hist[i]);
+	free(threads);
+	free(buf);
+	fclose(f);
 	return err;
 }
 
-#define min(x, y) x > y ? y : x;
-static int fw_download(int argc, char **argv)
+/*
+ * Endurance run: writes at a steady drive-writes-per-day rate for as long
+ * as asked, sampling the SMART wear indicators as it goes. Progress is
+ * checkpointed to a small file, so a run killed by a reboot or signal
+ * picks up where it stopped when restarted with the same file.
+ */
+#define ENDURANCE_MAGIC		"NVMEEND1"
+
+struct endurance_ckpt {
+	char magic[8];
+	__le32 version;
+	__le32 rsvd;
+	__le64 elapsed;		/* ns of run time so far */
+	__le64 written;		/* host bytes written */
+	__le64 read;		/* host bytes read */
+	__le64 seq_lba;		/* next sequential write */
+	__le64 seed;
+};
+
+enum {
+	END_SEQ_WRITE,
+	END_RAND_WRITE,
+	END_RAND_READ,
+	NR_END_OPS,
+};
+
+static const char *endurance_op_names[NR_END_OPS] = {
+	[END_SEQ_WRITE]		= "seqwrite",
+	[END_RAND_WRITE]	= "randwrite",
+	[END_RAND_READ]		= "randread",
+};
+
+static volatile sig_atomic_t endurance_stop;
+
+static void endurance_signal(int sig)
 {
-	int opt, err, long_index = 0, fw_fd = -1;
-	unsigned int fw_size, xfer_size = 4096, offset = 0;
-	struct stat sb;
-	struct nvme_admin_cmd cmd;
-	void *fw_buf;
+	endurance_stop = 1;
+}
+
+/* Parses "kind:weight[:bytes],..." into per kind weights and sizes. */
+static int parse_endurance_mix(char *mix, __u32 *weight, __u32 *bs)
+{
+	char *item, *save, *name, *w, *size;
+	int i;
+
+	memset(weight, 0, NR_END_OPS * sizeof(*weight));
+	for (item = strtok_r(mix, ",", &save); item;
+					item = strtok_r(NULL, ",", &save)) {
+		name = strtok(item, ":");
+		w = strtok(NULL, ":");
+		size = strtok(NULL, ":");
+		for (i = 0; i < NR_END_OPS; i++)
+			if (name && !strcmp(name, endurance_op_names[i]))
+				break;
+		if (i == NR_END_OPS || !w || sscanf(w, "%u", &weight[i]) != 1 ||
+				(size && sscanf(size, "%u", &bs[i]) != 1)) {
+			fprintf(stderr, "bad workload mix entry: %s\n", item);
+			return EINVAL;
+		}
+	}
+	if (!weight[END_SEQ_WRITE] && !weight[END_RAND_WRITE]) {
+		fprintf(stderr, "workload mix has no writes\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static int endurance_load(const char *path, struct endurance_ckpt *ck)
+{
+	FILE *f = fopen(path, "r");
+	int err = 0;
+
+	if (!f)
+		return errno == ENOENT ? ENOENT : (perror(path), errno);
+	if (fread(ck, sizeof(*ck), 1, f) != 1 ||
+			memcmp(ck->magic, ENDURANCE_MAGIC, sizeof(ck->magic)) ||
+			le32toh(ck->version) != 1) {
+		fprintf(stderr, "%s is not an endurance checkpoint\n", path);
+		err = EINVAL;
+	}
+	fclose(f);
+	return err;
+}
+
+/* written to a temporary file and renamed, so a crash leaves the old one */
+static int endurance_save(const char *path, const struct endurance_ckpt *ck)
+{
+	char *tmp;
+	FILE *f;
+	int err = 0;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		return ENOMEM;
+	f = fopen(tmp, "w");
+	if (!f || fwrite(ck, sizeof(*ck), 1, f) != 1 || fflush(f) ||
+						fsync(fileno(f)))
+		err = errno;
+	if (f && fclose(f) && !err)
+		err = errno;
+	if (!err && rename(tmp, path))
+		err = errno;
+	if (err)
+		fprintf(stderr, "saving checkpoint %s: %s\n", path,
+							strerror(err));
+	free(tmp);
+	return err;
+}
+
+static void endurance_sample(const struct endurance_ckpt *ck, __u64 capacity)
+{
+	struct nvme_smart_log smart;
+	char units[U128_STR_LEN];
+	int err;
+
+	printf("%.0f,%llu,%llu,%.4f,", le64toh(ck->elapsed) / 1e9,
+		(unsigned long long)le64toh(ck->written),
+		(unsigned long long)le64toh(ck->read),
+		(double)le64toh(ck->written) / capacity);
+	err = nvme_get_log(fd, &smart, sizeof(smart),
+			0x2 | (((sizeof(smart) / 4) - 1) << 16), 0xffffffff);
+	if (err) {
+		printf(",,,\n");
+		fflush(stdout);
+		fprintf(stderr, "smart log: %s\n", err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+		return;
+	}
+	printf("%u,%u,", smart.percent_used, smart.avail_spare);
+	printf("%s,", u128_to_str(int128_to_u128(smart.media_errors),
+								units, 0));
+	printf("%s\n", u128_to_str(int128_to_u128(smart.data_units_written),
+								units, 0));
+	fflush(stdout);
+}
+
+static int endurance(int argc, char **argv)
+{
+	struct endurance_ckpt ck;
+	struct nvme_id_ctrl ctrl;
+	struct sigaction sa;
+	__u32 nsid = 0, interval = 3600, weight[NR_END_OPS], total, pick;
+	__u32 bs[NR_END_OPS] = { 131072, 4096, 4096 };
+	__u64 nsze = 0, capacity = 0, nlb[NR_END_OPS], rate, start;
+	__u64 run_ns, next_sample, seed, slba;
+	double dwpd = 1, days = 1;
+	char mix_default[] = "seqwrite:80,randwrite:20";
+	char *mix = mix_default, *checkpoint = NULL;
+	struct data_pattern pattern;
+	int opt, long_index, err, lba_shift, i, resumed = 0;
+	unsigned int max_bs = 0;
+	void *buf;
 	static struct option opts[] = {
-		{"fw", required_argument, 0, 'f'},
-		{"xfer", required_argument, 0, 'x'},
-		{"offset", required_argument, 0, 'o'},
-		{ 0, 0, 0, 0}
+		{"namespace-id", required_argument, 0, 'n'},
+		{"dwpd", required_argument, 0, 'w'},
+		{"days", required_argument, 0, 'D'},
+		{"capacity", required_argument, 0, 'c'},
+		{"mix", required_argument, 0, 'm'},
+		{"interval", required_argument, 0, 'i'},
+		{"checkpoint", required_argument, 0, 'C'},
+		{"pattern", required_argument, 0, 'P'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "x:f:o:", opts,
-							&long_index)) != -1) {
+	parse_data_pattern("random", &pattern);
+	while ((opt = getopt_long(argc, (char **)argv, "n:w:D:c:m:i:C:P:",
+						opts, &long_index)) != -1) {
 		switch (opt) {
-		case 'f':
-			fw_fd = open(optarg, O_RDONLY);
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'w':
+			get_double(optarg, &dwpd);
+			break;
+		case 'D':
+			get_double(optarg, &days);
+			break;
+		case 'c':
+			get_long(optarg, &capacity);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'i':
+			get_int(optarg, &interval);
 			break;
-		case 'x':
-			get_int(optarg, &xfer_size);
+		case 'C':
+			checkpoint = optarg;
 			break;
-		case 'p':
-			get_int(optarg, &offset);
-			offset <<= 2;
+		case 'P':
+			if (parse_data_pattern(optarg, &pattern))
+				return EINVAL;
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	err = parse_endurance_mix(mix, weight, bs);
+	if (err)
+		return err;
+	if (dwpd <= 0 || days <= 0 || !interval) {
+		fprintf(stderr, "dwpd, days and interval must be positive\n");
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
 
-	if (fw_fd < 0) {
-		fprintf(stderr, "no firmware file provided\n");
-		return EINVAL;
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		return err;
+	for (i = 0, total = 0; i < NR_END_OPS; i++) {
+		if (weight[i] && (!bs[i] || bs[i] % (1 << lba_shift) ||
+					bs[i] >> lba_shift > 65536 ||
+					bs[i] >> lba_shift > nsze)) {
+			fprintf(stderr, "%s size must be a multiple of %d\n",
+				endurance_op_names[i], 1 << lba_shift);
+			return EINVAL;
+		}
+		nlb[i] = bs[i] >> lba_shift;
+		total += weight[i];
+		if (weight[i] && bs[i] > max_bs)
+			max_bs = bs[i];
 	}
-	err = fstat(fw_fd, &sb);
-	if (err < 0) {
-		perror("fstat");
-		exit(errno);
+	if (!capacity && !identify(fd, 0, &ctrl, 1))
+		capacity = int128_to_u128(ctrl.tnvmcap);
+	if (!capacity)
+		capacity = nsze << lba_shift;
+	rate = dwpd * capacity / 86400;
+	if (!rate)
+		rate = 1;
+
+	memset(&ck, 0, sizeof(ck));
+	if (checkpoint) {
+		err = endurance_load(checkpoint, &ck);
+		if (err && err != ENOENT)
+			return err;
+		resumed = !err;
+	}
+	if (!resumed) {
+		memcpy(ck.magic, ENDURANCE_MAGIC, sizeof(ck.magic));
+		ck.version = htole32(1);
+		ck.seed = htole64(now_ns() | 1);
 	}
 
-	fw_size = sb.st_size;
-	if (fw_size & 0x3) {
-		fprintf(stderr, "Invalid size:%d for f/w image\n", fw_size);
-		return EINVAL;
-	} 
-	if (posix_memalign(&fw_buf, getpagesize(), fw_size)) {
-		fprintf(stderr, "No memory for f/w size:%d\n", fw_size);
+	buf = NULL;
+	if (posix_memalign(&buf, getpagesize(), max_bs)) {
+		fprintf(stderr, "can not allocate I/O buffer\n");
 		return ENOMEM;
 	}
-	if (xfer_size % 4096)
-		xfer_size = 4096;
+	seed = le64toh(ck.seed);
+	pattern_seed(&pattern, seed);
 
-	while (fw_size > 0) {
-		xfer_size = min(xfer_size, fw_size);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = endurance_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-		memset(&cmd, 0, sizeof(cmd));
-		cmd.opcode = nvme_admin_download_fw;
-		cmd.addr = (__u64)fw_buf;
-		cmd.data_len = xfer_size;
-		cmd.cdw10 = (xfer_size >> 2) - 1;
-		cmd.cdw11 = offset >> 2; 
+	if (resumed)
+		fprintf(stderr, "resuming after %.0f of %.0f seconds\n",
+				le64toh(ck.elapsed) / 1e9, days * 86400);
+	else
+		printf("elapsed_s,host_written,host_read,drive_writes,"
+			"percent_used,avail_spare,media_errors,"
+			"data_units_written\n");
+	fprintf(stderr, "capacity %llu bytes, writing %llu bytes/s for %g "
+			"drive writes per day\n", (unsigned long long)capacity,
+			(unsigned long long)rate, dwpd);
+	endurance_sample(&ck, capacity);
+
+	run_ns = days * 86400 * 1e9;
+	start = now_ns() - le64toh(ck.elapsed);
+	next_sample = le64toh(ck.elapsed) + interval * 1000000000ULL;
+	i = -1;
+	while (!endurance_stop) {
+		__u64 elapsed = now_ns() - start, due;
+		__u8 opcode;
+
+		ck.elapsed = htole64(elapsed);
+		ck.seed = htole64(seed);
+		if (elapsed >= next_sample || elapsed >= run_ns) {
+			endurance_sample(&ck, capacity);
+			if (checkpoint)
+				endurance_save(checkpoint, &ck);
+			next_sample += interval * 1000000000ULL;
+			if (elapsed >= run_ns)
+				break;
+		}
 
-		err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-		if (err < 0) {
-			perror("ioctl");
-			exit(errno);
-		} else if (err != 0) {
-			fprintf(stderr, "NVME Admin command error:%d\n", err);
+		/* a write held back stays next, so reads keep their share */
+		if (i < 0) {
+			pick = xorshift64(&seed) % total;
+			for (i = 0; pick >= weight[i]; i++)
+				pick -= weight[i];
+		}
+		if (i == END_RAND_READ) {
+			opcode = nvme_cmd_read;
+			slba = xorshift64(&seed) % (nsze - nlb[i] + 1);
+		} else {
+			/* hold writes back until the schedule catches up */
+			due = le64toh(ck.written) * 1e9 / rate;
+			if (due > elapsed) {
+				if (due > next_sample)
+					due = next_sample;
+				if (due > run_ns)
+					due = run_ns;
+				usleep((due - elapsed) / 1000 + 1);
+				continue;
+			}
+			opcode = nvme_cmd_write;
+			if (i == END_SEQ_WRITE) {
+				slba = le64toh(ck.seq_lba);
+				if (slba + nlb[i] > nsze)
+					slba = 0;
+				ck.seq_lba = htole64(slba + nlb[i]);
+			} else
+				slba = xorshift64(&seed) % (nsze - nlb[i] + 1);
+			fill_pattern(&pattern, buf, bs[i]);
+		}
+		err = nvme_io(fd, opcode, nsid, slba, nlb[i], 0, buf, bs[i]);
+		if (err) {
+			fprintf(stderr, "%s at %llu: %s\n", endurance_op_names[i],
+				(unsigned long long)slba, err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+			err = err > 0 ? err : errno;
 			break;
 		}
-		fw_buf += xfer_size;
-		fw_size -= xfer_size;
-		offset += xfer_size;
+		if (opcode == nvme_cmd_write)
+			ck.written = htole64(le64toh(ck.written) + bs[i]);
+		else
+			ck.read = htole64(le64toh(ck.read) + bs[i]);
+		i = -1;
 	}
-	if (!err)
-		printf("Firmware download success\n");
+	ck.seed = htole64(seed);
+	ck.elapsed = htole64(now_ns() - start);
+	if (endurance_stop || err) {
+		endurance_sample(&ck, capacity);
+		if (checkpoint)
+			endurance_save(checkpoint, &ck);
+	}
+	free(buf);
 	return err;
 }
 
-static int fw_activate(int argc, char **argv)
+/*
+ * Read disturb stress: jobs hammer a small hot region with random reads
+ * while the main thread periodically probes the regions on either side of
+ * it, looking for latency drift (more ECC retries) and read errors, and
+ * checks the error log for entries that appeared during the run.
+ */
+struct read_disturb {
+	__u32 nsid;
+	__u64 hot_slba, hot_blocks;
+	__u64 nb_lo, nb_hi, nb_blocks;	/* neighbors: [lo, lo+n), [hi, hi+n) */
+	__u32 nlb, len;
+	volatile int stop;
+};
+
+struct read_disturb_job {
+	struct read_disturb *rd;
+	pthread_t thread;
+	__u64 seed;
+	volatile __u64 reads;
+	volatile __u64 errors;
+};
+
+static void *read_disturb_hammer(void *arg)
 {
-	int opt, err, long_index;
-	unsigned char slot = 0, action = 1;
-	struct nvme_admin_cmd cmd;
+	struct read_disturb_job *job = arg;
+	struct read_disturb *rd = job->rd;
+	__u64 slots = rd->hot_blocks / rd->nlb;
+	void *buf;
+
+	if (posix_memalign(&buf, getpagesize(), rd->len))
+		return NULL;
+	while (!rd->stop) {
+		if (nvme_io(fd, nvme_cmd_read, rd->nsid, rd->hot_slba +
+				xorshift64(&job->seed) % slots * rd->nlb,
+				rd->nlb, 0, buf, rd->len))
+			job->errors++;
+		job->reads++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Reads 'probes' random blocks of each neighbor, timing each. */
+static __u64 read_disturb_probe(struct read_disturb *rd, unsigned int probes,
+					__u64 *seed, struct lat_hist *h, void *buf)
+{
+	__u64 slots = rd->nb_blocks / rd->nlb, slba, start, errors = 0;
+	unsigned int i;
+
+	for (i = 0; i < probes * 2; i++) {
+		slba = (i & 1 ? rd->nb_hi : rd->nb_lo) +
+					xorshift64(seed) % slots * rd->nlb;
+		start = now_ns();
+		if (nvme_io(fd, nvme_cmd_read, rd->nsid, slba, rd->nlb, 0,
+							buf, rd->len)) {
+			errors++;
+			continue;
+		}
+		lat_add(h, now_ns() - start);
+	}
+	return errors;
+}
+
+/*
+ * Reads the error log and reports entries newer than *last, which is then
+ * moved up to the newest error count seen.
+ */
+static int read_disturb_errors(struct nvme_error_log_page *log, int entries,
+						__u64 *last, int show)
+{
+	__u64 newest = *last;
+	int i, err, found = 0;
+
+	err = nvme_get_log(fd, log, entries * sizeof(*log),
+			0x1 | (((entries * sizeof(*log) / 4) - 1) << 16),
+			0xffffffff);
+	if (err)
+		return err > 0 ? -err : -errno;
+	for (i = 0; i < entries; i++) {
+		__u64 count = le64toh(log[i].error_count);
+
+		if (count <= *last)
+			continue;
+		found++;
+		if (count > newest)
+			newest = count;
+		if (show)
+			printf("  error %llu: status %#x (%s) nsid %u lba %llu\n",
+				(unsigned long long)count,
+				le16toh(log[i].status_field) >> 1,
+				nvme_status_to_string(
+					le16toh(log[i].status_field) >> 1),
+				le32toh(log[i].nsid),
+				(unsigned long long)le64toh(log[i].lba));
+	}
+	*last = newest;
+	return found;
+}
+
+static int read_disturb(int argc, char **argv)
+{
+	struct read_disturb rd;
+	struct read_disturb_job *job;
+	struct nvme_error_log_page *elog;
+	struct nvme_id_ctrl ctrl;
+	struct lat_hist *first, *cur;
+	unsigned int secs = 3600, interval = 60, jobs = 1, bs = 4096;
+	unsigned int probes = 64, started = 0, entries;
+	__u64 nsze = 0, hot_bytes = 1 << 20, nb_bytes = 0, seed;
+	__u64 base_err = 0, last_err;
+	__u64 start, now, next, reads, prev_reads = 0, hot_errors, nb_errors = 0;
+	__u64 new_errors = 0, p99_base = 0;
+	int opt, long_index, err, lba_shift, i, n, has_lo, has_hi, check_log = 1;
+	void *buf = NULL;
 	static struct option opts[] = {
-		{"slot", required_argument, 0, 's'},
-		{"action", required_argument, 0, 'a'},
-		{ 0, 0, 0, 0}
+		{"namespace-id", required_argument, 0, 'n'},
+		{"start-block", required_argument, 0, 'b'},
+		{"hot-size", required_argument, 0, 'H'},
+		{"neighbor-size", required_argument, 0, 'N'},
+		{"block-size", required_argument, 0, 's'},
+		{"jobs", required_argument, 0, 'j'},
+		{"time", required_argument, 0, 't'},
+		{"interval", required_argument, 0, 'i'},
+		{"probes", required_argument, 0, 'p'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "s:a:", opts,
-							&long_index)) != -1) {
+	memset(&rd, 0, sizeof(rd));
+	while ((opt = getopt_long(argc, (char **)argv, "n:b:H:N:s:j:t:i:p:",
+						opts, &long_index)) != -1) {
 		switch (opt) {
+		case 'n':
+			get_int(optarg, &rd.nsid);
+			break;
+		case 'b':
+			get_long(optarg, &rd.hot_slba);
+			break;
+		case 'H':
+			get_long(optarg, &hot_bytes);
+			break;
+		case 'N':
+			get_long(optarg, &nb_bytes);
+			break;
 		case 's':
-			get_byte(optarg, &slot);
-			if (slot > 7) {
-				fprintf(stderr, "invalid slot:%d\n", slot);
-				return EINVAL;
-			}
+			get_int(optarg, &bs);
 			break;
-		case 'a':
-			get_byte(optarg, &action);
-			if (action > 3) {
-				fprintf(stderr, "invalid action:%d\n", action);
-				return EINVAL;
-			}
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		case 't':
+			get_int(optarg, &secs);
+			break;
+		case 'i':
+			get_int(optarg, &interval);
+			break;
+		case 'p':
+			get_int(optarg, &probes);
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!jobs || !secs || !interval) {
+		fprintf(stderr, "jobs, time and interval must be non-zero\n");
+		return EINVAL;
+	}
+	if (secs < interval) {
+		fprintf(stderr, "time must be at least one interval\n");
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
 
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.opcode = nvme_admin_activate_fw;
-	cmd.cdw10 = (action << 3) | slot;
+	err = ns_geometry(&rd.nsid, &nsze, &lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536 ||
+						bs > hot_bytes) {
+		fprintf(stderr, "block size must be a multiple of %d and no "
+			"larger than the hot region\n", 1 << lba_shift);
+		return EINVAL;
+	}
+	rd.nlb = bs >> lba_shift;
+	rd.len = bs;
+	rd.hot_blocks = hot_bytes >> lba_shift;
+	if (rd.hot_slba + rd.hot_blocks > nsze) {
+		fprintf(stderr, "hot region is beyond the end of the namespace\n");
+		return EINVAL;
+	}
+	rd.nb_blocks = nb_bytes ? nb_bytes >> lba_shift : rd.hot_blocks;
+	has_lo = rd.nb_blocks <= rd.hot_slba;
+	has_hi = rd.hot_slba + rd.hot_blocks + rd.nb_blocks <= nsze;
+	if (rd.nb_blocks < rd.nlb || (!has_lo && !has_hi)) {
+		fprintf(stderr, "no room for neighbor regions\n");
+		return EINVAL;
+	}
+	/* at an end of the namespace, the one neighbor is probed twice */
+	rd.nb_lo = has_lo ? rd.hot_slba - rd.nb_blocks :
+						rd.hot_slba + rd.hot_blocks;
+	rd.nb_hi = has_hi ? rd.hot_slba + rd.hot_blocks : rd.nb_lo;
+
+	entries = 64;
+	if (!identify(fd, 0, &ctrl, 1) && ctrl.elpe < entries)
+		entries = ctrl.elpe + 1;
+	job = calloc(jobs, sizeof(*job));
+	elog = calloc(entries, sizeof(*elog));
+	first = calloc(1, sizeof(*first));
+	cur = calloc(1, sizeof(*cur));
+	if (!job || !elog || !first || !cur ||
+			posix_memalign(&buf, getpagesize(), bs)) {
+		err = ENOMEM;
+		goto free;
+	}
+	if (read_disturb_errors(elog, entries, &base_err, 0) < 0) {
+		fprintf(stderr, "error log unavailable, not checking it\n");
+		check_log = 0;
+	}
+	last_err = base_err;
+
+	seed = now_ns() | 1;
+	nb_errors = read_disturb_probe(&rd, probes, &seed, first, buf);
+	printf("hot region %llu+%llu blocks, neighbors at %llu and %llu, "
+		"%u jobs\n", (unsigned long long)rd.hot_slba,
+		(unsigned long long)rd.hot_blocks,
+		(unsigned long long)rd.nb_lo, (unsigned long long)rd.nb_hi,
+		jobs);
+	printf("%8s %14s %10s %8s %11s %11s %11s %8s %8s %8s\n", "time(s)",
+		"hot reads", "iops", "errors", "nb p50(us)", "nb p99(us)",
+		"nb max(us)", "p99 drift", "nb errs", "log errs");
+	printf("%8u %14u %10u %8u %11.1f %11.1f %11.1f %8s %8llu %8u\n",
+		0, 0, 0, 0, lat_pct(first, 50) / 1e3, lat_pct(first, 99) / 1e3,
+		first->max / 1e3, "", (unsigned long long)nb_errors, 0);
+	fflush(stdout);
+
+	for (i = 0; i < jobs; i++) {
+		job[i].rd = &rd;
+		job[i].seed = seed + i * 0x9e3779b97f4a7c15ULL;
+		if (pthread_create(&job[i].thread, NULL, read_disturb_hammer,
+								&job[i]))
+			break;
+		started++;
+	}
+	if (!started) {
+		fprintf(stderr, "failed to start read jobs\n");
+		err = EAGAIN;
+		goto free;
+	}
 
-	err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-	if (err < 0)
-		perror("ioctl");
-	else if (err != 0)
-		fprintf(stderr, "NVME Admin command error:%d\n", err);
-	else
-		printf("Success activating firmware action:%d slot:%d\n", action, slot);
+	start = now = now_ns();
+	for (next = start + interval * 1000000000ULL;
+			next <= start + secs * 1000000000ULL;
+			next += interval * 1000000000ULL) {
+		__u64 probe_errors;
+
+		while ((now = now_ns()) < next)
+			usleep((next - now) / 1000 + 1);
+		for (i = 0, reads = 0, hot_errors = 0; i < started; i++) {
+			reads += job[i].reads;
+			hot_errors += job[i].errors;
+		}
+		memset(cur, 0, sizeof(*cur));
+		probe_errors = read_disturb_probe(&rd, probes, &seed, cur, buf);
+		nb_errors += probe_errors;
+		n = check_log ? read_disturb_errors(elog, entries, &last_err, 0)
+									: 0;
+		if (n > 0)
+			new_errors += n;
+		/* drift is against the first sample under load, not idle */
+		if (!p99_base)
+			p99_base = lat_pct(cur, 99);
+		printf("%8llu %14llu %10.0f %8llu %11.1f %11.1f %11.1f "
+			"%+7.1f%% %8llu %8d\n",
+			(unsigned long long)(now - start) / 1000000000ULL,
+			(unsigned long long)reads,
+			(reads - prev_reads) / (double)interval,
+			(unsigned long long)hot_errors,
+			lat_pct(cur, 50) / 1e3, lat_pct(cur, 99) / 1e3,
+			cur->max / 1e3, p99_base ?
+			lat_pct(cur, 99) * 100.0 / p99_base - 100 : 0,
+			(unsigned long long)probe_errors, n > 0 ? n : 0);
+		fflush(stdout);
+		prev_reads = reads;
+	}
+	rd.stop = 1;
+	for (i = 0; i < started; i++)
+		pthread_join(job[i].thread, NULL);
+
+	for (i = 0, hot_errors = 0; i < started; i++)
+		hot_errors += job[i].errors;
+	printf("\n%llu hot region read errors, %llu neighbor read errors, "
+		"%llu new error log entries\n", (unsigned long long)hot_errors,
+		(unsigned long long)nb_errors, (unsigned long long)new_errors);
+	if (new_errors) {
+		printf("error log:\n");
+		read_disturb_errors(elog, entries, &base_err, 1);
+	}
+	if (hot_errors || nb_errors || new_errors)
+		err = EIO;
+ free:
+	free(job);
+	free(elog);
+	free(first);
+	free(cur);
+	free(buf);
 	return err;
 }
 
-static int show_registers(int argc, char **argv)
-{
-	int opt, long_index, pci_fd;
-	char *base, path[512];
-	void *membase;
-	struct nvme_bar *bar;
-	static struct option opts[] = {};
+/*
+ * Workload profile from two SMART logs of a production drive: the command
+ * and data unit counters give the read/write mix and average transfer
+ * sizes, and controller busy time gives utilization. The result is printed
+ * as an endurance command line that replays the mix at the same rate.
+ */
+struct smart_sample {
+	__uint128_t units_read, units_written;
+	__uint128_t reads, writes;
+	__uint128_t busy_min, hours;
+	__u64 capacity;			/* bytes, 0 if unknown */
+};
 
-	while ((opt = getopt_long(argc, (char **)argv, "", opts,
-					&long_index)) != -1);
-	get_dev(optind, argc, argv);
+static void smart_sample_from_log(struct smart_sample *s,
+				const struct nvme_smart_log *smart)
+{
+	s->units_read = int128_to_u128(smart->data_units_read);
+	s->units_written = int128_to_u128(smart->data_units_written);
+	s->reads = int128_to_u128(smart->host_reads);
+	s->writes = int128_to_u128(smart->host_writes);
+	s->busy_min = int128_to_u128(smart->ctrl_busy_time);
+	s->hours = int128_to_u128(smart->power_on_hours);
+}
 
-	if (!S_ISCHR(nvme_stat.st_mode)) {
-		fprintf(stderr, "%s is not character device\n", devicename);
-		exit(ENODEV);
+/*
+ * Loads a sample from a raw SMART log (smart-log --raw-binary) or from the
+ * row of a snapshot file whose device matches 'dev', or its only row.
+ */
+static int smart_sample_load(const char *path, const char *dev,
+						struct smart_sample *s)
+{
+	static const char *names[] = {
+		"data_units_read", "data_units_written", "host_read_commands",
+		"host_write_commands", "controller_busy_time",
+		"power_on_hours", "tnvmcap",
+	};
+	struct snap_col_hdr *cols[ARRAY_SIZE(names)], *dev_col;
+	struct nvme_smart_log smart;
+	struct snap_file sf;
+	__u64 row;
+	FILE *f;
+	int i, err;
+
+	memset(s, 0, sizeof(*s));
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return errno;
 	}
-
-	base = basename(devicename);
-	sprintf(path, "/sys/class/misc/%s/device/resource0", base);
-	pci_fd = open(path, O_RDONLY);
-	if (pci_fd < 0) {
-		fprintf(stderr, "%s did not find a pci resource\n", devicename);
-		exit(ENODEV);
+	i = fread(&smart, 1, sizeof(smart), f);
+	if (i == sizeof(smart) && fgetc(f) == EOF &&
+			memcmp(&smart, SNAP_MAGIC, strlen(SNAP_MAGIC))) {
+		fclose(f);
+		smart_sample_from_log(s, &smart);
+		return 0;
 	}
+	fclose(f);
 
-	membase = mmap(0, getpagesize(), PROT_READ, MAP_SHARED, pci_fd, 0);
-	if (!membase) {
-		fprintf(stderr, "%s failed to map\n", devicename);
-		exit(ENODEV);
+	err = snap_open(path, &sf);
+	if (err)
+		return err;
+	dev_col = snap_find_col(&sf, "dev");
+	for (row = 0; row < sf.nr_rows; row++) {
+		const __u8 *p;
+
+		if (!dev)
+			break;
+		if (!dev_col)
+			continue;
+		p = snap_cell(&sf, dev_col, row);
+		if (snap_cell_strlen(dev_col, p) == strlen(dev) &&
+					!memcmp(p, dev, strlen(dev)))
+			break;
+	}
+	if (row == sf.nr_rows || (!dev && sf.nr_rows != 1)) {
+		fprintf(stderr, "%s: %s\n", path, dev ? "device not found" :
+			"has several devices, pick one with --dev");
+		err = EINVAL;
+		goto close;
+	}
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		cols[i] = snap_find_col(&sf, names[i]);
+		if (!cols[i] && i < ARRAY_SIZE(names) - 1) {
+			fprintf(stderr, "%s: no %s column\n", path, names[i]);
+			err = EINVAL;
+			goto close;
+		}
 	}
+	s->units_read = snap_cell_value(cols[0], snap_cell(&sf, cols[0], row));
+	s->units_written = snap_cell_value(cols[1],
+					snap_cell(&sf, cols[1], row));
+	s->reads = snap_cell_value(cols[2], snap_cell(&sf, cols[2], row));
+	s->writes = snap_cell_value(cols[3], snap_cell(&sf, cols[3], row));
+	s->busy_min = snap_cell_value(cols[4], snap_cell(&sf, cols[4], row));
+	s->hours = snap_cell_value(cols[5], snap_cell(&sf, cols[5], row));
+	if (cols[6])
+		s->capacity = snap_cell_value(cols[6],
+					snap_cell(&sf, cols[6], row));
+ close:
+	snap_close(&sf);
+	return err;
+}
 
-	bar = membase;
-	printf("cap     : %"PRIx64"\n", (uint64_t)bar->cap);
-	printf("version : %x\n", bar->vs);
-	printf("intms   : %x\n", bar->intms);
-	printf("intmc   : %x\n", bar->intmc);
-	printf("cc      : %x\n", bar->cc);
-	printf("csts    : %x\n", bar->csts);
-	printf("nssr    : %x\n", bar->nssr);
-	printf("aqa     : %x\n", bar->aqa);
-	printf("asq     : %"PRIx64"\n", (uint64_t)bar->asq);
-	printf("acq     : %"PRIx64"\n", (uint64_t)bar->acq);
-	printf("cmbloc  : %x\n", bar->cmbloc);
-	printf("cmbsz   : %x\n", bar->cmbsz);
+/* rounds an average transfer size to whole 4KiB, the smallest common LBA */
+static __u32 profile_io_size(double bytes)
+{
+	__u64 n = (bytes + 2048) / 4096;
 
-	return 0;
+	if (!n)
+		n = 1;
+	if (n > 65536 / 8)
+		n = 65536 / 8;
+	return n * 4096;
 }
 
-static int format(int argc, char **argv)
+/*
+ * A share as a weight out of 1000. A share that is there at all keeps at
+ * least 1, as endurance rejects a mix whose writes weigh nothing.
+ */
+static unsigned int profile_weight(double share)
 {
-	int opt, err, long_index;
-	unsigned int nsid = 0xffffffff;
-	unsigned char lbaf = 0, ses = 0, pil = 0, pi = 0, ms = 0;
-	struct nvme_admin_cmd cmd;
+	unsigned int w = share * 1000 + 0.5;
+
+	return share > 0 && !w ? 1 : w;
+}
+
+static int profile_from_smart(int argc, char **argv)
+{
+	struct smart_sample a, b;
+	struct nvme_smart_log smart;
+	struct nvme_id_ctrl ctrl;
+	char *before = NULL, *after = NULL, *dev = NULL;
+	unsigned int interval = 3600, elapsed = 0;
+	double reads, writes, rbytes, wbytes, secs, ratio, per_day;
+	__u64 capacity = 0;
+	int opt, long_index, err;
 	static struct option opts[] = {
-		{"namespace-id", required_argument, 0, 'n'},
-		{"lbaf", required_argument, 0, 'l'},
-		{"ses", required_argument, 0, 's'},
-		{"pil", required_argument, 0, 'p'},
-		{"pi", required_argument, 0, 'i'},
-		{"ms", required_argument, 0, 'm'},
-		{ 0, 0, 0, 0}
+		{"interval", required_argument, 0, 'i'},
+		{"before", required_argument, 0, 'B'},
+		{"after", required_argument, 0, 'A'},
+		{"dev", required_argument, 0, 'd'},
+		{"elapsed", required_argument, 0, 'e'},
+		{"capacity", required_argument, 0, 'c'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:l:s:p:i:m:", opts,
-							&long_index)) != -1) {
+	while ((opt = getopt_long(argc, (char **)argv, "i:B:A:d:e:c:", opts,
+						&long_index)) != -1) {
 		switch (opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		case 'l': get_byte(optarg, &lbaf); break;
-		case 's': get_byte(optarg, &ses); break;
-		case 'p': get_byte(optarg, &pil); break;
-		case 'i': get_byte(optarg, &pi); break;
-		case 'm': get_byte(optarg, &ms); break;
+		case 'i':
+			get_int(optarg, &interval);
+			break;
+		case 'B':
+			before = optarg;
+			break;
+		case 'A':
+			after = optarg;
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'e':
+			get_int(optarg, &elapsed);
+			break;
+		case 'c':
+			get_long(optarg, &capacity);
+			break;
 		default:
 			return EINVAL;
 		}
 	}
-	get_dev(optind, argc, argv);
 
-	if (ms > 1) {
-		fprintf(stderr, "invalid pi:%d\n", ms);
-		return EINVAL;
-	}
-	if (pil > 1) {
-		fprintf(stderr, "invalid pi location:%d\n", pil);
-		return EINVAL;
+	if (before || after) {
+		if (!before || !after) {
+			fprintf(stderr, "both --before and --after are required\n");
+			return EINVAL;
+		}
+		err = smart_sample_load(before, dev, &a);
+		if (!err)
+			err = smart_sample_load(after, dev, &b);
+		if (err)
+			return err;
+		secs = elapsed ? elapsed : (double)(b.hours - a.hours) * 3600;
+	} else {
+		if (!interval) {
+			fprintf(stderr, "interval must be non-zero\n");
+			return EINVAL;
+		}
+		get_dev(optind, argc, argv);
+		memset(&a, 0, sizeof(a));
+		memset(&b, 0, sizeof(b));
+		err = nvme_get_log(fd, &smart, sizeof(smart),
+			0x2 | (((sizeof(smart) / 4) - 1) << 16), 0xffffffff);
+		if (!err) {
+			smart_sample_from_log(&a, &smart);
+			sleep(interval);
+			err = nvme_get_log(fd, &smart, sizeof(smart),
+				0x2 | (((sizeof(smart) / 4) - 1) << 16),
+				0xffffffff);
+			smart_sample_from_log(&b, &smart);
+		}
+		if (err) {
+			if (err > 0)
+				fprintf(stderr, "NVMe Status:%s\n",
+					nvme_status_to_string(err));
+			else
+				perror("smart log");
+			return err > 0 ? err : errno;
+		}
+		if (!identify(fd, 0, &ctrl, 1))
+			b.capacity = int128_to_u128(ctrl.tnvmcap);
+		secs = interval;
+	}
+	if (!capacity)
+		capacity = b.capacity;
+	if (secs <= 0) {
+		fprintf(stderr, "power on hours did not advance, give the time "
+					"between the logs with --elapsed\n");
+		return EINVAL;
+	}
+	if (b.reads < a.reads || b.writes < a.writes ||
+			b.units_read < a.units_read ||
+			b.units_written < a.units_written) {
+		fprintf(stderr, "counters went backwards, are the logs in order "
+					"and from the same drive?\n");
+		return EINVAL;
+	}
+
+	/* data units are thousands of 512 byte units */
+	reads = b.reads - a.reads;
+	writes = b.writes - a.writes;
+	rbytes = (double)(b.units_read - a.units_read) * 512000;
+	wbytes = (double)(b.units_written - a.units_written) * 512000;
+	ratio = reads + writes ? reads / (reads + writes) : 0;
+	per_day = wbytes / secs * 86400;
+
+	printf("interval                : %.0f s\n", secs);
+	printf("read commands           : %.0f (%.1f/s)\n", reads, reads / secs);
+	printf("write commands          : %.0f (%.1f/s)\n", writes,
+								writes / secs);
+	printf("read ratio              : %.1f%%\n", ratio * 100);
+	printf("average read size       : %.0f bytes\n",
+						reads ? rbytes / reads : 0);
+	printf("average write size      : %.0f bytes\n",
+						writes ? wbytes / writes : 0);
+	printf("utilization             : %.1f%%\n",
+		(double)(b.busy_min - a.busy_min) * 60 * 100 / secs);
+	printf("written per day         : %.0f bytes", per_day);
+	if (capacity)
+		printf(" (%.3f drive writes per day)", per_day / capacity);
+	printf("\n");
+
+	if (!writes || !wbytes) {
+		printf("no writes in the interval, nothing to replay\n");
+		return 0;
+	}
+	printf("replay                  : nvme endurance <device> --mix=");
+	if (reads)
+		printf("randread:%u:%u,", profile_weight(ratio),
+					profile_io_size(rbytes / reads));
+	printf("randwrite:%u:%u", profile_weight(1 - ratio),
+					profile_io_size(wbytes / writes));
+	if (capacity)
+		printf(" --dwpd=%.3f --capacity=%llu\n", per_day / capacity,
+						(unsigned long long)capacity);
+	else
+		printf(" --dwpd=1 --capacity=%.0f\n", per_day);
+	return 0;
+}
+
+/*
+ * Data reduction test: writes the same volume of incompressible,
+ * compressible, duplicate and zero data over one region and compares the
+ * throughput and SMART data units written of each. A controller that
+ * compresses or deduplicates is faster, or counts fewer units, for the
+ * data it can reduce. The region is first preconditioned with random
+ * data, which is then written again first and last; the mean of the two
+ * is the baseline, so drift over the test does not count as reduction.
+ */
+#define REDUCTION_TASK		(8 << 20)
+
+struct reduction {
+	__u32 nsid;
+	__u32 bs;
+	int lba_shift;
+	struct data_pattern pattern;
+	__u64 io_ns;
+	volatile int err;
+};
+
+struct reduction_task {
+	struct reduction *rd;
+	__u64 slba;
+	__u64 bytes;
+	__u64 seed;
+};
+
+static void reduction_write(void *arg)
+{
+	struct reduction_task *t = arg;
+	struct reduction *rd = t->rd;
+	struct data_pattern pattern = rd->pattern;
+	__u64 slba = t->slba, left = t->bytes, start, io_ns = 0;
+	__u32 len;
+	void *buf;
+	int err;
+
+	if (posix_memalign(&buf, getpagesize(), rd->bs)) {
+		rd->err = ENOMEM;
+		return;
 	}
-	if (ses > 7) {
-		fprintf(stderr, "invalid secure erase settings:%d\n", ses);
-		return EINVAL;
+	pattern_seed(&pattern, t->seed);
+	for (; left && !rd->err; left -= len, slba += len >> rd->lba_shift) {
+		len = left < rd->bs ? left : rd->bs;
+		fill_pattern(&pattern, buf, len);
+		start = now_ns();
+		err = nvme_io(fd, nvme_cmd_write, rd->nsid, slba,
+				len >> rd->lba_shift, 0, buf, len);
+		io_ns += now_ns() - start;
+		if (err) {
+			fprintf(stderr, "write at %llu: %s\n",
+				(unsigned long long)slba, err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+			rd->err = err > 0 ? err : errno;
+		}
 	}
-	if (lbaf > 15) {
-		fprintf(stderr, "invalid lbaf:%d\n", lbaf);
-		return EINVAL;
+	__sync_fetch_and_add(&rd->io_ns, io_ns);
+	free(buf);
+}
+
+static int reduction_units(__uint128_t *units)
+{
+	struct nvme_smart_log smart;
+	int err;
+
+	err = nvme_get_log(fd, &smart, sizeof(smart),
+			0x2 | (((sizeof(smart) / 4) - 1) << 16), 0xffffffff);
+	if (err) {
+		fprintf(stderr, "smart log: %s\n", err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+		return err > 0 ? err : errno;
 	}
-	if (pi > 7) {
-		fprintf(stderr, "invalid pi:%d\n", pi);
+	*units = int128_to_u128(smart.data_units_written);
+	return 0;
+}
+
+/*
+ * Writes 'size' bytes of one pattern from 'slba' on 'jobs' workers, then
+ * flushes. Returns the rate in MB/s and data units written per host byte.
+ * The rate counts only time spent in commands, so patterns that are
+ * cheaper to generate do not look faster.
+ */
+static int reduction_pass(struct reduction *rd, const char *pattern,
+			__u64 slba, __u64 size, int jobs, __u64 seed,
+			double *mbps, double *unit_ratio)
+{
+	struct reduction_task *tasks;
+	__uint128_t before, after;
+	struct exec ex;
+	__u64 start, i, nr = (size + REDUCTION_TASK - 1) / REDUCTION_TASK;
+	int err;
+
+	if (parse_data_pattern(pattern, &rd->pattern))
 		return EINVAL;
+	if (jobs > nr)
+		jobs = nr;
+	tasks = calloc(nr, sizeof(*tasks));
+	if (!tasks)
+		return ENOMEM;
+	err = reduction_units(&before);
+	if (err)
+		goto free;
+	err = exec_start(&ex, jobs);
+	if (err)
+		goto free;
+
+	rd->err = 0;
+	rd->io_ns = 0;
+	for (i = 0; i < nr; i++) {
+		tasks[i].rd = rd;
+		tasks[i].slba = slba + (i * REDUCTION_TASK >> rd->lba_shift);
+		tasks[i].bytes = i + 1 < nr ? REDUCTION_TASK :
+						size - i * REDUCTION_TASK;
+		tasks[i].seed = seed + i;
+		err = exec_submit(&ex, reduction_write, &tasks[i]);
+		if (err)
+			break;
 	}
-	if (S_ISBLK(nvme_stat.st_mode)) {
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			fprintf(stderr,
-				"%s: failed to return namespace id\n",
-				devicename);
-			return errno;
-		}
+	exec_stop(&ex);
+	if (!err)
+		err = rd->err;
+	start = now_ns();
+	if (!err) {
+		err = nvme_io(fd, nvme_cmd_flush, rd->nsid, 0, 1, 0, NULL, 0);
+		if (err < 0)
+			err = errno;
 	}
+	if (err)
+		goto free;
+	*mbps = size / ((rd->io_ns / (double)jobs + now_ns() - start) / 1e9) /
+									1e6;
 
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.opcode = nvme_admin_format_nvm;
-	cmd.nsid = nsid;
-	cmd.cdw10 = (lbaf << 0) | (ms << 4) | (pi << 5) | (pil << 8) | (ses << 9);
-	
-	err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-	if (err < 0)
-		perror("ioctl");
-	else if (err != 0)
-		fprintf(stderr, "NVME Admin command error:%s(%d)\n",
-					nvme_status_to_string(err), err);
-	else {
-		printf("Success formatting namespace:%x\n", nsid);
-		ioctl(fd, BLKRRPART);
-	}
+	err = reduction_units(&after);
+	if (!err)
+		*unit_ratio = (double)(after - before) * 512000 / size;
+ free:
+	free(tasks);
 	return err;
 }
 
-/* FIXME: read a buffer from a file if the feature requires one */
-static int set_feature(int argc, char **argv)
+static int data_reduction(int argc, char **argv)
 {
-	int opt, err, long_index = 0, val = -1;
-	unsigned int f, v, result, nsid = 0, data_len = 0;
-	void *buf = NULL;
+	struct reduction rd;
+	char compress[32], dedupe[32];
+	const char *patterns[] = { "random", compress, dedupe, "zero",
+								"random" };
+	double mbps[ARRAY_SIZE(patterns)], units[ARRAY_SIZE(patterns)];
+	double ratio = 2, base_mbps, base_units, threshold = 10;
+	unsigned int dup_pct = 50, jobs = 4;
+	__u64 nsze = 0, slba = 0, size = 1ULL << 30, seed;
+	int opt, long_index, err, i, compresses, dedupes;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"feature-id", required_argument, 0, 'f'},
-		{"value", required_argument, 0, 'v'},
-		{"data-len", required_argument, 0, 'l'},
+		{"start-block", required_argument, 0, 'b'},
+		{"size", required_argument, 0, 'z'},
+		{"block-size", required_argument, 0, 's'},
+		{"jobs", required_argument, 0, 'j'},
+		{"ratio", required_argument, 0, 'r'},
+		{"duplicates", required_argument, 0, 'd'},
+		{"threshold", required_argument, 0, 't'},
 		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:f:l:v:", opts,
-							&long_index)) != -1) {
+	memset(&rd, 0, sizeof(rd));
+	rd.bs = 131072;
+	while ((opt = getopt_long(argc, (char **)argv, "n:b:z:s:j:r:d:t:",
+						opts, &long_index)) != -1) {
 		switch (opt) {
 		case 'n':
-			get_int(optarg, &nsid);
+			get_int(optarg, &rd.nsid);
 			break;
-		case 'f':
-			get_int(optarg, &f);
+		case 'b':
+			get_long(optarg, &slba);
 			break;
-		case 'l':
-			get_int(optarg, &data_len);
+		case 'z':
+			get_long(optarg, &size);
 			break;
-		case 'v':
-			get_int(optarg, &v);
-			val = (int)v;
+		case 's':
+			get_int(optarg, &rd.bs);
+			break;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
+		case 'r':
+			get_double(optarg, &ratio);
+			break;
+		case 'd':
+			get_int(optarg, &dup_pct);
+			break;
+		case 't':
+			get_double(optarg, &threshold);
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (ratio < 1 || dup_pct > 100 || !jobs) {
+		fprintf(stderr, "ratio must be at least 1, duplicates at most "
+					"100 and jobs non-zero\n");
+		return EINVAL;
+	}
+	snprintf(compress, sizeof(compress), "compress:%g", ratio);
+	snprintf(dedupe, sizeof(dedupe), "dedupe:%u", dup_pct);
 	get_dev(optind, argc, argv);
-	if (val == -1) {
-		fprintf(stderr, "feature value required param\n");
+
+	err = ns_geometry(&rd.nsid, &nsze, &rd.lba_shift);
+	if (err)
+		return err;
+	if (!rd.bs || rd.bs % (1 << rd.lba_shift) ||
+				rd.bs >> rd.lba_shift > 65536 ||
+				REDUCTION_TASK % rd.bs) {
+		fprintf(stderr, "block size must be a multiple of %d that "
+			"divides %d\n", 1 << rd.lba_shift, REDUCTION_TASK);
 		return EINVAL;
 	}
-	if (!f) {
-		fprintf(stderr, "feature-id required param\n");
+	if (!size || size % rd.bs ||
+			slba + (size >> rd.lba_shift) > nsze) {
+		fprintf(stderr, "size must be a multiple of the block size "
+					"and fit in the namespace\n");
 		return EINVAL;
 	}
-	if (f == NVME_FEAT_LBA_RANGE)
-		data_len = 4096;
-	if (data_len)
-		buf = malloc(data_len);
 
-	err = nvme_feature(nvme_admin_set_features, buf, data_len, f, nsid, v, &result);
-	if (!err) {
-		printf("set-feature:%d(%s), value:%#08x\n", f,
-			nvme_feature_to_string(f), result);
-		if (buf) {
-			if (f == NVME_FEAT_LBA_RANGE)
-				show_lba_range((struct nvme_lba_range_type *)buf,
-								result);
-			else
-				d(buf, data_len, 16, 1);
-		}
+	seed = now_ns();
+	err = reduction_pass(&rd, "random", slba, size, jobs, seed,
+						&mbps[0], &units[0]);
+	if (err)
+		return err;
+	printf("%-16s %10s %14s\n", "pattern", "MB/s", "units/host");
+	for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+		seed += size / REDUCTION_TASK + 1;
+		err = reduction_pass(&rd, patterns[i], slba, size, jobs,
+						seed, &mbps[i], &units[i]);
+		if (err)
+			return err;
+		printf("%-16s %10.1f %14.3f\n", patterns[i], mbps[i], units[i]);
+		fflush(stdout);
 	}
-	else if (err > 0)
-		fprintf(stderr, "NVMe Status: %s\n", nvme_status_to_string(err));
-	if (buf)
-		free(buf);
-	return err;
+
+	base_mbps = (mbps[0] + mbps[4]) / 2;
+	base_units = (units[0] + units[4]) / 2;
+	if (fabs(mbps[0] - mbps[4]) > base_mbps * threshold / 100)
+		printf("\nrandom data rate moved %.1f%% during the test, the "
+			"results are unreliable\n",
+			fabs(mbps[4] - mbps[0]) * 100 / base_mbps);
+	compresses = mbps[1] > base_mbps * (1 + threshold / 100) ||
+			units[1] < base_units * (1 - threshold / 100);
+	dedupes = mbps[2] > base_mbps * (1 + threshold / 100) ||
+			units[2] < base_units * (1 - threshold / 100);
+	printf("\ncompression    : %s (%+.1f%% MB/s, %+.1f%% units)\n",
+		compresses ? "likely" : "not detected",
+		mbps[1] * 100 / base_mbps - 100,
+		base_units ? units[1] * 100 / base_units - 100 : 0);
+	printf("deduplication  : %s (%+.1f%% MB/s, %+.1f%% units)\n",
+		dedupes ? "likely" : "not detected",
+		mbps[2] * 100 / base_mbps - 100,
+		base_units ? units[2] * 100 / base_units - 100 : 0);
+	printf("zero detection : %s (%+.1f%% MB/s, %+.1f%% units)\n",
+		mbps[3] > base_mbps * (1 + threshold / 100) ||
+		units[3] < base_units * (1 - threshold / 100) ?
+						"likely" : "not detected",
+		mbps[3] * 100 / base_mbps - 100,
+		base_units ? units[3] * 100 / base_units - 100 : 0);
+	return 0;
 }
 
-static int sec_send(int argc, char **argv)
+/*
+ * Read cache sizing: for working sets doubling from 'min' to 'max', reads
+ * the whole set once to warm any cache, then times random reads within
+ * it. While the set fits in a controller read cache the reads hit and
+ * are fast; past it the mean rises towards the media latency. With LRU
+ * and uniform random reads the hit rate of a set larger than the cache is
+ * cache / set, so each set past the step also gives a size estimate.
+ */
+struct read_cache_step {
+	__u64 bytes;
+	double mean;
+	__u64 p50, p99;
+};
+
+static int read_cache_set(__u32 nsid, __u64 slba, __u64 blocks, __u32 nlb,
+		int lba_shift, unsigned int samples, __u64 *seed, void *buf,
+		struct read_cache_step *step)
 {
-	struct stat sb;
-	struct nvme_admin_cmd cmd;
-        int err, sec_fd = -1, opt, long_index = 0;
-	void *sec_buf;
-	unsigned int tl = 0;
-	unsigned short spsp = 0;
-	unsigned char secp = 0;
-	unsigned int sec_size;
+	struct lat_hist *h;
+	__u64 b, start;
+	unsigned int i;
+	int err;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return ENOMEM;
+	for (b = 0; b + nlb <= blocks; b += nlb) {
+		err = nvme_io(fd, nvme_cmd_read, nsid, slba + b, nlb, 0, buf,
+							nlb << lba_shift);
+		if (err)
+			goto out;
+	}
+	for (i = 0; i < samples; i++) {
+		b = xorshift64(seed) % (blocks / nlb) * nlb;
+		start = now_ns();
+		err = nvme_io(fd, nvme_cmd_read, nsid, slba + b, nlb, 0, buf,
+							nlb << lba_shift);
+		if (err)
+			goto out;
+		lat_add(h, now_ns() - start);
+	}
+	step->bytes = blocks << lba_shift;
+	step->mean = (double)h->sum / h->count;
+	step->p50 = lat_pct(h, 50);
+	step->p99 = lat_pct(h, 99);
+ out:
+	if (err)
+		fprintf(stderr, "read at %llu: %s\n",
+			(unsigned long long)(slba + b), err > 0 ?
+			nvme_status_to_string(err) : strerror(errno));
+	free(h);
+	return err > 0 ? err : err ? errno : 0;
+}
+
+static int read_cache(int argc, char **argv)
+{
+	struct read_cache_step steps[64];
+	__u64 nsze = 0, slba = 0, min = 1 << 20, max = 1ULL << 30, bytes;
+	__u64 seed, est_sum = 0;
+	unsigned int bs = 4096, samples = 2000, nr = 0, i, jump, nr_est = 0;
+	double step_pct = 50, hit, miss, h;
+	int opt, long_index, err, lba_shift;
+	void *buf = NULL;
+	__u32 nsid = 0;
 	static struct option opts[] = {
-		{"file", required_argument, 0, 'f'},
-		{"secp", required_argument, 0, 'p'},
-		{"spsp", required_argument, 0, 's'},
-		{"tl", required_argument, 0, 't'},
-		{ 0, 0, 0, 0}
+		{"namespace-id", required_argument, 0, 'n'},
+		{"start-block", required_argument, 0, 'b'},
+		{"block-size", required_argument, 0, 's'},
+		{"min", required_argument, 0, 'm'},
+		{"max", required_argument, 0, 'M'},
+		{"samples", required_argument, 0, 'S'},
+		{"step", required_argument, 0, 't'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "f:p:s:t:", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'f':
-			sec_fd = open(optarg, O_RDONLY);
+	while ((opt = getopt_long(argc, (char **)argv, "n:b:s:m:M:S:t:",
+						opts, &long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
 			break;
-		case 'p':
-			get_short(optarg, &spsp);
+		case 'b':
+			get_long(optarg, &slba);
 			break;
 		case 's':
-			get_byte(optarg, &secp);
+			get_int(optarg, &bs);
+			break;
+		case 'm':
+			get_long(optarg, &min);
+			break;
+		case 'M':
+			get_long(optarg, &max);
+			break;
+		case 'S':
+			get_int(optarg, &samples);
 			break;
 		case 't':
-			get_int(optarg, &tl);
+			get_double(optarg, &step_pct);
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!samples || step_pct <= 0) {
+		fprintf(stderr, "samples and step must be positive\n");
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
 
-	if (sec_fd < 0) {
-		fprintf(stderr, "no firmware file provided\n");
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536 ||
+								min < bs) {
+		fprintf(stderr, "block size must be a multiple of %d and no "
+				"larger than --min\n", 1 << lba_shift);
 		return EINVAL;
 	}
-	err = fstat(sec_fd, &sb);
-	if (err < 0) {
-		perror("fstat");
-		return errno;
+	if (slba >= nsze)
+		return EINVAL;
+	if (max > (nsze - slba) << lba_shift)
+		max = (nsze - slba) << lba_shift;
+	if (min > max) {
+		fprintf(stderr, "--min is beyond the end of the namespace\n");
+		return EINVAL;
 	}
-	sec_size = sb.st_size;
-	if (posix_memalign(&sec_buf, getpagesize(), sec_size)) {
-		fprintf(stderr, "No memory for security size:%d\n", sec_size);
+	if (posix_memalign(&buf, getpagesize(), bs))
 		return ENOMEM;
-	}
 
-        memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_admin_security_send;
-        cmd.cdw10 = secp << 24 | spsp << 8;
-        cmd.cdw11 = tl;
-        cmd.data_len = sec_size;
-        cmd.addr = (__u64)sec_buf;
+	memset(steps, 0, sizeof(steps));
+	printf("%14s %10s %10s %10s\n", "working set", "mean(us)", "p50(us)",
+								"p99(us)");
+	seed = now_ns() | 1;
+	for (bytes = min; bytes <= max && nr < ARRAY_SIZE(steps); bytes *= 2) {
+		err = read_cache_set(nsid, slba, bytes >> lba_shift,
+				bs >> lba_shift, lba_shift, samples, &seed,
+				buf, &steps[nr]);
+		if (err)
+			goto free;
+		printf("%14llu %10.1f %10.1f %10.1f\n",
+			(unsigned long long)steps[nr].bytes,
+			steps[nr].mean / 1e3, steps[nr].p50 / 1e3,
+			steps[nr].p99 / 1e3);
+		fflush(stdout);
+		nr++;
+	}
 
-        err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME Security Send Command Error:%d\n", err);
+	/* the step is found on medians, which ignore scheduling noise */
+	hit = steps[0].mean;
+	miss = steps[nr - 1].mean;
+	for (jump = 0; jump < nr; jump++)
+		if (steps[jump].p50 > steps[0].p50 * (1 + step_pct / 100))
+			break;
+	printf("\n");
+	if (jump == nr) {
+		printf("no latency step up to %llu bytes: no read cache, or "
+			"one at least that large with %.1fus hits\n",
+			(unsigned long long)steps[nr - 1].bytes, hit / 1e3);
+		goto free;
+	}
+	for (i = jump; i < nr; i++) {
+		h = (miss - steps[i].mean) / (miss - hit);
+		if (h > 0.1 && h < 0.9) {
+			est_sum += h * steps[i].bytes;
+			nr_est++;
+		}
+	}
+	printf("hit latency    : %.1f us\n", hit / 1e3);
+	printf("miss latency   : %.1f us%s\n", miss / 1e3,
+		nr - jump < 3 ? " (may still include hits, try a larger --max)"
+									: "");
+	printf("latency step   : between %llu and %llu bytes\n",
+		(unsigned long long)(jump ? steps[jump - 1].bytes : 0),
+		(unsigned long long)steps[jump].bytes);
+	if (nr_est)
+		printf("estimated size : %llu bytes\n",
+				(unsigned long long)(est_sum / nr_est));
 	else
-                printf("NVME Security Send Command Success:%d\n", cmd.result);
-        return err;
+		printf("estimated size : about %llu bytes\n",
+			(unsigned long long)(jump ? steps[jump - 1].bytes : 0));
+ free:
+	free(buf);
+	return err;
 }
 
-static int flush(int argc, char **argv)
-{
-	struct nvme_passthru_cmd cmd;
-	unsigned int nsid = 0xffffffff;
-        int err, opt, long_index = 0;
+/*
+ * Alignment penalties: runs the same random I/O at aligned offsets, then
+ * at offsets off 4KiB, from a buffer off the LBA size, and straddling the
+ * namespace atomic boundaries Identify Namespace reports, and compares
+ * each against the aligned run.
+ */
+struct align_case {
+	char name[32];
+	__u64 base;		/* first position, in blocks */
+	__u64 unit;		/* positions are base + k * unit + offset */
+	__u64 offset;
+	unsigned int buf_off;	/* bytes into the page aligned buffer */
+};
 
-	static struct option opts[] = {
-		{"namespace-id", required_argument, 0, 'n'},
-		{ 0, 0, 0, 0}
-	};
+static int align_run(const struct align_case *ac, __u32 nsid, __u8 opcode,
+		__u64 nsze, __u32 nlb, int lba_shift, unsigned int count,
+		__u64 *seed, __u8 *buf, struct lat_hist *h)
+{
+	__u64 slots, slba = 0, start;
+	unsigned int i;
+	int err;
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		default:
-			return EINVAL;
+	if (ac->base + ac->offset + nlb > nsze)
+		return ERANGE;
+	slots = (nsze - ac->base - ac->offset - nlb) / ac->unit + 1;
+	for (i = 0; i < count; i++) {
+		slba = ac->base + xorshift64(seed) % slots * ac->unit +
+								ac->offset;
+		start = now_ns();
+		err = nvme_io(fd, opcode, nsid, slba, nlb, 0,
+				buf + ac->buf_off, nlb << lba_shift);
+		if (err) {
+			fprintf(stderr, "%s at %llu: %s\n", ac->name,
+				(unsigned long long)slba, err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+			return err > 0 ? err : errno;
 		}
+		lat_add(h, now_ns() - start);
 	}
-	get_dev(optind, argc, argv);
-
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.opcode = nvme_cmd_flush;
-	cmd.nsid = nsid;
-
-	err = ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
-	if (err < 0)
-		return errno;
-	else if (err != 0)
-		fprintf(stderr, "NVME IO command error:%s(%d)\n",
-				nvme_status_to_string(err), err);
-	else
-		printf("NVMe Flush: success\n");
 	return 0;
 }
 
-static int resv_acquire(int argc, char **argv)
+/* Adds the inside and straddling cases of one kind of atomic boundary. */
+static int align_boundary_cases(struct align_case *cases, int nr,
+		const char *name, __u16 nabs, __u16 nabo, __u32 nlb)
 {
-	struct nvme_passthru_cmd cmd;
-        int err, opt, long_index = 0;
-	unsigned int nsid = 0;
-	unsigned char rtype = 0, racqa = 0, iekey = 0;
+	__u64 size = (__u64)nabs + 1;
+
+	if (!nabs)
+		return nr;
+	if (nlb > size || nlb < 2) {
+		printf("%s boundary every %llu blocks: I/O of %u blocks "
+			"can not both fit inside and straddle it\n", name,
+			(unsigned long long)size, nlb);
+		return nr;
+	}
+	snprintf(cases[nr].name, sizeof(cases[nr].name), "inside %s", name);
+	cases[nr].base = nabo;
+	cases[nr].unit = size;
+	nr++;
+	snprintf(cases[nr].name, sizeof(cases[nr].name), "across %s", name);
+	cases[nr].base = nabo;
+	cases[nr].unit = size;
+	cases[nr].offset = size - nlb / 2;
+	return nr + 1;
+}
+
+static int alignment(int argc, char **argv)
+{
+	struct align_case cases[8];
+	struct data_pattern pattern;
+	struct nvme_id_ns ns;
+	struct lat_hist *h;
+	unsigned int bs = 4096, count = 2000, page = getpagesize();
+	__u64 nsze = 0, seed, t;
+	__u32 nsid = 0, nlb, per4k;
+	double base_mean = 0, mean;
+	char *rw = "read";
+	__u8 opcode, *buf = NULL;
+	int opt, long_index, err, lba_shift, nr = 0, i;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"crkey", required_argument, 0, 'c'},
-		{"prkey", required_argument, 0, 'p'},
-		{"rtype", required_argument, 0, 't'},
-		{"racqa", required_argument, 0, 'a'},
-		{"iekey", no_argument, 0, 'i'},
-		{ 0, 0, 0, 0}
+		{"block-size", required_argument, 0, 's'},
+		{"count", required_argument, 0, 'c'},
+		{"rw", required_argument, 0, 'r'},
+		{0, 0, 0, 0 }
 	};
-	__u64 prkey= 0, crkey = 0, payload[2];
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:a:i", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		case 'c': get_long(optarg, &crkey); break;
-		case 'p': get_long(optarg, &prkey); break;
-		case 't': get_byte(optarg, &rtype); break;
-		case 'a': get_byte(optarg, &racqa); break;
-		case 'i': iekey = 1; break;
+	while ((opt = getopt_long(argc, (char **)argv, "n:s:c:r:", opts,
+						&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 's':
+			get_int(optarg, &bs);
+			break;
+		case 'c':
+			get_int(optarg, &count);
+			break;
+		case 'r':
+			rw = optarg;
+			break;
 		default:
 			return EINVAL;
 		}
 	}
-	get_dev(optind, argc, argv);
-
-	if (!nsid) {
-		if (!S_ISBLK(nvme_stat.st_mode)) {
-			fprintf(stderr,
-				"%s: non-block device requires namespace-id param\n",
-				devicename);
-			exit(ENOTBLK);
-		}
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			fprintf(stderr,
-				"%s: failed to return namespace id\n",
-				devicename);
-			return errno;
-		}
+	if (!strcmp(rw, "read"))
+		opcode = nvme_cmd_read;
+	else if (!strcmp(rw, "write"))
+		opcode = nvme_cmd_write;
+	else {
+		fprintf(stderr, "unknown --rw: %s\n", rw);
+		return EINVAL;
 	}
-	if (racqa > 7) {
-		fprintf(stderr, "invalid racqa:%d\n", racqa);
+	if (!count) {
+		fprintf(stderr, "count must be non-zero\n");
 		return EINVAL;
 	}
+	get_dev(optind, argc, argv);
 
-	payload[0] = crkey;
-	payload[1] = prkey;
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536 ||
+						bs >> lba_shift > nsze) {
+		fprintf(stderr, "block size must be a multiple of %d\n",
+							1 << lba_shift);
+		return EINVAL;
+	}
+	nlb = bs >> lba_shift;
+	err = identify(fd, nsid, &ns, 0);
+	if (err)
+		return err > 0 ? err : errno;
+
+	memset(cases, 0, sizeof(cases));
+	per4k = lba_shift < 12 ? 4096 >> lba_shift : 1;
+	strcpy(cases[nr].name, "aligned");
+	cases[nr++].unit = per4k;
+	if (per4k > 1) {
+		strcpy(cases[nr].name, "4k + 1 block");
+		cases[nr].unit = per4k;
+		cases[nr++].offset = 1;
+	}
+	snprintf(cases[nr].name, sizeof(cases[nr].name), "buffer + %d",
+						(1 << lba_shift) / 2);
+	cases[nr].unit = per4k;
+	cases[nr++].buf_off = (1 << lba_shift) / 2;
+	if (ns.nsfeat & (1 << 1)) {
+		nr = align_boundary_cases(cases, nr, "nabsn",
+				le16toh(ns.nabsn), le16toh(ns.nabo), nlb);
+		if (ns.nabspf != ns.nabsn)
+			nr = align_boundary_cases(cases, nr, "nabspf",
+				le16toh(ns.nabspf), le16toh(ns.nabo), nlb);
+	} else
+		printf("namespace reports no atomic boundaries\n");
 
-	memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_cmd_resv_acquire;
-        cmd.nsid = nsid;
-        cmd.cdw10 = rtype << 8 | iekey << 3 | racqa;
+	h = calloc(1, sizeof(*h));
+	if (!h || posix_memalign((void **)&buf, page, bs + page)) {
+		err = ENOMEM;
+		goto free;
+	}
+	parse_data_pattern("random", &pattern);
+	fill_pattern(&pattern, buf, bs + page);
+
+	printf("%-18s %10s %10s %10s %10s %10s %9s\n", "case", "iops",
+		"MB/s", "mean(us)", "p50(us)", "p99(us)", "penalty");
+	seed = now_ns() | 1;
+	for (i = 0; i < nr; i++) {
+		memset(h, 0, sizeof(*h));
+		t = now_ns();
+		err = align_run(&cases[i], nsid, opcode, nsze, nlb, lba_shift,
+					count, &seed, buf, h);
+		if (err == ERANGE) {
+			printf("%-18s does not fit in the namespace\n",
+							cases[i].name);
+			err = 0;
+			continue;
+		}
+		if (err)
+			goto free;
+		t = now_ns() - t;
+		mean = (double)h->sum / h->count;
+		if (!i)
+			base_mean = mean;
+		printf("%-18s %10.0f %10.1f %10.1f %10.1f %10.1f %+8.1f%%\n",
+			cases[i].name, count / (t / 1e9),
+			(double)count * bs / (t / 1e9) / 1e6, mean / 1e3,
+			lat_pct(h, 50) / 1e3, lat_pct(h, 99) / 1e3,
+			mean * 100 / base_mean - 100);
+		fflush(stdout);
+	}
+ free:
+	free(h);
+	free(buf);
+	return err;
+}
 
-        cmd.addr = (__u64)payload;
-        cmd.data_len = sizeof(payload);
+/*
+ * Thermal throttling: keeps the drive busy with sequential writes while
+ * sampling the composite temperature and write throughput once a second,
+ * then finds where throughput fell away from its early level and relates
+ * that temperature to WCTEMP, CCTEMP and the Temperature Threshold feature.
+ */
+struct thermal {
+	__u32 nsid;
+	__u64 nsze;
+	__u32 nlb, len;
+	unsigned int jobs;
+	volatile int stop;
+};
 
-        err = ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME IO command error:%04x\n", err);
-        else
-                printf("NVME Reservation Acquire success\n");
-	return 0;
+struct thermal_job {
+	struct thermal *th;
+	pthread_t thread;
+	unsigned int index;
+	volatile __u64 bytes;
+	volatile __u64 errors;
+};
+
+struct thermal_sample {
+	double mbps;
+	int temp;		/* kelvin, 0 if the log could not be read */
+};
+
+static void *thermal_write(void *arg)
+{
+	struct thermal_job *job = arg;
+	struct thermal *th = job->th;
+	struct data_pattern pattern;
+	__u64 slots = th->nsze / th->nlb, k = job->index;
+	void *buf;
+
+	if (posix_memalign(&buf, getpagesize(), th->len))
+		return NULL;
+	parse_data_pattern("random", &pattern);
+	fill_pattern(&pattern, buf, th->len);
+	while (!th->stop) {
+		if (nvme_io(fd, nvme_cmd_write, th->nsid, k % slots * th->nlb,
+						th->nlb, 0, buf, th->len))
+			job->errors++;
+		else
+			job->bytes += th->len;
+		k += th->jobs;
+	}
+	free(buf);
+	return NULL;
 }
 
-static int resv_register(int argc, char **argv)
+static int thermal_smart(struct nvme_smart_log *smart)
 {
-	struct nvme_passthru_cmd cmd;
-        int err, opt, long_index = 0;
-	unsigned int nsid = 0;
-	unsigned char rrega = 0, iekey = 0, cptpl = 0;
+	return nvme_get_log(fd, smart, sizeof(*smart),
+			0x2 | (((sizeof(*smart) / 4) - 1) << 16), 0xffffffff);
+}
+
+static int smart_temp(const struct nvme_smart_log *smart)
+{
+	return smart->temperature[0] | smart->temperature[1] << 8;
+}
+
+static int thermal(int argc, char **argv)
+{
+	struct thermal th = { .jobs = 4 };
+	struct thermal_job *job = NULL;
+	struct thermal_sample *s = NULL;
+	struct nvme_smart_log first, smart;
+	struct nvme_id_ctrl ctrl;
+	unsigned int bs = 128 << 10, secs = 600, warmup = 5, i, n = 0;
+	unsigned int started = 0, below = 0, drop = 0, over_wc = 0, over_cc = 0;
+	unsigned int nr_base = 0, nr_after = 0;
+	__u64 start, now, next, bytes, prev_bytes = 0, errors;
+	__u32 result, thresh = 0;
+	double drop_pct = 20, base = 0, after = 0;
+	int opt, long_index, err, lba_shift, max_temp = 0, wctemp, cctemp;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"crkey", required_argument, 0, 'c'},
-		{"nrkey", required_argument, 0, 'k'},
-		{"rrega", required_argument, 0, 'r'},
-		{"cptpl", required_argument, 0, 'p'},
-		{"iekey", required_argument, 0, 'i'},
-		{ 0, 0, 0, 0}
+		{"block-size", required_argument, 0, 's'},
+		{"jobs", required_argument, 0, 'j'},
+		{"time", required_argument, 0, 't'},
+		{"warmup", required_argument, 0, 'w'},
+		{"drop", required_argument, 0, 'd'},
+		{0, 0, 0, 0 }
 	};
-	__u64 nrkey= 0, crkey = 0, payload[2];
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:i:k:", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		case 'c': get_long(optarg, &crkey); break;
-		case 'k': get_long(optarg, &nrkey); break;
-		case 'r': get_byte(optarg, &rrega); break;
-		case 'p': get_byte(optarg, &cptpl); break;
-		case 'i': get_byte(optarg, &iekey); break;
+	while ((opt = getopt_long(argc, (char **)argv, "n:s:j:t:w:d:", opts,
+						&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &th.nsid);
+			break;
+		case 's':
+			get_int(optarg, &bs);
+			break;
+		case 'j':
+			get_int(optarg, &th.jobs);
+			break;
+		case 't':
+			get_int(optarg, &secs);
+			break;
+		case 'w':
+			get_int(optarg, &warmup);
+			break;
+		case 'd':
+			get_double(optarg, &drop_pct);
+			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!th.jobs || !warmup || secs <= warmup + 1 || drop_pct <= 0 ||
+							drop_pct >= 100) {
+		fprintf(stderr, "jobs and warmup must be non-zero, time longer "
+			"than the warmup and drop between 0 and 100\n");
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
 
-	if (!nsid) {
-		if (!S_ISBLK(nvme_stat.st_mode)) {
-			fprintf(stderr,
-				"%s: non-block device requires namespace-id param\n",
-				devicename);
-			exit(ENOTBLK);
-		}
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			fprintf(stderr,
-				"%s: failed to return namespace id\n",
-				devicename);
-			return errno;
-		}
-	}
-	if (iekey > 1) {
-		fprintf(stderr, "invalid iekey:%d\n", iekey);
+	err = ns_geometry(&th.nsid, &th.nsze, &lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536 ||
+						bs >> lba_shift > th.nsze) {
+		fprintf(stderr, "block size must be a multiple of %d\n",
+							1 << lba_shift);
 		return EINVAL;
 	}
-	if (cptpl > 3) {
-		fprintf(stderr, "invalid cptpl:%d\n", cptpl);
-		return EINVAL;
+	th.nlb = bs >> lba_shift;
+	th.len = bs;
+
+	err = identify(fd, 0, &ctrl, 1);
+	if (err)
+		return err > 0 ? err : errno;
+	wctemp = le16toh(ctrl.wctemp);
+	cctemp = le16toh(ctrl.cctemp);
+	if (!nvme_feature(fd, nvme_admin_get_features, NULL, 0,
+				NVME_FEAT_TEMP_THRESH, 0, 0, &result))
+		thresh = result & 0xffff;
+	err = thermal_smart(&first);
+	if (err) {
+		fprintf(stderr, "smart log: %s\n", err > 0 ?
+			nvme_status_to_string(err) : strerror(errno));
+		return err > 0 ? err : errno;
 	}
 
-	payload[0] = crkey;
-	payload[1] = nrkey;
+	job = calloc(th.jobs, sizeof(*job));
+	s = calloc(secs, sizeof(*s));
+	if (!job || !s) {
+		err = ENOMEM;
+		goto free;
+	}
+	printf("wctemp %d C, cctemp %d C, temperature threshold %d C, "
+		"idle %d C, %u jobs of %u byte writes\n",
+		wctemp ? wctemp - 273 : 0, cctemp ? cctemp - 273 : 0,
+		thresh ? (int)thresh - 273 : 0, smart_temp(&first) - 273,
+		th.jobs, bs);
+	printf("%8s %10s %8s %10s %10s %8s\n", "time(s)", "MB/s", "temp(C)",
+		"warn(min)", "crit(min)", "warning");
+
+	for (i = 0; i < th.jobs; i++) {
+		job[i].th = &th;
+		job[i].index = i;
+		if (pthread_create(&job[i].thread, NULL, thermal_write, &job[i]))
+			break;
+		started++;
+	}
+	if (!started) {
+		fprintf(stderr, "failed to start write jobs\n");
+		err = EAGAIN;
+		goto free;
+	}
 
-	memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_cmd_resv_register;
-        cmd.nsid = nsid;
-	cmd.cdw10 = cptpl << 30 | iekey << 3 | rrega;
+	smart = first;
+	start = now_ns();
+	for (next = start + 1000000000ULL; n < secs;
+					next += 1000000000ULL) {
+		while ((now = now_ns()) < next)
+			usleep((next - now) / 1000 + 1);
+		for (i = 0, bytes = 0; i < started; i++)
+			bytes += job[i].bytes;
+		s[n].mbps = (bytes - prev_bytes) / 1e6;
+		prev_bytes = bytes;
+		if (!thermal_smart(&smart))
+			s[n].temp = smart_temp(&smart);
+		printf("%8u %10.1f %8d %10u %10u %8s\n", n + 1, s[n].mbps,
+			s[n].temp ? s[n].temp - 273 : 0,
+			le32toh(smart.warning_temp_time) -
+				le32toh(first.warning_temp_time),
+			le32toh(smart.critical_comp_time) -
+				le32toh(first.critical_comp_time),
+			smart.critical_warning & (1 << 1) ? "temp" : "");
+		fflush(stdout);
+		n++;
+	}
+	th.stop = 1;
+	for (i = 0; i < started; i++)
+		pthread_join(job[i].thread, NULL);
+	for (i = 0, errors = 0; i < started; i++)
+		errors += job[i].errors;
+
+	/*
+	 * The baseline skips the first second, which includes thread start.
+	 * A drop must last three samples so a single stall is not taken for
+	 * throttling.
+	 */
+	for (i = 1; i <= warmup; i++) {
+		base += s[i].mbps;
+		nr_base++;
+	}
+	base /= nr_base;
+	for (i = 0; i < n; i++) {
+		if (s[i].temp > max_temp)
+			max_temp = s[i].temp;
+		if (wctemp && s[i].temp >= wctemp)
+			over_wc++;
+		if (cctemp && s[i].temp >= cctemp)
+			over_cc++;
+		if (i <= warmup || drop)
+			continue;
+		if (s[i].mbps < base * (1 - drop_pct / 100)) {
+			if (++below == 3)
+				drop = i - 2;
+		} else
+			below = 0;
+	}
 
-        cmd.addr = (__u64)payload;
-        cmd.data_len = sizeof(payload);
+	printf("\nbaseline         : %.1f MB/s\n", base);
+	printf("max temperature  : %d C\n", max_temp ? max_temp - 273 : 0);
+	printf("above wctemp     : %u s\n", over_wc);
+	printf("above cctemp     : %u s\n", over_cc);
+	if (!drop) {
+		printf("no sustained throughput drop of %.0f%% in %u s\n",
+							drop_pct, secs);
+		goto done;
+	}
+	for (i = drop; i < n; i++) {
+		after += s[i].mbps;
+		nr_after++;
+	}
+	after /= nr_after;
+	printf("throttled        : %.1f MB/s after %u s, %.1f%% below "
+		"baseline\n", after, drop + 1, 100 - after * 100 / base);
+	if (!s[drop].temp)
+		goto done;
+	printf("drop temperature : %d C", s[drop].temp - 273);
+	if (wctemp)
+		printf(", %+d C from wctemp", s[drop].temp - wctemp);
+	if (thresh)
+		printf(", %+d C from the temperature threshold",
+						s[drop].temp - (int)thresh);
+	printf("\n");
+ done:
+	if (errors) {
+		fprintf(stderr, "%llu writes failed\n",
+					(unsigned long long)errors);
+		err = EIO;
+	}
+ free:
+	free(job);
+	free(s);
+	return err;
+}
 
-        err = ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME IO command error:%04x\n", err);
-        else
-                printf("NVME Reservation  success\n");
-	return 0;
+/*
+ * APST wake latency: idles the controller for growing periods and times
+ * the first read after each, so the idle times where autonomous power
+ * state transitions kick in, and what leaving each state costs, show up
+ * as steps. They are set against the APST table and the power state
+ * descriptors' entry and exit latencies.
+ */
+static int apst_cmp(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int resv_release(int argc, char **argv)
+/* The power state the APST table reaches after 'idle' ms in ps0. */
+static int apst_state(const __u64 *table, __u64 idle)
 {
-	struct nvme_passthru_cmd cmd;
-        int err, opt, long_index = 0;
-	unsigned int nsid = 0;
-	unsigned char rtype = 0, rrela = 0, iekey = 0;
+	__u64 t = 0, itpt;
+	int ps = 0, i;
+
+	for (i = 0; i < 32; i++) {
+		itpt = (le64toh(table[ps]) >> 8) & 0xffffff;
+		if (!itpt || idle < t + itpt)
+			break;
+		t += itpt;
+		ps = (le64toh(table[ps]) >> 3) & 0x1f;
+	}
+	return ps;
+}
+
+static int apst_read(__u32 nsid, __u64 slba, __u32 nlb, void *buf,
+						__u32 len, __u64 *lat)
+{
+	__u64 start = now_ns();
+	int err;
+
+	err = nvme_io(fd, nvme_cmd_read, nsid, slba, nlb, 0, buf, len);
+	*lat = now_ns() - start;
+	if (err)
+		fprintf(stderr, "read: %s\n", err > 0 ?
+			nvme_status_to_string(err) : strerror(errno));
+	return err > 0 ? err : err ? errno : 0;
+}
+
+static int apst(int argc, char **argv)
+{
+	struct nvme_id_ctrl ctrl;
+	__u64 table[32], lat[64], nsze = 0, slba = 0, idle, prev_idle = 0;
+	__u64 min_idle = 1, max_idle = 5000, base;
+	unsigned int bs = 4096, repeat = 5, i, r;
+	double step = 100, extra, prev_extra = 0;
+	__u32 nsid = 0, apste = 0;
+	int opt, long_index, err, lba_shift, ps, prev_ps = 0, steps = 0;
+	void *buf = NULL;
+	static const int series[] = { 1, 2, 5 };
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"crkey", required_argument, 0, 'c'},
-		{"rtype", required_argument, 0, 't'},
-		{"rrela", required_argument, 0, 'a'},
-		{"iekey", required_argument, 0, 'i'},
-		{ 0, 0, 0, 0}
+		{"start-block", required_argument, 0, 'b'},
+		{"block-size", required_argument, 0, 's'},
+		{"min", required_argument, 0, 'm'},
+		{"max", required_argument, 0, 'M'},
+		{"repeat", required_argument, 0, 'r'},
+		{"step", required_argument, 0, 't'},
+		{0, 0, 0, 0 }
 	};
-	__u64 crkey = 0;
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:c:p:t:a:i:", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		case 'c': get_long(optarg, &crkey); break;
-		case 't': get_byte(optarg, &rtype); break;
-		case 'a': get_byte(optarg, &rrela); break;
-		case 'i': get_byte(optarg, &iekey); break;
+	while ((opt = getopt_long(argc, (char **)argv, "n:b:s:m:M:r:t:",
+						opts, &long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'b':
+			get_long(optarg, &slba);
+			break;
+		case 's':
+			get_int(optarg, &bs);
+			break;
+		case 'm':
+			get_long(optarg, &min_idle);
+			break;
+		case 'M':
+			get_long(optarg, &max_idle);
+			break;
+		case 'r':
+			get_int(optarg, &repeat);
+			break;
+		case 't':
+			get_double(optarg, &step);
+			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!repeat || repeat > ARRAY_SIZE(lat) || !min_idle ||
+						min_idle > max_idle) {
+		fprintf(stderr, "repeat must be 1 to %zu and min idle "
+			"non-zero and no more than max\n", ARRAY_SIZE(lat));
+		return EINVAL;
+	}
 	get_dev(optind, argc, argv);
 
-	if (!nsid) {
-		if (!S_ISBLK(nvme_stat.st_mode)) {
-			fprintf(stderr,
-				"%s: non-block device requires namespace-id param\n",
-				devicename);
-			exit(ENOTBLK);
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		return err;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536 ||
+					slba + (bs >> lba_shift) > nsze) {
+		fprintf(stderr, "block size must be a multiple of %d and fit "
+			"in the namespace\n", 1 << lba_shift);
+		return EINVAL;
+	}
+	err = identify(fd, 0, &ctrl, 1);
+	if (err)
+		return err > 0 ? err : errno;
+	if (!(ctrl.apsta & 1)) {
+		fprintf(stderr, "controller does not support APST\n");
+		return EINVAL;
+	}
+	memset(table, 0, sizeof(table));
+	err = nvme_feature(fd, nvme_admin_get_features, table, sizeof(table),
+				NVME_FEAT_AUTO_PST, 0, 0, &apste);
+	if (err) {
+		fprintf(stderr, "get APST feature: %s\n", err > 0 ?
+			nvme_status_to_string(err) : strerror(errno));
+		return err > 0 ? err : errno;
+	}
+	if (posix_memalign(&buf, getpagesize(), bs))
+		return ENOMEM;
+
+	printf("APST %s\n", apste & 1 ? "enabled" : "disabled");
+	printf("%4s %-6s %12s %12s %14s\n", "ps", "type", "enlat(us)",
+						"exlat(us)", "APST");
+	for (i = 0; i <= ctrl.npss && i < 32; i++) {
+		__u64 e = le64toh(table[i]);
+
+		printf("%4u %-6s %12u %12u", i,
+			ctrl.psd[i].flags & (1 << 1) ? "non-op" : "op",
+			le32toh(ctrl.psd[i].entry_lat),
+			le32toh(ctrl.psd[i].exit_lat));
+		if ((e >> 8) & 0xffffff)
+			printf("   ps%llu after %llums",
+				(unsigned long long)(e >> 3) & 0x1f,
+				(unsigned long long)(e >> 8) & 0xffffff);
+		printf("\n");
+	}
+
+	/* back to back reads never leave ps0 */
+	for (r = 0; r < repeat * 4 && r < ARRAY_SIZE(lat); r++) {
+		err = apst_read(nsid, slba, bs >> lba_shift, buf, bs, &lat[r]);
+		if (err)
+			goto free;
+	}
+	qsort(lat, r, sizeof(lat[0]), apst_cmp);
+	base = lat[r / 2];
+	printf("\nbusy read p50: %.1f us\n\n", base / 1e3);
+
+	printf("%10s %12s %12s %12s %10s %12s\n", "idle(ms)", "p50(us)",
+		"max(us)", "extra(us)", "table ps", "exlat(us)");
+	for (i = 0; ; i++) {
+		idle = series[i % 3];
+		for (r = 0; r < i / 3; r++)
+			idle *= 10;
+		if (idle > max_idle)
+			break;
+		if (idle < min_idle)
+			continue;
+		for (r = 0; r < repeat; r++) {
+			__u64 ignore;
+
+			err = apst_read(nsid, slba, bs >> lba_shift, buf, bs,
+								&ignore);
+			if (!err) {
+				usleep(idle * 1000);
+				err = apst_read(nsid, slba, bs >> lba_shift,
+						buf, bs, &lat[r]);
+			}
+			if (err)
+				goto free;
 		}
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			fprintf(stderr,
-				"%s: failed to return namespace id\n",
-				devicename);
+		qsort(lat, repeat, sizeof(lat[0]), apst_cmp);
+		extra = ((double)lat[repeat / 2] - base) / 1e3;
+		ps = apste & 1 ? apst_state(table, idle) : 0;
+		printf("%10llu %12.1f %12.1f %12.1f %10d %12u\n",
+			(unsigned long long)idle, lat[repeat / 2] / 1e3,
+			lat[repeat - 1] / 1e3, extra, ps,
+			ps ? le32toh(ctrl.psd[ps].exit_lat) : 0);
+		fflush(stdout);
+
+		if (prev_idle && extra - prev_extra > step) {
+			printf("%10s step of %.1f us after %llu to %llu ms "
+				"idle", "", extra - prev_extra,
+				(unsigned long long)prev_idle,
+				(unsigned long long)idle);
+			if (ps != prev_ps)
+				printf(", table enters ps%d", ps);
+			else
+				printf(", not in the APST table");
+			printf("\n");
+			steps++;
+		}
+		prev_idle = idle;
+		prev_extra = extra;
+		prev_ps = ps;
+	}
+	if (!steps)
+		printf("\nno first read latency step over %.0f us up to "
+			"%llu ms idle\n", step, (unsigned long long)max_idle);
+ free:
+	free(buf);
+	return err;
+}
+
+/*
+ * Write Uncorrectable error injection. Ranges are given as a list of
+ * <slba>:<blocks> on the command line or one per line in a file, and are
+ * split into commands of at most 65536 blocks.
+ */
+struct lba_range {
+	__u64 slba;
+	__u64 nlb;
+};
+
+static int add_lba_range(const char *s, struct lba_range **ranges,
+					unsigned int *nr, unsigned int *alloc)
+{
+	struct lba_range *r;
+	const char *p = s;
+	char *end;
+
+	if (*nr == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		r = realloc(*ranges, *alloc * sizeof(*r));
+		if (!r)
+			return ENOMEM;
+		*ranges = r;
+	}
+	r = &(*ranges)[*nr];
+	errno = 0;
+	r->slba = strtoull(p, &end, 0);
+	if (end == p || (*end != ':' && *end != ' ' && *end != '\t'))
+		goto bad;
+	p = end + 1;
+	r->nlb = strtoull(p, &end, 0);
+	if (end == p || errno || !r->nlb || r->slba + r->nlb < r->slba)
+		goto bad;
+	while (*end == ' ' || *end == '\t' || *end == '\n')
+		end++;
+	if (*end)
+		goto bad;
+	(*nr)++;
+	return 0;
+ bad:
+	fprintf(stderr, "bad range, want <slba>:<blocks>: %s\n", s);
+	return EINVAL;
+}
+
+static int parse_lba_ranges(char *list, const char *path,
+			struct lba_range **ranges, unsigned int *nr)
+{
+	unsigned int alloc = 0;
+	char line[128], *tok;
+	FILE *f;
+	int err = 0;
+
+	*ranges = NULL;
+	*nr = 0;
+	if (list)
+		for (tok = strtok(list, ","); tok && !err;
+						tok = strtok(NULL, ","))
+			err = add_lba_range(tok, ranges, nr, &alloc);
+	if (path && !err) {
+		f = fopen(path, "r");
+		if (!f) {
+			perror(path);
 			return errno;
 		}
+		while (!err && fgets(line, sizeof(line), f))
+			if (line[0] != '#' && line[strspn(line, " \t\n")])
+				err = add_lba_range(line, ranges, nr, &alloc);
+		fclose(f);
 	}
-	if (iekey > 1) {
-		fprintf(stderr, "invalid iekey:%d\n", iekey);
-		return EINVAL;
+	if (!err && !*nr) {
+		fprintf(stderr, "no ranges given\n");
+		err = EINVAL;
 	}
-	if (rrela > 7) {
-		fprintf(stderr, "invalid rrela:%d\n", rrela);
-		return EINVAL;
+	return err;
+}
+
+/* Checks the ranges fit the namespace and returns the blocks they cover. */
+static int check_lba_ranges(const struct lba_range *r, unsigned int nr,
+					__u64 nsze, __u64 *blocks)
+{
+	unsigned int i;
+
+	for (i = 0, *blocks = 0; i < nr; i++) {
+		if (r[i].slba + r[i].nlb > nsze) {
+			fprintf(stderr, "range %llu:%llu is beyond the end of "
+				"the namespace\n", (unsigned long long)r[i].slba,
+				(unsigned long long)r[i].nlb);
+			return ERANGE;
+		}
+		*blocks += r[i].nlb;
 	}
+	return 0;
+}
 
-	memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_cmd_resv_release;
-        cmd.nsid = nsid;
-	cmd.cdw10 = rtype << 8 | iekey << 3 | rrela;
+struct uncor_batch {
+	__u32 nsid;
+	const struct lba_range *cmds;
+	unsigned int nr;
+	volatile int *err;
+};
 
-        cmd.addr = (__u64)&crkey;
-        cmd.data_len = sizeof(crkey);
+static void uncor_batch(void *arg)
+{
+	struct uncor_batch *b = arg;
+	unsigned int i;
+	int err;
 
-        err = ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME IO command error:%04x\n", err);
-        else
-                printf("NVME Reservation Register success\n");
-	return 0;
+	for (i = 0; i < b->nr && !*b->err; i++) {
+		err = nvme_io(fd, nvme_cmd_write_uncor, b->nsid,
+				b->cmds[i].slba, b->cmds[i].nlb, 0, NULL, 0);
+		if (err) {
+			fprintf(stderr, "write uncorrectable at %llu: %s\n",
+				(unsigned long long)b->cmds[i].slba, err > 0 ?
+				nvme_status_to_string(err) : strerror(errno));
+			*b->err = err > 0 ? err : errno;
+		}
+	}
 }
 
-static int resv_report(int argc, char **argv)
+static int write_uncor(int argc, char **argv)
 {
-	struct nvme_passthru_cmd cmd;
-        int err, opt, long_index = 0, raw = 0;
-	unsigned int nsid = 0, numd = 0x1000 > 2;
-	struct nvme_reservation_status *status;
+	struct lba_range *ranges = NULL, *cmds = NULL;
+	struct uncor_batch *batches = NULL;
+	struct nvme_id_ctrl ctrl;
+	struct exec ex;
+	unsigned int nr, nr_cmds = 0, batch = 64, jobs = 4, nr_batches, i;
+	__u64 nsze = 0, blocks, slba, left, start;
+	__u32 nsid = 0;
+	volatile int io_err = 0;
+	char *list = NULL, *path = NULL;
+	int opt, long_index, err, lba_shift;
 	static struct option opts[] = {
 		{"namespace-id", required_argument, 0, 'n'},
-		{"numd", required_argument, 0, 'd'},
-		{"raw-binary", no_argument, 0, 'b'},
-		{ 0, 0, 0, 0}
+		{"ranges", required_argument, 0, 'r'},
+		{"file", required_argument, 0, 'f'},
+		{"batch", required_argument, 0, 'B'},
+		{"jobs", required_argument, 0, 'j'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "n:d:r", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'n': get_int(optarg, &nsid); break;
-		case 'd': get_int(optarg, &numd); break;
-		case 'r': raw = 0; break;
+	while ((opt = getopt_long(argc, (char **)argv, "n:r:f:B:j:", opts,
+						&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
+			break;
+		case 'r':
+			list = optarg;
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'B':
+			get_int(optarg, &batch);
+			break;
+		case 'j':
+			get_int(optarg, &jobs);
+			break;
 		default:
 			return EINVAL;
 		}
 	}
+	if (!batch || !jobs) {
+		fprintf(stderr, "batch and jobs must be non-zero\n");
+		return EINVAL;
+	}
+	err = parse_lba_ranges(list, path, &ranges, &nr);
+	if (err)
+		return err;
 	get_dev(optind, argc, argv);
 
-	if (!nsid) {
-		if (!S_ISBLK(nvme_stat.st_mode)) {
-			fprintf(stderr,
-				"%s: non-block device requires namespace-id param\n",
-				devicename);
-			exit(ENOTBLK);
-		}
-		nsid = ioctl(fd, NVME_IOCTL_ID);
-		if (nsid <= 0) {
-			fprintf(stderr,
-				"%s: failed to return namespace id\n",
-				devicename);
-			return errno;
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		goto free;
+	err = check_lba_ranges(ranges, nr, nsze, &blocks);
+	if (err)
+		goto free;
+	err = identify(fd, 0, &ctrl, 1);
+	if (err) {
+		err = err > 0 ? err : errno;
+		goto free;
+	}
+	if (!(le16toh(ctrl.oncs) & NVME_CTRL_ONCS_WRITE_UNCORRECTABLE)) {
+		fprintf(stderr, "controller does not support Write "
+							"Uncorrectable\n");
+		err = EINVAL;
+		goto free;
+	}
+
+	cmds = malloc((blocks / 65536 + nr) * sizeof(*cmds));
+	if (!cmds) {
+		err = ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < nr; i++)
+		for (slba = ranges[i].slba, left = ranges[i].nlb; left; ) {
+			cmds[nr_cmds].slba = slba;
+			cmds[nr_cmds].nlb = left < 65536 ? left : 65536;
+			slba += cmds[nr_cmds].nlb;
+			left -= cmds[nr_cmds++].nlb;
 		}
+	nr_batches = (nr_cmds + batch - 1) / batch;
+	if (jobs > nr_batches)
+		jobs = nr_batches;
+	batches = calloc(nr_batches, sizeof(*batches));
+	if (!batches) {
+		err = ENOMEM;
+		goto free;
 	}
-	if (!numd || numd > (0x1000 >> 2))
-		numd = 0x1000 >> 2;
 
-	if (posix_memalign((void **)&status, getpagesize(), numd << 2)) {
-		fprintf(stderr, "No memory for resv report:%d\n", numd << 2);
-		return ENOMEM;
+	start = now_ns();
+	err = exec_start(&ex, jobs);
+	if (err)
+		goto free;
+	for (i = 0; i < nr_batches; i++) {
+		batches[i].nsid = nsid;
+		batches[i].cmds = &cmds[i * batch];
+		batches[i].nr = i + 1 < nr_batches ? batch :
+						nr_cmds - i * batch;
+		batches[i].err = &io_err;
+		err = exec_submit(&ex, uncor_batch, &batches[i]);
+		if (err)
+			break;
 	}
+	exec_stop(&ex);
+	if (!err)
+		err = io_err;
+	if (!err)
+		printf("marked %llu blocks in %u ranges uncorrectable with "
+			"%u commands in %.1f ms\n", (unsigned long long)blocks,
+			nr, nr_cmds, (now_ns() - start) / 1e6);
+ free:
+	free(batches);
+	free(cmds);
+	free(ranges);
+	return err;
+}
 
-	memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_cmd_resv_report;
-        cmd.nsid = nsid;
-        cmd.cdw10 = numd;
+/*
+ * Reads every range in commands of up to 'nlb' blocks, 'count' times, and
+ * sorts the latencies by how each command completed.
+ */
+struct uncor_stats {
+	struct lat_hist read_error;
+	struct lat_hist other_error;
+	struct lat_hist success;
+};
 
-        cmd.addr = (__u64)status;
-        cmd.data_len = numd << 2;
+static int uncor_read_pass(const struct lba_range *r, unsigned int nr,
+		__u32 nsid, __u32 nlb, int lba_shift, __u16 control,
+		unsigned int count, void *buf, struct uncor_stats *st)
+{
+	__u64 slba, left, start, lat;
+	unsigned int i, n;
+	__u32 len;
+	int err;
 
-        err = ioctl(fd, NVME_IOCTL_IO_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME IO command error:%04x\n", err);
-        else {
-		if (!raw) {
-                	printf("NVME Reservation Report success\n");
-			show_nvme_resv_report(status);
-		} else
-			d_raw((unsigned char *)status, numd << 2);
-	}
+	for (n = 0; n < count; n++)
+		for (i = 0; i < nr; i++)
+			for (slba = r[i].slba, left = r[i].nlb; left;
+					slba += len, left -= len) {
+				len = left < nlb ? left : nlb;
+				start = now_ns();
+				err = nvme_io(fd, nvme_cmd_read, nsid, slba, len,
+					control, buf, len << lba_shift);
+				lat = now_ns() - start;
+				if (err < 0) {
+					perror("read");
+					return errno;
+				}
+				if ((err & 0x7ff) == NVME_SC_READ_ERROR)
+					lat_add(&st->read_error, lat);
+				else if (err)
+					lat_add(&st->other_error, lat);
+				else
+					lat_add(&st->success, lat);
+			}
 	return 0;
 }
 
-static int submit_io(int opcode, char *command, int argc, char **argv)
+static void show_uncor_row(const char *name, const struct lat_hist *h)
 {
-	struct nvme_user_io io;
-	void *buffer;
-        int err, opt, dfd = opcode & 1 ? STDIN_FILENO : STDOUT_FILENO,
-	  show = 0, dry_run = 0, long_index = 0;
-	unsigned int data_size = 0;
-	__u8 prinfo = 0;
+	if (!h->count)
+		return;
+	printf("%-14s %10llu %9.1f %9.1f %9.1f %9.1f\n", name,
+		(unsigned long long)h->count, (double)h->sum / h->count / 1e3,
+		lat_pct(h, 50) / 1e3, lat_pct(h, 99) / 1e3, h->max / 1e3);
+}
 
-	/* XXX: metadata ? */
+static int uncor_latency(int argc, char **argv)
+{
+	struct lba_range *ranges = NULL, good;
+	struct uncor_stats *st = NULL, *good_st = NULL;
+	unsigned int nr, bs = 4096, count = 1;
+	__u64 nsze = 0, blocks, good_slba = ~0ULL;
+	__u32 nsid = 0;
+	__u16 control = 0;
+	char *list = NULL, *path = NULL;
+	void *buf = NULL;
+	int opt, long_index, err, lba_shift;
 	static struct option opts[] = {
-		{"start-block", required_argument, 0, 's'},
-		{"block-count", required_argument, 0, 'c'},
-		{"data-size", required_argument, 0, 'z'},
-		{"ref-tag", required_argument, 0, 'r'},
-		{"data", required_argument, 0, 'd'},
-		{"prinfo", required_argument, 0, 'p'},
-		{"app-tag-mask", required_argument, 0, 'm'},
-		{"app-tag", required_argument, 0, 'a'},
+		{"namespace-id", required_argument, 0, 'n'},
+		{"ranges", required_argument, 0, 'r'},
+		{"file", required_argument, 0, 'f'},
+		{"block-size", required_argument, 0, 's'},
+		{"count", required_argument, 0, 'c'},
+		{"good", required_argument, 0, 'g'},
 		{"limited-retry", no_argument, 0, 'l'},
-		{"force-unit-access", no_argument, 0, 'f'},
-		{"show-command", no_argument, 0, 'v'},
-		{"dry-run", no_argument, 0, 'w'},
-		{ 0, 0, 0, 0}
+		{0, 0, 0, 0 }
 	};
 
-	memset(&io, 0, sizeof(io));
-	while ((opt = getopt_long(argc, (char **)argv, "p:s:c:z:r:d:m:a:lfvw", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 's': get_long(optarg, &io.slba); break;
-		case 'c': get_short(optarg, &io.nblocks); break;
-		case 'z': get_int(optarg, &data_size); break;
-		case 'r': get_int(optarg, &io.reftag); break;
-		case 'm': get_short(optarg, &io.appmask); break;
-		case 'a': get_short(optarg, &io.apptag); break;
-		case 'p':
-			get_byte(optarg, &prinfo);
-			if (prinfo > 0xf)
-				return EINVAL;
-			io.control |= (prinfo << 10);
+	while ((opt = getopt_long(argc, (char **)argv, "n:r:f:s:c:g:l", opts,
+						&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
 			break;
-		case 'l':
-			io.control |= NVME_RW_LR;
+		case 'r':
+			list = optarg;
 			break;
 		case 'f':
-			io.control |= NVME_RW_FUA;
+			path = optarg;
 			break;
-		case 'd': 
-		        if (opcode & 1)
-			  dfd = open(optarg, O_RDONLY);		  
-			else
-			  dfd = open(optarg, O_WRONLY | O_CREAT, 660);
-			if (dfd < 0) {
-				perror(optarg);
-				return EINVAL;
-			}
+		case 's':
+			get_int(optarg, &bs);
+			break;
+		case 'c':
+			get_int(optarg, &count);
+			break;
+		case 'g':
+			get_long(optarg, &good_slba);
+			break;
+		case 'l':
+			control |= NVME_RW_LR;
 			break;
-		case 'v': show = 1; break;
-		case 'w': dry_run = 1; break;
 		default:
 			return EINVAL;
 		}
-	};
-	get_dev(optind, argc, argv);
-
-	if (!data_size)	{
-		fprintf(stderr, "data size not provided\n");
-		return EINVAL;
 	}
-	buffer = malloc(data_size);
-	if ((opcode & 1) && read(dfd, (void *)buffer, data_size) < 0) {
-		fprintf(stderr, "failed to read buffer from input file\n");
+	if (!count) {
+		fprintf(stderr, "count must be non-zero\n");
 		return EINVAL;
 	}
+	err = parse_lba_ranges(list, path, &ranges, &nr);
+	if (err)
+		return err;
+	get_dev(optind, argc, argv);
 
-        io.opcode = opcode;
-	io.addr = (__u64)buffer;
-
-	if (show) {
-		printf("opcode       : %02x\n" , io.opcode);
-		printf("flags        : %02x\n" , io.flags);
-		printf("control      : %04x\n" , io.control);
-		printf("nblocks      : %04x\n" , io.nblocks);
-		printf("rsvd         : %04x\n" , io.rsvd);
-		printf("metadata     : %p\n"   , (void *)io.metadata);
-		printf("addr         : %p\n"   , (void *)io.addr);
-		printf("sbla         : %p\n"   , (void *)io.slba);
-		printf("dsmgmt       : %08x\n" , io.dsmgmt);
-		printf("reftag       : %08x\n" , io.reftag);
-		printf("apptag       : %04x\n" , io.apptag);
-		printf("appmask      : %04x\n" , io.appmask);
-		if (dry_run)
-		  goto free_and_return;
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		goto free;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536) {
+		fprintf(stderr, "block size must be a multiple of %d\n",
+							1 << lba_shift);
+		err = EINVAL;
+		goto free;
+	}
+	err = check_lba_ranges(ranges, nr, nsze, &blocks);
+	if (err)
+		goto free;
+	st = calloc(1, sizeof(*st));
+	good_st = calloc(1, sizeof(*good_st));
+	if (!st || !good_st || posix_memalign(&buf, getpagesize(), bs)) {
+		err = ENOMEM;
+		goto free;
 	}
 
-	err = ioctl(fd, NVME_IOCTL_SUBMIT_IO, &io);
-	if (err < 0)
-		perror("ioctl");
-	else if (err)
-		printf("%s:%s(%04x)\n", command, nvme_status_to_string(err), err);
-	else {
-		if (!(opcode & 1) && write(dfd, (void *)buffer, data_size) < 0) {
-			fprintf(stderr, "failed to write buffer to output file\n");
-			return EINVAL;
-		} else
-			printf("%s: success\n", command);
+	err = uncor_read_pass(ranges, nr, nsid, bs >> lba_shift, lba_shift,
+						control, count, buf, st);
+	if (err)
+		goto free;
+	/* the same number of reads of a healthy block, for comparison */
+	if (good_slba != ~0ULL) {
+		good.slba = good_slba;
+		good.nlb = bs >> lba_shift;
+		err = check_lba_ranges(&good, 1, nsze, &blocks);
+		if (!err)
+			err = uncor_read_pass(&good, 1, nsid, bs >> lba_shift,
+				lba_shift, control, st->read_error.count +
+				st->other_error.count + st->success.count,
+				buf, good_st);
+		if (err)
+			goto free;
 	}
- free_and_return:
-	free(buffer);
-	return 0;
-}
 
-static int compare(int argc, char **argv)
-{
-	return submit_io(nvme_cmd_compare, "compare", argc, argv); 
+	printf("%-14s %10s %9s %9s %9s %9s\n", "status", "reads", "mean(us)",
+					"p50(us)", "p99(us)", "max(us)");
+	show_uncor_row("READ_ERROR", &st->read_error);
+	show_uncor_row("other error", &st->other_error);
+	show_uncor_row("success", &st->success);
+	show_uncor_row("good block", &good_st->success);
+	show_uncor_row("good READ_ERR", &good_st->read_error);
+	show_uncor_row("good other", &good_st->other_error);
+	if (st->success.count) {
+		printf("\n%llu reads returned data: those blocks are not "
+			"uncorrectable\n",
+			(unsigned long long)st->success.count);
+		err = EIO;
+	}
+ free:
+	free(st);
+	free(good_st);
+	free(buf);
+	free(ranges);
+	return err;
 }
 
-static int read_cmd(int argc, char **argv)
-{
-	return submit_io(nvme_cmd_read, "read", argc, argv); 
-}
+/*
+ * Error recovery timeout sweep: for each time limited error recovery
+ * value, with and without Limited Retry, reads known bad ranges and
+ * records how long reads take and how many get their data back. A
+ * redundant deployment would rather fail fast and read another copy; a
+ * non-redundant one needs every block it can recover.
+ */
+struct tler_result {
+	__u32 tler;
+	int lr;
+	double recovered;	/* percent of reads that returned data */
+	__u64 p99;
+};
 
-static int write_cmd(int argc, char **argv)
+/* TLER with its unit, or "none" for no limit */
+static const char *tler_str(__u32 tler, char *buf)
 {
-	return submit_io(nvme_cmd_write, "write", argc, argv); 
+	if (!tler)
+		return "none";
+	sprintf(buf, "%u ms", tler * 100);
+	return buf;
 }
 
-static int sec_recv(int argc, char **argv)
+static int tler_sweep(int argc, char **argv)
 {
-	struct nvme_admin_cmd cmd;
-        int err, opt, long_index = 0, raw = 0;
-	void *sec_buf = NULL;
-	unsigned int al = 0;
-	unsigned short spsp = 0;
-	unsigned char secp = 0;
-	unsigned int sec_size = 0;
+	struct lba_range *ranges = NULL;
+	struct tler_result res[2 * 32], *fast = NULL, *safe = NULL;
+	struct uncor_stats *st = NULL;
+	struct lat_hist *all = NULL;
+	unsigned int nr, nr_tler = 0, nr_res = 0, bs = 4096, count = 1, i;
+	__u32 tler[32], nsid = 0, saved, dw11;
+	__u64 nsze = 0, blocks, reads;
+	char *list = NULL, *path = NULL, *tlers = "0,1,2,5,10,20", *tok, t[16];
+	void *buf = NULL;
+	int opt, long_index, err, lba_shift, lr;
 	static struct option opts[] = {
-		{"size", required_argument, 0, 'x'},
+		{"namespace-id", required_argument, 0, 'n'},
+		{"ranges", required_argument, 0, 'r'},
 		{"file", required_argument, 0, 'f'},
-		{"secp", required_argument, 0, 'p'},
-		{"spsp", required_argument, 0, 's'},
-		{"al", required_argument, 0, 't'},
-		{"raw-binary", no_argument, 0, 'b'},
-		{ 0, 0, 0, 0}
+		{"block-size", required_argument, 0, 's'},
+		{"count", required_argument, 0, 'c'},
+		{"tler", required_argument, 0, 'T'},
+		{0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, (char **)argv, "f:p:s:t:", opts,
-							&long_index)) != -1) {
-		switch(opt) {
-		case 'x':
-			get_int(optarg, &sec_size);
+	while ((opt = getopt_long(argc, (char **)argv, "n:r:f:s:c:T:", opts,
+						&long_index)) != -1) {
+		switch (opt) {
+		case 'n':
+			get_int(optarg, &nsid);
 			break;
-		case 'p':
-			get_short(optarg, &spsp);
+		case 'r':
+			list = optarg;
+			break;
+		case 'f':
+			path = optarg;
 			break;
 		case 's':
-			get_byte(optarg, &secp);
+			get_int(optarg, &bs);
 			break;
-		case 't':
-			get_int(optarg, &al);
+		case 'c':
+			get_int(optarg, &count);
 			break;
-		case 'b':
-			raw = 1;
+		case 'T':
+			tlers = optarg;
 			break;
 		default:
 			return EINVAL;
 		}
 	}
+	for (tok = tlers; *tok; ) {
+		char *end;
+		unsigned long v = strtoul(tok, &end, 0);
+
+		if (end == tok || (*end && *end != ',') || v > 0xffff ||
+					nr_tler == ARRAY_SIZE(tler)) {
+			fprintf(stderr, "bad --tler, want up to %zu values of "
+				"0 to 65535: %s\n", ARRAY_SIZE(tler), tlers);
+			return EINVAL;
+		}
+		tler[nr_tler++] = v;
+		tok = *end ? end + 1 : end;
+	}
+	if (!count || !nr_tler) {
+		fprintf(stderr, "count and the TLER list must be non-empty\n");
+		return EINVAL;
+	}
+	err = parse_lba_ranges(list, path, &ranges, &nr);
+	if (err)
+		return err;
 	get_dev(optind, argc, argv);
 
-	if (sec_size) {
-		if (posix_memalign(&sec_buf, getpagesize(), sec_size)) {
-			fprintf(stderr, "No memory for security size:%d\n",
-								sec_size);
-			return ENOMEM;
-		}
+	err = ns_geometry(&nsid, &nsze, &lba_shift);
+	if (err)
+		goto free;
+	if (!bs || bs % (1 << lba_shift) || bs >> lba_shift > 65536) {
+		fprintf(stderr, "block size must be a multiple of %d\n",
+							1 << lba_shift);
+		err = EINVAL;
+		goto free;
+	}
+	err = check_lba_ranges(ranges, nr, nsze, &blocks);
+	if (err)
+		goto free;
+	err = nvme_feature(fd, nvme_admin_get_features, NULL, 0,
+				NVME_FEAT_ERR_RECOVERY, nsid, 0, &saved);
+	if (err) {
+		fprintf(stderr, "get error recovery: %s\n", err > 0 ?
+			nvme_status_to_string(err) : strerror(errno));
+		err = err > 0 ? err : errno;
+		goto free;
+	}
+	st = calloc(1, sizeof(*st));
+	all = calloc(1, sizeof(*all));
+	if (!st || !all || posix_memalign(&buf, getpagesize(), bs)) {
+		err = ENOMEM;
+		goto free;
 	}
 
-        memset(&cmd, 0, sizeof(cmd));
-        cmd.opcode = nvme_admin_security_recv;
-        cmd.cdw10 = secp << 24 | spsp << 8;
-        cmd.cdw11 = al;
-        cmd.data_len = sec_size;
-        cmd.addr = (__u64)sec_buf;
+	printf("%9s %3s %8s %10s %9s %9s %9s %9s\n", "tler", "lr",
+		"reads", "recovered", "mean(us)", "p50(us)", "p99(us)",
+		"max(us)");
+	for (i = 0; i < nr_tler && !err; i++) {
+		dw11 = (saved & ~0xffff) | tler[i];
+		err = nvme_feature(fd, nvme_admin_set_features, NULL, 0,
+				NVME_FEAT_ERR_RECOVERY, nsid, dw11, NULL);
+		if (err) {
+			fprintf(stderr, "set error recovery to %u: %s\n",
+				tler[i], err > 0 ? nvme_status_to_string(err) :
+				strerror(errno));
+			err = err > 0 ? err : errno;
+			break;
+		}
+		for (lr = 0; lr <= 1 && !err; lr++) {
+			memset(st, 0, sizeof(*st));
+			memset(all, 0, sizeof(*all));
+			err = uncor_read_pass(ranges, nr, nsid,
+				bs >> lba_shift, lba_shift, lr ? NVME_RW_LR : 0,
+				count, buf, st);
+			if (err)
+				break;
+			lat_merge(all, &st->read_error);
+			lat_merge(all, &st->other_error);
+			lat_merge(all, &st->success);
+			reads = all->count;
+			res[nr_res].tler = tler[i];
+			res[nr_res].lr = lr;
+			res[nr_res].recovered = st->success.count * 100.0 /
+									reads;
+			res[nr_res].p99 = lat_pct(all, 99);
+			printf("%9s %3s %8llu %9.1f%% %9.1f %9.1f %9.1f %9.1f\n",
+				tler_str(tler[i], t), lr ? "on" : "off",
+				(unsigned long long)reads,
+				res[nr_res].recovered,
+				(double)all->sum / reads / 1e3,
+				lat_pct(all, 50) / 1e3, res[nr_res].p99 / 1e3,
+				all->max / 1e3);
+			fflush(stdout);
+			nr_res++;
+		}
+	}
 
-        err = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
-        if (err < 0)
-                return errno;
-        else if (err != 0)
-                fprintf(stderr, "NVME Security Receivce Command Error:%d\n",
-									err);
-	else {
-		if (!raw) {
-                	printf("NVME Security Receivce Command Success:%d\n",
-							cmd.result);
-			d(sec_buf, sec_size, 16, 1);
-		} else if (sec_size)
-			d_raw((unsigned char *)&sec_buf, sec_size);
+	/* always put the original setting back, even after an error */
+	if (nvme_feature(fd, nvme_admin_set_features, NULL, 0,
+				NVME_FEAT_ERR_RECOVERY, nsid, saved, NULL))
+		fprintf(stderr, "could not restore error recovery to %#x\n",
+									saved);
+	if (err || !nr_res)
+		goto free;
+
+	/*
+	 * Redundant: lowest tail, then most recovered. Non-redundant: most
+	 * recovered, then lowest tail.
+	 */
+	for (i = 0; i < nr_res; i++) {
+		if (!fast || res[i].p99 < fast->p99 ||
+				(res[i].p99 == fast->p99 &&
+				 res[i].recovered > fast->recovered))
+			fast = &res[i];
+		if (!safe || res[i].recovered > safe->recovered ||
+				(res[i].recovered == safe->recovered &&
+				 res[i].p99 < safe->p99))
+			safe = &res[i];
 	}
-        return err;
+	printf("\nredundant     : tler %s, limited retry %s (p99 %.1f us, "
+		"%.1f%% recovered)\n", tler_str(fast->tler, t),
+		fast->lr ? "on" : "off", fast->p99 / 1e3, fast->recovered);
+	printf("non-redundant : tler %s, limited retry %s (p99 %.1f us, "
+		"%.1f%% recovered)\n", tler_str(safe->tler, t),
+		safe->lr ? "on" : "off", safe->p99 / 1e3, safe->recovered);
+ free:
+	free(st);
+	free(all);
+	free(buf);
+	free(ranges);
+	return err;
 }
 
 static int nvme_passthru(int argc, char **argv, int ioctl_cmd)
@@ -2057,7 +8386,7 @@ static int nvme_passthru(int argc, char **argv, int ioctl_cmd)
 		if (dry_run)
 		  return 0;
 	}
-	err = ioctl(fd, ioctl_cmd, &cmd);
+	err = nvme_ioctl(fd, ioctl_cmd, &cmd);
 	if (err >= 0) {
 		if (!raw) {
 			printf("NVMe Status:%s Command Result:%08x\n",